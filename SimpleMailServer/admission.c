@@ -0,0 +1,424 @@
+/* admission.c
+ * Admission control and rate limits for incoming connections.
+ *
+ * Each listener has its own table in an anonymous shared mapping,
+ * created before any connection handler is forked and protected by a
+ * process-shared robust mutex. The listener counts the connections it
+ * admits, overall and per client address, and turns away clients over
+ * the limits with a short reply instead of starting a handler. The
+ * listening process releases a connection when its handler returns
+ * or, with forked handlers, when it reaps the handler, however the
+ * handler ended.
+ *
+ * Client addresses are kept in a set-associative hash table: an
+ * address hashes to a set of WAYS entries, and is looked up only in
+ * that set. Each entry holds the connections of the address and two
+ * token buckets, one for commands and one for received bytes, shared
+ * by all connections from the address. A bucket gains tokens at the
+ * configured rate, up to its burst size, and each command or byte
+ * takes one; a client taking more tokens than the bucket holds is put
+ * to sleep until the debt is repaid, so it is slowed down to the rate.
+ *
+ * Entries age: when an address is not in the table, it replaces an
+ * unused entry of its set or, failing that, the entry without
+ * connections that was used least recently. An address whose set is
+ * full of connected addresses is admitted untracked, subject only to
+ * the overall limit.
+ */
+
+#include "admission.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#define DEFAULT_MAX_CONNECTIONS 512
+#define DEFAULT_MAX_PER_ADDRESS 32
+#define SET_BITS    10
+#define SETS        (1 << SET_BITS)
+#define WAYS        8
+#define NO_ENTRY    UINT32_MAX
+
+struct address_entry {
+    unsigned char addr[16];     // IPv4 addresses are stored IPv4-mapped
+    uint32_t in_use;
+    uint32_t connections;
+    uint64_t last_ms;           // last refill of the buckets
+    double command_tokens;
+    double byte_tokens;
+};
+
+struct admission {
+    pthread_mutex_t mutex;
+    struct admission_limits limits;
+    char reject_reply[128];
+    uint32_t connections;
+    struct address_entry entries[SETS * WAYS];
+};
+
+// Connection being handled by this process, set by admission_attach
+static struct admission_slot current = { NULL, NO_ENTRY };
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** FNV-1a hash of an address.
+ */
+static uint32_t hash_addr(const unsigned char addr[16]) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 16; i++) {
+        h ^= addr[i];
+        h *= 1099511628211ull;
+    }
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+/** Internal function that stores the IP address of a socket address
+ *  as 16 bytes.
+ *
+ *  Returns: 0 on success, -1 if the address is not an IP address.
+ */
+static int address_key(const struct sockaddr *sa, unsigned char addr[16]) {
+    if (sa->sa_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *) sa)->sin6_addr, 16);
+        return 0;
+    }
+    if (sa->sa_family == AF_INET) {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((const struct sockaddr_in *) sa)->sin_addr, 4);
+        return 0;
+    }
+    return -1;
+}
+
+/** Internal function that locks a table. If a process died while
+ *  holding the lock, its update may be incomplete, but every field is
+ *  a count that the next updates bring back in line, so the table is
+ *  kept.
+ */
+static int admission_lock(admission_t admission) {
+    int rv = pthread_mutex_lock(&admission->mutex);
+    if (rv == EOWNERDEAD) {
+        pthread_mutex_consistent(&admission->mutex);
+        rv = 0;
+    }
+    return rv;
+}
+
+static void admission_unlock(admission_t admission) {
+    pthread_mutex_unlock(&admission->mutex);
+}
+
+/** Internal function that finds the entry of an address, or takes
+ *  over an entry for it (see the aging rules above).
+ *
+ *  Returns: Index of the entry, or NO_ENTRY if every entry of the set
+ *           has connections.
+ */
+static uint32_t find_entry(admission_t admission, const unsigned char addr[16], uint64_t now) {
+
+    uint32_t first = (hash_addr(addr) & (SETS - 1)) * WAYS;
+    uint32_t victim = NO_ENTRY;
+
+    for (uint32_t i = first; i < first + WAYS; i++) {
+        struct address_entry *entry = &admission->entries[i];
+        if (!entry->in_use) {
+            if (victim == NO_ENTRY || admission->entries[victim].in_use)
+                victim = i;
+            continue;
+        }
+        if (!memcmp(entry->addr, addr, 16))
+            return i;
+        if (!entry->connections &&
+            (victim == NO_ENTRY || (admission->entries[victim].in_use && entry->last_ms < admission->entries[victim].last_ms)))
+            victim = i;
+    }
+    if (victim == NO_ENTRY)
+        return NO_ENTRY;
+
+    // A new address starts with full buckets
+    struct address_entry *entry = &admission->entries[victim];
+    memcpy(entry->addr, addr, 16);
+    entry->in_use = 1;
+    entry->connections = 0;
+    entry->last_ms = now;
+    entry->command_tokens = admission->limits.command_burst;
+    entry->byte_tokens = admission->limits.byte_burst;
+    return victim;
+}
+
+/** Sets limits to the defaults: a cap on connections, overall and per
+ *  address, and no rate limits.
+ */
+void admission_default_limits(struct admission_limits *limits) {
+    memset(limits, 0, sizeof(*limits));
+    limits->max_connections = DEFAULT_MAX_CONNECTIONS;
+    limits->max_per_address = DEFAULT_MAX_PER_ADDRESS;
+}
+
+/** Internal function that parses a rate with an optional burst size,
+ *  as "rate" or "rate/burst". The burst defaults to one second worth
+ *  of tokens.
+ */
+static int parse_rate(const char *value, unsigned int *rate, unsigned int *burst) {
+    char *end;
+    *rate = strtoul(value, &end, 10);
+    *burst = *rate;
+    if (*end == '/')
+        *burst = strtoul(end + 1, &end, 10);
+    return *end ? -1 : 0;
+}
+
+/** Changes limits from a specification made of comma-separated
+ *  settings, e.g., "max=200,per_ip=8,commands=20/50,bytes=65536":
+ *
+ *    max=N                  connections handled at once
+ *    per_ip=N               connections handled at once per address
+ *    commands=RATE[/BURST]  commands per second per address
+ *    bytes=RATE[/BURST]     received bytes per second per address
+ *
+ *  0 means no limit. Settings not given keep their value.
+ *
+ *  Parameters: spec: Specification to parse.
+ *              limits: Limits to change.
+ *
+ *  Returns: 0 on success, -1 if the specification is not valid.
+ */
+int admission_parse_limits(const char *spec, struct admission_limits *limits) {
+
+    char copy[256];
+    if (strlen(spec) >= sizeof(copy))
+        return -1;
+    strcpy(copy, spec);
+
+    for (char *setting = strtok(copy, ","); setting; setting = strtok(NULL, ",")) {
+        char *value = strchr(setting, '=');
+        if (!value || !value[1])
+            return -1;
+        *value++ = '\0';
+        char *end;
+        if (!strcmp(setting, "max")) {
+            limits->max_connections = strtoul(value, &end, 10);
+            if (*end)
+                return -1;
+        } else if (!strcmp(setting, "per_ip")) {
+            limits->max_per_address = strtoul(value, &end, 10);
+            if (*end)
+                return -1;
+        } else if (!strcmp(setting, "commands")) {
+            if (parse_rate(value, &limits->command_rate, &limits->command_burst) < 0)
+                return -1;
+        } else if (!strcmp(setting, "bytes")) {
+            if (parse_rate(value, &limits->byte_rate, &limits->byte_burst) < 0)
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Creates the admission table of a listener. Must be called before
+ *  any connection handler is forked, so that all processes share it.
+ *
+ *  Parameters: limits: Limits applied to the clients of the listener.
+ *                      The reject reply is copied, and truncated if
+ *                      too long.
+ *
+ *  Returns: The new table, or NULL if it could not be created.
+ */
+admission_t admission_create(const struct admission_limits *limits) {
+
+    void *shared = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return NULL;
+
+    admission_t admission = shared;
+    admission->limits = *limits;
+    if (limits->reject_reply)
+        snprintf(admission->reject_reply, sizeof(admission->reject_reply), "%s", limits->reject_reply);
+    admission->limits.reject_reply = NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&admission->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return admission;
+}
+
+/** Decides whether a new connection may be handled, and if so counts
+ *  it. The connection must then be released with admission_release
+ *  once it is closed; with forked handlers, the listening process does
+ *  so when it reaps the handler, so that a handler that dies does not
+ *  keep its connection counted.
+ *
+ *  Parameters: admission: Table of the listener, or NULL to admit
+ *                         every connection without limits.
+ *              addr: Address of the client.
+ *              slot: Receives the admitted connection.
+ *
+ *  Returns: 0 if the connection is admitted, -1 if it must be
+ *           rejected.
+ */
+int admission_admit(admission_t admission, const struct sockaddr *addr, struct admission_slot *slot) {
+
+    slot->admission = NULL;
+    slot->entry = NO_ENTRY;
+    if (!admission)
+        return 0;
+    if (admission_lock(admission))
+        return 0;
+
+    const struct admission_limits *limits = &admission->limits;
+    if (limits->max_connections && admission->connections >= limits->max_connections) {
+        admission_unlock(admission);
+        return -1;
+    }
+
+    unsigned char key[16];
+    uint32_t index = address_key(addr, key) < 0 ? NO_ENTRY : find_entry(admission, key, now_ms());
+    if (index != NO_ENTRY) {
+        struct address_entry *entry = &admission->entries[index];
+        if (limits->max_per_address && entry->connections >= limits->max_per_address) {
+            admission_unlock(admission);
+            return -1;
+        }
+        entry->connections++;
+    }
+    admission->connections++;
+    admission_unlock(admission);
+
+    slot->admission = admission;
+    slot->entry = index;
+    return 0;
+}
+
+/** Turns a client away: sends the reject reply of the listener,
+ *  without waiting if the socket cannot take it, and closes the
+ *  connection.
+ *
+ *  Parameters: admission: Table of the listener.
+ *              fd: Socket of the rejected connection.
+ */
+void admission_reject(admission_t admission, int fd) {
+    metrics_add(COUNTER_REJECTED_CONNECTIONS, 1);
+    size_t length = strlen(admission->reject_reply);
+    if (length && send(fd, admission->reject_reply, length, MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+        metrics_add(COUNTER_BYTES_OUT, length);
+    close(fd);
+}
+
+/** Makes an admitted connection the connection of this process, to
+ *  which rate limits are applied.
+ *
+ *  Parameters: slot: Connection returned by admission_admit, or NULL
+ *                    to apply no limits.
+ */
+void admission_attach(const struct admission_slot *slot) {
+    current.admission = slot ? slot->admission : NULL;
+    current.entry = slot ? slot->entry : NO_ENTRY;
+}
+
+/** Stops counting an admitted connection, if it was admitted with
+ *  limits. It is no longer the connection of this process.
+ *
+ *  Parameters: slot: Connection returned by admission_admit; it is
+ *                    cleared.
+ */
+void admission_release(struct admission_slot *slot) {
+
+    admission_t admission = slot->admission;
+    if (current.admission == admission && current.entry == slot->entry)
+        admission_attach(NULL);
+    if (!admission || admission_lock(admission))
+        return;
+    if (admission->connections)
+        admission->connections--;
+    if (slot->entry != NO_ENTRY && admission->entries[slot->entry].connections)
+        admission->entries[slot->entry].connections--;
+    admission_unlock(admission);
+    slot->admission = NULL;
+    slot->entry = NO_ENTRY;
+}
+
+/** Internal function that takes tokens from a bucket of the address of
+ *  this connection, and sleeps until the bucket is no longer in debt.
+ *
+ *  Parameters: bytes: Non-zero for the byte bucket, zero for the
+ *                     command bucket.
+ *              count: Number of tokens taken.
+ */
+static void charge(int bytes, size_t count) {
+
+    admission_t admission = current.admission;
+    if (!admission || current.entry == NO_ENTRY)
+        return;
+    const struct admission_limits *limits = &admission->limits;
+    unsigned int rate = bytes ? limits->byte_rate : limits->command_rate;
+    if (!rate || admission_lock(admission))
+        return;
+
+    struct address_entry *entry = &admission->entries[current.entry];
+    uint64_t now = now_ms();
+    double elapsed = now > entry->last_ms ? (now - entry->last_ms) / 1000.0 : 0;
+    entry->last_ms = now;
+
+    // Both buckets are refilled together, as they share the time stamp
+    if (limits->command_rate) {
+        entry->command_tokens += elapsed * limits->command_rate;
+        if (entry->command_tokens > limits->command_burst)
+            entry->command_tokens = limits->command_burst;
+    }
+    if (limits->byte_rate) {
+        entry->byte_tokens += elapsed * limits->byte_rate;
+        if (entry->byte_tokens > limits->byte_burst)
+            entry->byte_tokens = limits->byte_burst;
+    }
+
+    double *tokens = bytes ? &entry->byte_tokens : &entry->command_tokens;
+    *tokens -= count;
+    double wait = *tokens < 0 ? -*tokens / rate : 0;
+    admission_unlock(admission);
+
+    if (wait > 0) {
+        metrics_add(COUNTER_THROTTLED, 1);
+        struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/** Applies the command rate limit of the address of this connection,
+ *  sleeping if the client is over its rate.
+ *
+ *  Parameters: count: Number of commands received.
+ */
+void admission_charge_commands(unsigned int count) {
+    charge(0, count);
+}
+
+/** Applies the byte rate limit of the address of this connection,
+ *  sleeping if the client is over its rate.
+ *
+ *  Parameters: count: Number of bytes received.
+ */
+void admission_charge_bytes(size_t count) {
+    charge(1, count);
+}
@@ -0,0 +1,45 @@
+/* admission.h
+ * Admission control for incoming connections: caps on the number of
+ * connections handled at once, overall and per client address, and
+ * token-bucket limits on the commands and bytes each address sends.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef struct admission *admission_t;
+
+// Limits of a listener; 0 means no limit
+struct admission_limits {
+    unsigned int max_connections;   // handled at once, all clients together
+    unsigned int max_per_address;   // handled at once, from one address
+    unsigned int command_rate;      // commands per second, per address
+    unsigned int command_burst;     // commands allowed at once
+    unsigned int byte_rate;         // bytes received per second, per address
+    unsigned int byte_burst;        // bytes allowed at once
+    const char *reject_reply;       // sent to clients that are turned away
+};
+
+// An admitted connection, counted until it is released
+struct admission_slot {
+    admission_t admission;
+    uint32_t entry;                 // entry of the client address
+};
+
+void admission_default_limits(struct admission_limits *limits);
+int admission_parse_limits(const char *spec, struct admission_limits *limits);
+
+admission_t admission_create(const struct admission_limits *limits);
+int admission_admit(admission_t admission, const struct sockaddr *addr, struct admission_slot *slot);
+void admission_reject(admission_t admission, int fd);
+void admission_attach(const struct admission_slot *slot);
+void admission_release(struct admission_slot *slot);
+
+void admission_charge_commands(unsigned int count);
+void admission_charge_bytes(size_t count);
+
+#endif
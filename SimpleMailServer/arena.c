@@ -0,0 +1,142 @@
+/* arena.c
+ * Bump allocator for memory that lives until a known point.
+ *
+ * Memory is handed out from large blocks and is only given back all
+ * at once by arena_reset. Blocks of the standard size are kept and
+ * reused after a reset, so a session that resets its arena after
+ * each command or transaction stops calling malloc once its blocks
+ * are in place. Requests larger than a block get a block of their
+ * own, which is freed by the next reset.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    // Aligned so that allocations at the start of data are aligned too
+    _Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+struct arena {
+    size_t block_size;
+    struct arena_block *first;
+    struct arena_block *current;
+};
+
+/** Creates a new, empty, arena.
+ *
+ *  Parameters: block_size: Size of the blocks memory is taken from.
+ *                          Should be larger than most allocations.
+ *
+ *  Returns: The new arena, or NULL if out of memory.
+ */
+arena_t arena_create(size_t block_size) {
+    arena_t arena = malloc(sizeof(struct arena));
+    if (!arena)
+        return NULL;
+    arena->block_size = block_size;
+    arena->first = arena->current = NULL;
+    return arena;
+}
+
+/** Internal function that adds a block after the current one.
+ */
+static struct arena_block *add_block(arena_t arena, size_t size) {
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (!block)
+        return NULL;
+    block->size = size;
+    block->used = 0;
+    if (arena->current) {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    } else {
+        block->next = arena->first;
+        arena->first = block;
+    }
+    return block;
+}
+
+/** Allocates memory from an arena. The memory is aligned for any
+ *  type and stays valid until the arena is reset or destroyed.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              size: Number of bytes.
+ *
+ *  Returns: Pointer to the memory, or NULL if out of memory.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+
+    struct arena_block *block = arena->current;
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+    // Move on to blocks kept from before the last reset, if any
+    while (block && block->size - block->used < size) {
+        if (!block->next || block->next->size < size)
+            block = NULL;
+        else
+            block = arena->current = block->next;
+    }
+    if (!block) {
+        block = add_block(arena, size > arena->block_size ? size : arena->block_size);
+        if (!block)
+            return NULL;
+        arena->current = block;
+    }
+
+    void *rv = block->data + block->used;
+    block->used += size;
+    return rv;
+}
+
+/** Copies a null-terminated string into an arena.
+ *
+ *  Returns: Pointer to the copy, or NULL if out of memory.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = arena_alloc(arena, size);
+    if (copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+/** Releases all memory allocated from an arena at once. Blocks of the
+ *  standard size are kept for later allocations.
+ *
+ *  Parameters: arena: Arena to reset.
+ */
+void arena_reset(arena_t arena) {
+    struct arena_block **link = &arena->first;
+    while (*link) {
+        struct arena_block *block = *link;
+        if (block->size > arena->block_size) {
+            *link = block->next;
+            free(block);
+        } else {
+            block->used = 0;
+            link = &block->next;
+        }
+    }
+    arena->current = arena->first;
+}
+
+/** Frees an arena and all memory allocated from it.
+ */
+void arena_destroy(arena_t arena) {
+    if (!arena)
+        return;
+    while (arena->first) {
+        struct arena_block *next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
+    }
+    free(arena);
+}
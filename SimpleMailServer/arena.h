@@ -0,0 +1,19 @@
+/* arena.h
+ * Bump allocator for memory that lives until a known point, e.g.,
+ * the end of a command or of a mail transaction.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena *arena_t;
+
+arena_t arena_create(size_t block_size);
+void *arena_alloc(arena_t arena, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+void arena_reset(arena_t arena);
+void arena_destroy(arena_t arena);
+
+#endif
@@ -0,0 +1,770 @@
+/* loadgen.c
+ * Closed-loop load generator for mysmtpd and mypopd.
+ *
+ * A number of SMTP workers and POP3 workers run concurrently for a
+ * fixed time. Each SMTP worker opens a session, sends a number of
+ * messages to random users from the users file and starts a new
+ * session; each POP3 worker logs in as one of those users, runs STAT
+ * and LIST, retrieves and deletes every message and starts again.
+ * Every worker waits for each response before going on (closed loop),
+ * optionally sending the commands of a transaction or a batch of
+ * RETR/DELE commands together (pipelining).
+ *
+ * The latency of each command is measured from the moment it is sent
+ * until its response is complete, and kept in log-linear histograms
+ * (eight buckets per power of two of microseconds). The report gives
+ * messages/s and MB/s for both protocols and p50/p99/p999 latencies
+ * per command, on the terminal and optionally as JSON.
+ *
+ * Note that the servers handle one connection at a time unless built
+ * with -DDOFORK; with more workers than that, sessions wait for each
+ * other and the latencies include the time spent waiting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_USERS        1024
+#define LINE_SIZE        1024
+#define RECV_BUFFER      65536
+#define MAX_MESSAGE_SIZE (4 * 1024 * 1024)
+#define BODY_LINE        76      // characters per line of generated bodies
+#define POP_BATCH        64      // commands sent together when pipelining
+#define SUB_BUCKET_BITS  3
+#define SUB_BUCKETS      (1 << SUB_BUCKET_BITS)
+#define HIST_BUCKETS     (28 * SUB_BUCKETS)
+#define IO_TIMEOUT_S     30
+#define STARTUP_WAIT_MS  5000
+
+enum command {
+    SMTP_CONNECT, SMTP_HELO, SMTP_MAIL, SMTP_RCPT, SMTP_DATA, SMTP_BODY, SMTP_QUIT,
+    POP_CONNECT, POP_USER, POP_PASS, POP_STAT, POP_LIST, POP_RETR, POP_DELE, POP_QUIT,
+    COMMAND_COUNT
+};
+
+static const char *command_names[COMMAND_COUNT] = {
+    "smtp_connect", "smtp_helo", "smtp_mail", "smtp_rcpt", "smtp_data", "smtp_body", "smtp_quit",
+    "pop3_connect", "pop3_user", "pop3_pass", "pop3_stat", "pop3_list", "pop3_retr", "pop3_dele",
+    "pop3_quit"
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Results of a worker, merged at the end
+struct results {
+    struct histogram commands[COMMAND_COUNT];
+    uint64_t smtp_messages;
+    uint64_t smtp_bytes;
+    uint64_t pop_messages;
+    uint64_t pop_bytes;
+    uint64_t pop_sessions_refused;
+};
+
+enum size_kind { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXPONENTIAL };
+
+static struct {
+    const char *host;
+    const char *smtp_port;
+    const char *pop_port;
+    int smtp_workers;
+    int pop_workers;
+    int seconds;
+    int messages_per_session;
+    int recipients;
+    enum size_kind size_kind;
+    size_t size_a, size_b;
+    const char *size_spec;
+    int pipelining;
+    const char *users_file;
+    const char *server_dir;
+    const char *json_file;
+    unsigned int seed;
+} config = {
+    "127.0.0.1", "2525", "2110", 4, 2, 10, 10, 1, SIZE_EXPONENTIAL, 8192, 0, "exp:8192",
+    0, "users.txt", NULL, NULL, 1
+};
+
+static struct {
+    char name[256];
+    char password[256];
+} users[MAX_USERS];
+static int user_count;
+
+static char *body_text;         // lines of text that message bodies are cut from
+static volatile sig_atomic_t stopping;
+
+struct connection {
+    int fd;
+    size_t start, end;
+    char buf[RECV_BUFFER];
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    struct results results;
+};
+
+/** Returns the current time in microseconds from a monotonic clock.
+ */
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Returns the histogram bucket of a latency in microseconds.
+ */
+static int bucket_of(uint64_t us) {
+    if (us < SUB_BUCKETS)
+        return us;
+    int exponent = 63 - __builtin_clzll(us);
+    int sub = (us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    int bucket = (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/** Returns the upper bound, in microseconds, of the values in a bucket.
+ */
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket + 1;
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    int sub = bucket % SUB_BUCKETS;
+    return (uint64_t) (SUB_BUCKETS + sub + 1) << (exponent - SUB_BUCKET_BITS);
+}
+
+/** Records the latency of a command that started at a given time.
+ */
+static void record(struct results *results, enum command command, uint64_t start, int ok) {
+    struct histogram *hist = &results->commands[command];
+    hist->count++;
+    if (!ok)
+        hist->errors++;
+    hist->buckets[bucket_of(now_us() - start)]++;
+}
+
+/** Returns a percentile of a histogram, as the upper bound of the
+ *  bucket that contains it, in microseconds.
+ */
+static uint64_t percentile(const struct histogram *hist, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * hist->count + 0.5), seen = 0;
+    if (!hist->count)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            return bucket_limit(i);
+    }
+    return bucket_limit(HIST_BUCKETS - 1);
+}
+
+/** Opens a TCP connection. Returns -1 on error.
+ */
+static int connect_to(const char *host, const char *port) {
+
+    struct addrinfo hints = { 0 }, *info, *p;
+    int fd = -1, yes = 1;
+    struct timeval timeout = { IO_TIMEOUT_S, 0 };
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &info) != 0)
+        return -1;
+    for (p = info; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+/** Sends a whole buffer. Returns 0 on success, -1 on error.
+ */
+static int send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t rv = send(fd, data, size, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        data += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Reads one line, including its line break, into line (null
+ *  terminated; longer lines are truncated). Returns the length of the
+ *  full line, or -1 if the connection is closed or times out.
+ */
+static long read_line(struct connection *conn, char *line) {
+
+    long total = 0;
+    while (1) {
+        char *eol = memchr(conn->buf + conn->start, '\n', conn->end - conn->start);
+        size_t len = eol ? (size_t) (eol - (conn->buf + conn->start)) + 1 : conn->end - conn->start;
+        size_t copy = total + len < LINE_SIZE ? len : total < LINE_SIZE - 1 ? LINE_SIZE - 1 - total : 0;
+        memcpy(line + (total < LINE_SIZE ? total : LINE_SIZE - 1), conn->buf + conn->start, copy);
+        total += len;
+        line[total < LINE_SIZE - 1 ? total : LINE_SIZE - 1] = 0;
+        conn->start += len;
+        if (eol)
+            return total;
+
+        conn->start = conn->end = 0;
+        ssize_t rv = recv(conn->fd, conn->buf, RECV_BUFFER, 0);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        conn->end = rv;
+    }
+}
+
+/** Reads an SMTP reply, which may span several lines. Returns the
+ *  reply code, or -1 on error.
+ */
+static int smtp_reply(struct connection *conn) {
+    char line[LINE_SIZE];
+    do {
+        if (read_line(conn, line) < 4)
+            return -1;
+    } while (line[3] == '-');
+    return atoi(line);
+}
+
+/** Reads a POP3 status line and, if it is positive and multi is set,
+ *  the data that follows, up to the termination line. Returns the
+ *  number of data bytes read (0 for single-line responses), or -1 for
+ *  a negative or missing response.
+ */
+static long pop_reply(struct connection *conn, int multi, char *status) {
+    char line[LINE_SIZE];
+    long bytes = 0, len;
+    if (read_line(conn, status) < 0 || strncmp(status, "+OK", 3))
+        return -1;
+    if (!multi)
+        return 0;
+    while ((len = read_line(conn, line)) >= 0) {
+        if (!strcmp(line, ".\r\n"))
+            return bytes;
+        bytes += len;
+    }
+    return -1;
+}
+
+/** Picks the size of the next message from the configured distribution.
+ */
+static size_t message_size(unsigned int *seed) {
+    size_t size;
+    switch (config.size_kind) {
+        case SIZE_UNIFORM:
+            size = config.size_a + (size_t) ((double) rand_r(seed) / RAND_MAX * (config.size_b - config.size_a));
+            break;
+        case SIZE_EXPONENTIAL: {
+            double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+            size = (size_t) (-log1p(-u) * config.size_a);
+            break;
+        }
+        default:
+            size = config.size_a;
+    }
+    return size < MAX_MESSAGE_SIZE ? size : MAX_MESSAGE_SIZE;
+}
+
+/** Sends one SMTP transaction and waits for each response. Returns 0 if
+ *  the message was accepted, 1 if it was refused, -1 on connection errors.
+ */
+static int smtp_transaction(struct connection *conn, struct worker *worker) {
+
+    char commands[LINE_SIZE * 8];
+    size_t len = 0, size = message_size(&worker->seed);
+    int n = config.recipients;
+    uint64_t start = now_us();
+    int code = -1;
+
+    // The body is a run of complete lines from the shared text, so no
+    // line starts with a dot; the headers make it a valid message
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "From: <load@bench.local>\r\nSubject: bench %d\r\n\r\n", worker->id);
+    size_t body_len = size > (size_t) header_len ? size - header_len : 0;
+    body_len -= body_len % (BODY_LINE + 2);
+
+    len += sprintf(commands + len, "MAIL FROM:<load@bench.local>\r\n");
+    for (int i = 0; i < n && len < sizeof(commands) - 600; i++)
+        len += sprintf(commands + len, "RCPT TO:<%s>\r\n", users[rand_r(&worker->seed) % user_count].name);
+    len += sprintf(commands + len, "DATA\r\n");
+
+    if (config.pipelining) {
+        // Everything up to DATA goes in a single write; each response
+        // is timed from that write
+        if (send_all(conn->fd, commands, len) < 0)
+            return -1;
+        code = smtp_reply(conn);
+        record(&worker->results, SMTP_MAIL, start, code == 250);
+        for (int i = 0; i < n; i++) {
+            code = smtp_reply(conn);
+            record(&worker->results, SMTP_RCPT, start, code == 250);
+        }
+        code = smtp_reply(conn);
+        record(&worker->results, SMTP_DATA, start, code == 354);
+    } else {
+        char *line = commands;
+        for (int i = 0; i < n + 2; i++) {
+            char *next = strstr(line, "\r\n") + 2;
+            enum command command = i == 0 ? SMTP_MAIL : i <= n ? SMTP_RCPT : SMTP_DATA;
+            start = now_us();
+            if (send_all(conn->fd, line, next - line) < 0)
+                return -1;
+            code = smtp_reply(conn);
+            record(&worker->results, command, start, code == (command == SMTP_DATA ? 354 : 250));
+            if (code < 0)
+                return -1;
+            line = next;
+        }
+    }
+    if (code != 354)
+        return code < 0 ? -1 : 1;
+
+    start = now_us();
+    if (send_all(conn->fd, header, header_len) < 0 ||
+        send_all(conn->fd, body_text, body_len) < 0 ||
+        send_all(conn->fd, ".\r\n", 3) < 0)
+        return -1;
+    code = smtp_reply(conn);
+    record(&worker->results, SMTP_BODY, start, code == 250);
+    if (code != 250)
+        return code < 0 ? -1 : 1;
+    worker->results.smtp_messages++;
+    worker->results.smtp_bytes += header_len + body_len;
+    return 0;
+}
+
+/** Runs SMTP sessions until the test ends.
+ */
+static void *smtp_worker(void *arg) {
+
+    struct worker *worker = arg;
+    struct connection *conn = malloc(sizeof(struct connection));
+
+    while (!stopping) {
+        uint64_t start = now_us();
+        conn->fd = connect_to(config.host, config.smtp_port);
+        conn->start = conn->end = 0;
+        int code = conn->fd < 0 ? -1 : smtp_reply(conn);
+        record(&worker->results, SMTP_CONNECT, start, code == 220);
+        if (code != 220) {
+            if (conn->fd >= 0)
+                close(conn->fd);
+            usleep(10000);
+            continue;
+        }
+
+        start = now_us();
+        send_all(conn->fd, "HELO bench.local\r\n", 18);
+        code = smtp_reply(conn);
+        record(&worker->results, SMTP_HELO, start, code == 250);
+
+        int rv = 0;
+        for (int i = 0; code == 250 && rv >= 0 && i < config.messages_per_session && !stopping; i++)
+            rv = smtp_transaction(conn, worker);
+
+        if (rv >= 0) {
+            start = now_us();
+            send_all(conn->fd, "QUIT\r\n", 6);
+            code = smtp_reply(conn);
+            record(&worker->results, SMTP_QUIT, start, code == 221);
+        }
+        close(conn->fd);
+    }
+    free(conn);
+    return NULL;
+}
+
+/** Sends a POP3 command and waits for its response. Returns the value
+ *  returned by pop_reply.
+ */
+static long pop_command(struct connection *conn, struct worker *worker, enum command command,
+                        const char *text, int multi, char *status) {
+    uint64_t start = now_us();
+    if (send_all(conn->fd, text, strlen(text)) < 0)
+        return -1;
+    long rv = pop_reply(conn, multi, status);
+    record(&worker->results, command, start, rv >= 0);
+    return rv;
+}
+
+/** Sends RETR or DELE for messages 1 to count, in batches if
+ *  pipelining, stopping early when the test ends. Returns the number
+ *  of messages done, or -1 on connection errors.
+ */
+static int pop_each(struct connection *conn, struct worker *worker, enum command command, int count) {
+
+    char batch[POP_BATCH * 24], status[LINE_SIZE];
+    const char *verb = command == POP_RETR ? "RETR" : "DELE";
+    int per_batch = config.pipelining ? POP_BATCH : 1;
+
+    int first;
+    for (first = 1; first <= count && !stopping; first += per_batch) {
+        int last = first + per_batch - 1 < count ? first + per_batch - 1 : count;
+        size_t len = 0;
+        for (int i = first; i <= last; i++)
+            len += sprintf(batch + len, "%s %d\r\n", verb, i);
+        uint64_t start = now_us();
+        if (send_all(conn->fd, batch, len) < 0)
+            return -1;
+        for (int i = first; i <= last; i++) {
+            long bytes = pop_reply(conn, command == POP_RETR, status);
+            record(&worker->results, command, start, bytes >= 0);
+            if (bytes < 0 && status[0] != '-')
+                return -1;
+            if (bytes >= 0 && command == POP_RETR) {
+                worker->results.pop_messages++;
+                worker->results.pop_bytes += bytes;
+            }
+        }
+    }
+    return (first <= count ? first : count + 1) - 1;
+}
+
+/** Runs POP3 sessions until the test ends. Each worker uses one user,
+ *  so that workers only compete for a mailbox when there are more
+ *  workers than users.
+ */
+static void *pop_worker(void *arg) {
+
+    struct worker *worker = arg;
+    struct connection *conn = malloc(sizeof(struct connection));
+    char command[LINE_SIZE], status[LINE_SIZE];
+    int user = worker->id % user_count;
+
+    while (!stopping) {
+        uint64_t start = now_us();
+        conn->fd = connect_to(config.host, config.pop_port);
+        conn->start = conn->end = 0;
+        long rv = conn->fd < 0 ? -1 : pop_reply(conn, 0, status);
+        record(&worker->results, POP_CONNECT, start, rv >= 0);
+        if (rv < 0) {
+            if (conn->fd >= 0)
+                close(conn->fd);
+            usleep(10000);
+            continue;
+        }
+
+        int count = 0;
+        snprintf(command, sizeof(command), "USER %s\r\n", users[user].name);
+        rv = pop_command(conn, worker, POP_USER, command, 0, status);
+        if (rv >= 0) {
+            snprintf(command, sizeof(command), "PASS %s\r\n", users[user].password);
+            rv = pop_command(conn, worker, POP_PASS, command, 0, status);
+            // The mailbox is locked by another session
+            if (rv < 0)
+                worker->results.pop_sessions_refused++;
+        }
+        if (rv >= 0 && (rv = pop_command(conn, worker, POP_STAT, "STAT\r\n", 0, status)) >= 0)
+            count = atoi(status + 4);
+        if (rv >= 0)
+            rv = pop_command(conn, worker, POP_LIST, "LIST\r\n", 1, status);
+        // Only the messages retrieved are deleted
+        if (rv >= 0 && count)
+            rv = pop_each(conn, worker, POP_RETR, count);
+        if (rv > 0)
+            rv = pop_each(conn, worker, POP_DELE, rv);
+        pop_command(conn, worker, POP_QUIT, "QUIT\r\n", 0, status);
+        close(conn->fd);
+
+        // Let messages arrive before the next session
+        if (!count)
+            usleep(10000);
+    }
+    free(conn);
+    return NULL;
+}
+
+/** Reads user names and passwords from the users file.
+ */
+static int load_users(const char *file_name) {
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+        return -1;
+    while (user_count < MAX_USERS &&
+           fscanf(file, "%255s %255s", users[user_count].name, users[user_count].password) == 2)
+        user_count++;
+    fclose(file);
+    return user_count ? 0 : -1;
+}
+
+/** Builds the text that message bodies are cut from.
+ */
+static void build_body_text(void) {
+    size_t lines = MAX_MESSAGE_SIZE / (BODY_LINE + 2) + 1;
+    body_text = malloc(lines * (BODY_LINE + 2));
+    for (size_t i = 0; i < lines; i++) {
+        char *line = body_text + i * (BODY_LINE + 2);
+        for (int j = 0; j < BODY_LINE; j++)
+            line[j] = 'a' + (i + j) % 26;
+        line[BODY_LINE] = '\r';
+        line[BODY_LINE + 1] = '\n';
+    }
+}
+
+/** Parses a message size distribution: fixed:N, uniform:MIN:MAX or
+ *  exp:MEAN. Returns 0 on success, -1 on error.
+ */
+static int parse_size(const char *spec) {
+    config.size_spec = spec;
+    if (sscanf(spec, "fixed:%zu", &config.size_a) == 1)
+        config.size_kind = SIZE_FIXED;
+    else if (sscanf(spec, "uniform:%zu:%zu", &config.size_a, &config.size_b) == 2 &&
+             config.size_a <= config.size_b)
+        config.size_kind = SIZE_UNIFORM;
+    else if (sscanf(spec, "exp:%zu", &config.size_a) == 1)
+        config.size_kind = SIZE_EXPONENTIAL;
+    else
+        return -1;
+    return 0;
+}
+
+/** Starts a server from the server directory and waits until it
+ *  accepts connections. Returns its process ID, or -1 on error.
+ */
+static pid_t start_server(const char *program, const char *port) {
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        char path[512];
+        snprintf(path, sizeof(path), "./%s", program);
+        if (chdir(config.server_dir) < 0)
+            _exit(1);
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        execl(path, program, port, (char *) NULL);
+        _exit(1);
+    }
+
+    for (int waited = 0; waited < STARTUP_WAIT_MS; waited += 20) {
+        int fd = connect_to(config.host, port);
+        if (fd >= 0) {
+            // The probe connection is answered and dropped
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(20000);
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/** Adds the results of a worker to the totals.
+ */
+static void merge(struct results *total, const struct results *results) {
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+        total->commands[c].count += results->commands[c].count;
+        total->commands[c].errors += results->commands[c].errors;
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            total->commands[c].buckets[i] += results->commands[c].buckets[i];
+    }
+    total->smtp_messages += results->smtp_messages;
+    total->smtp_bytes += results->smtp_bytes;
+    total->pop_messages += results->pop_messages;
+    total->pop_bytes += results->pop_bytes;
+    total->pop_sessions_refused += results->pop_sessions_refused;
+}
+
+/** Prints the results on the terminal.
+ */
+static void print_report(const struct results *total, double seconds) {
+    printf("duration %.2f s, %d SMTP and %d POP3 workers, pipelining %s\n",
+           seconds, config.smtp_workers, config.pop_workers, config.pipelining ? "on" : "off");
+    printf("smtp: %llu messages, %.1f messages/s, %.2f MB/s\n",
+           (unsigned long long) total->smtp_messages, total->smtp_messages / seconds,
+           total->smtp_bytes / seconds / 1e6);
+    printf("pop3: %llu messages, %.1f messages/s, %.2f MB/s, %llu sessions refused\n",
+           (unsigned long long) total->pop_messages, total->pop_messages / seconds,
+           total->pop_bytes / seconds / 1e6, (unsigned long long) total->pop_sessions_refused);
+    printf("\n%-14s %10s %8s %10s %10s %10s\n", "command", "count", "errors", "p50 us", "p99 us", "p999 us");
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+        const struct histogram *hist = &total->commands[c];
+        if (!hist->count)
+            continue;
+        printf("%-14s %10llu %8llu %10llu %10llu %10llu\n", command_names[c],
+               (unsigned long long) hist->count, (unsigned long long) hist->errors,
+               (unsigned long long) percentile(hist, 0.5), (unsigned long long) percentile(hist, 0.99),
+               (unsigned long long) percentile(hist, 0.999));
+    }
+}
+
+/** Writes the configuration and results as a JSON object.
+ */
+static int write_json(const char *file_name, const struct results *total, double seconds) {
+
+    FILE *out = fopen(file_name, "w");
+    if (!out)
+        return -1;
+    fprintf(out, "{\n  \"timestamp\": %lld,\n", (long long) time(NULL));
+    fprintf(out, "  \"config\": {\"smtp_workers\": %d, \"pop3_workers\": %d, \"seconds\": %d, "
+                 "\"messages_per_session\": %d, \"recipients\": %d, \"size\": \"%s\", "
+                 "\"pipelining\": %s, \"seed\": %u},\n",
+            config.smtp_workers, config.pop_workers, config.seconds, config.messages_per_session,
+            config.recipients, config.size_spec, config.pipelining ? "true" : "false", config.seed);
+    fprintf(out, "  \"duration_s\": %.3f,\n", seconds);
+    fprintf(out, "  \"smtp\": {\"messages\": %llu, \"messages_per_s\": %.2f, \"mb_per_s\": %.3f},\n",
+            (unsigned long long) total->smtp_messages, total->smtp_messages / seconds,
+            total->smtp_bytes / seconds / 1e6);
+    fprintf(out, "  \"pop3\": {\"messages\": %llu, \"messages_per_s\": %.2f, \"mb_per_s\": %.3f, "
+                 "\"sessions_refused\": %llu},\n",
+            (unsigned long long) total->pop_messages, total->pop_messages / seconds,
+            total->pop_bytes / seconds / 1e6, (unsigned long long) total->pop_sessions_refused);
+    fprintf(out, "  \"commands\": {");
+    const char *separator = "\n";
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+        const struct histogram *hist = &total->commands[c];
+        if (!hist->count)
+            continue;
+        fprintf(out, "%s    \"%s\": {\"count\": %llu, \"errors\": %llu, \"p50_us\": %llu, "
+                     "\"p99_us\": %llu, \"p999_us\": %llu}",
+                separator, command_names[c], (unsigned long long) hist->count,
+                (unsigned long long) hist->errors, (unsigned long long) percentile(hist, 0.5),
+                (unsigned long long) percentile(hist, 0.99), (unsigned long long) percentile(hist, 0.999));
+        separator = ",\n";
+    }
+    fprintf(out, "\n  }\n}\n");
+    return fclose(out);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host          server address (default 127.0.0.1)\n"
+            "  -s port          SMTP port (default 2525)\n"
+            "  -p port          POP3 port (default 2110)\n"
+            "  -c n             concurrent SMTP sessions (default 4)\n"
+            "  -C n             concurrent POP3 sessions (default 2)\n"
+            "  -t seconds       test duration (default 10)\n"
+            "  -m n             messages per SMTP session (default 10)\n"
+            "  -r n             recipients per message (default 1)\n"
+            "  -z dist          message sizes: fixed:N, uniform:MIN:MAX or exp:MEAN (default exp:8192)\n"
+            "  -P               pipeline commands\n"
+            "  -u file          users file, also used for POP3 logins (default users.txt)\n"
+            "  -L dir           start mysmtpd and mypopd from dir for the test\n"
+            "  -o file          write results as JSON\n"
+            "  -S seed          random seed (default 1)\n", program);
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:s:p:c:C:t:m:r:z:Pu:L:o:S:")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 's': config.smtp_port = optarg; break;
+            case 'p': config.pop_port = optarg; break;
+            case 'c': config.smtp_workers = atoi(optarg); break;
+            case 'C': config.pop_workers = atoi(optarg); break;
+            case 't': config.seconds = atoi(optarg); break;
+            case 'm': config.messages_per_session = atoi(optarg); break;
+            case 'r': config.recipients = atoi(optarg); break;
+            case 'P': config.pipelining = 1; break;
+            case 'u': config.users_file = optarg; break;
+            case 'L': config.server_dir = optarg; break;
+            case 'o': config.json_file = optarg; break;
+            case 'S': config.seed = strtoul(optarg, NULL, 10); break;
+            case 'z':
+                if (parse_size(optarg) == 0)
+                    break;
+                // fall through
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.smtp_workers < 0 || config.pop_workers < 0 || config.seconds <= 0 ||
+        config.recipients < 1 || config.messages_per_session < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (load_users(config.users_file) < 0) {
+        fprintf(stderr, "Could not read users from %s\n", config.users_file);
+        return 1;
+    }
+    build_body_text();
+
+    pid_t smtp_pid = -1, pop_pid = -1;
+    if (config.server_dir) {
+        smtp_pid = start_server("mysmtpd", config.smtp_port);
+        pop_pid = start_server("mypopd", config.pop_port);
+        if (smtp_pid < 0 || pop_pid < 0) {
+            fprintf(stderr, "Could not start the servers from %s\n", config.server_dir);
+            if (smtp_pid > 0) kill(smtp_pid, SIGTERM);
+            if (pop_pid > 0) kill(pop_pid, SIGTERM);
+            return 1;
+        }
+    }
+
+    int count = config.smtp_workers + config.pop_workers;
+    struct worker *workers = calloc(count, sizeof(struct worker));
+    uint64_t start = now_us();
+    for (int i = 0; i < count; i++) {
+        workers[i].id = i < config.smtp_workers ? i : i - config.smtp_workers;
+        workers[i].seed = config.seed * 7919 + i;
+        pthread_create(&workers[i].thread, NULL, i < config.smtp_workers ? smtp_worker : pop_worker,
+                       &workers[i]);
+    }
+    sleep(config.seconds);
+    stopping = 1;
+
+    struct results *total = calloc(1, sizeof(struct results));
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge(total, &workers[i].results);
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    if (smtp_pid > 0) kill(smtp_pid, SIGTERM);
+    if (pop_pid > 0) kill(pop_pid, SIGTERM);
+    if (smtp_pid > 0) waitpid(smtp_pid, NULL, 0);
+    if (pop_pid > 0) waitpid(pop_pid, NULL, 0);
+
+    print_report(total, seconds);
+    if (config.json_file && write_json(config.json_file, total, seconds) != 0) {
+        fprintf(stderr, "Could not write %s\n", config.json_file);
+        return 1;
+    }
+    return 0;
+}
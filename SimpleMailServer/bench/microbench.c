@@ -0,0 +1,474 @@
+/* microbench.c
+ * Microbenchmarks for the hot paths shared by the servers: reading
+ * lines and bytes from a netbuffer, splitting and parsing commands,
+ * checking credentials and loading mailboxes.
+ *
+ * Each benchmark is run with a growing number of iterations until one
+ * run takes at least the minimum time, and reports the time and the
+ * number of heap allocations per operation. Allocations are counted by
+ * wrapping malloc, calloc and realloc, including the calls made inside
+ * the C library (e.g., by fopen or strdup).
+ *
+ * The users file and mailboxes are generated in a temporary directory,
+ * which is removed at the end. The generator is also available on its
+ * own, to fill the mail.store of the current directory for load tests:
+ *
+ *     microbench -g john.doe@example.com 10000 4096
+ *
+ * parse_email_address is internal to mysmtpd.c, so that file is
+ * included here with its main function renamed.
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 500   // for nftw
+
+#define main mysmtpd_main
+#include "../mysmtpd.c"
+#undef main
+
+#include "../mailindex.h"
+#include "../mailcache.h"
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define DEFAULT_MIN_TIME_MS  200
+#define MAX_ITERATIONS       (1L << 30)
+#define SOCKET_CHUNK         65536
+#define BENCH_CACHE_BUDGET   (256 * 1024 * 1024)
+#define DEFAULT_MESSAGE_SIZE 2048
+#define LINKS_PER_FILE       10000
+
+// Layout of the mail storage, as in mailuser.c
+#define USER_FILE_NAME        "users.txt"
+#define MAIL_BASE_DIRECTORY   "mail.store"
+#define MAIL_FILE_SUFFIX      ".mail"
+#define GENERATIONS_FILE_NAME MAIL_BASE_DIRECTORY "/.generations"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static uint64_t min_time_ns = DEFAULT_MIN_TIME_MS * 1000000ULL;
+static const char *filter;
+static volatile size_t sink;    // keeps results from being optimized away
+
+/** Returns the current time in nanoseconds from a monotonic clock.
+ */
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Returns non-zero if a benchmark is selected by the filter.
+ */
+static int selected(const char *name) {
+    return !filter || strstr(name, filter);
+}
+
+/** Runs a benchmark and prints its results. The function is called
+ *  with the number of operations to perform; calls are repeated with
+ *  more operations until one takes at least the minimum time. A first
+ *  call with a single operation warms up caches and is not measured.
+ *
+ *  Parameters: name: Name of the benchmark, matched against the filter.
+ *              fn: Function performing the operations.
+ *              arg: Argument passed to fn.
+ */
+static void run_bench(const char *name, void (*fn)(void *arg, long iterations), void *arg) {
+
+    if (!selected(name))
+        return;
+
+    fn(arg, 1);
+    long iterations = 1;
+    while (1) {
+        unsigned long allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+        uint64_t start = bench_now();
+        fn(arg, iterations);
+        uint64_t elapsed = bench_now() - start;
+        allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs;
+
+        if (elapsed >= min_time_ns || iterations >= MAX_ITERATIONS) {
+            printf("%-40s %10ld %14.1f ns/op %10.2f allocs/op\n", name, iterations,
+                   (double) elapsed / iterations, (double) allocs / iterations);
+            fflush(stdout);
+            return;
+        }
+        // Aim 20% past the minimum time, growing at least twofold
+        double next = elapsed ? (double) iterations * min_time_ns * 1.2 / elapsed : iterations * 100.0;
+        if (next < iterations * 2.0)
+            next = iterations * 2.0;
+        if (next > iterations * 100.0)
+            next = iterations * 100.0;
+        iterations = next < MAX_ITERATIONS ? (long) next : MAX_ITERATIONS;
+    }
+}
+
+/* Netbuffer */
+
+struct stream {
+    int fd;
+    const char *pattern;        // data sent, repeated as needed
+    size_t pattern_size;
+    size_t total;
+};
+
+/** Internal function run by the thread that sends data to the
+ *  netbuffer under test.
+ */
+static void *stream_writer(void *arg) {
+    struct stream *stream = arg;
+    size_t sent = 0;
+    while (sent < stream->total) {
+        size_t offset = sent % stream->pattern_size;
+        size_t len = stream->pattern_size - offset;
+        if (len > stream->total - sent)
+            len = stream->total - sent;
+        ssize_t rv = write(stream->fd, stream->pattern + offset, len);
+        if (rv <= 0)
+            break;
+        sent += rv;
+    }
+    return NULL;
+}
+
+/** Internal function that starts sending data over a socket pair.
+ *  Returns the descriptor the data is read from.
+ */
+static int start_stream(struct stream *stream, pthread_t *thread, size_t total) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    stream->fd = fds[1];
+    stream->total = total;
+    pthread_create(thread, NULL, stream_writer, stream);
+    return fds[0];
+}
+
+static void finish_stream(struct stream *stream, pthread_t thread, int fd) {
+    pthread_join(thread, NULL);
+    close(stream->fd);
+    close(fd);
+}
+
+static void bench_nb_read_line(void *arg, long iterations) {
+    struct stream *stream = arg;
+    static const char line[] = "RCPT TO:<john.doe@example.com>\r\n";
+    pthread_t thread;
+    char out[MAX_LINE_LENGTH + 1];
+
+    int fd = start_stream(stream, &thread, (sizeof(line) - 1) * iterations);
+    net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+    for (long i = 0; i < iterations; i++)
+        sink += nb_read_line(nb, out);
+    nb_destroy(nb);
+    finish_stream(stream, thread, fd);
+}
+
+static void bench_nb_read_bytes(void *arg, long iterations) {
+    struct stream *stream = arg;
+    pthread_t thread;
+    char out[MAX_LINE_LENGTH];
+
+    int fd = start_stream(stream, &thread, (size_t) MAX_LINE_LENGTH * iterations);
+    net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+    for (long i = 0; i < iterations; i++)
+        for (size_t got = 0; got < MAX_LINE_LENGTH; ) {
+            int rv = nb_read_bytes(nb, out, MAX_LINE_LENGTH - got);
+            if (rv <= 0)
+                break;
+            got += rv;
+        }
+    nb_destroy(nb);
+    finish_stream(stream, thread, fd);
+}
+
+/** Internal function that fills a pattern of repeated lines, sent by
+ *  the netbuffer benchmarks.
+ */
+static char *make_pattern(const char *line, size_t *size) {
+    size_t len = strlen(line), count = SOCKET_CHUNK / len;
+    char *pattern = malloc(count * len);
+    for (size_t i = 0; i < count; i++)
+        memcpy(pattern + i * len, line, len);
+    *size = count * len;
+    return pattern;
+}
+
+/* Parsers */
+
+static void bench_split(void *arg, long iterations) {
+    static const char command[] = "MAIL FROM:<john.doe@example.com> SIZE=4096\r\n";
+    char line[sizeof(command)];
+    char *parts[sizeof(command)];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(line, command, sizeof(command));
+        sink += split(line, parts);
+    }
+}
+
+static void bench_parse_email_address(void *arg, long iterations) {
+    char address[MAX_LINE_LENGTH];
+    for (long i = 0; i < iterations; i++)
+        sink += parse_email_address("FROM:<john.doe@example.com>", address);
+}
+
+/* Users */
+
+struct user_bench {
+    long users;
+    char name[64];
+    char password[64];
+};
+
+/** Internal function that writes a users file with a number of users,
+ *  and picks the one in the middle for lookups. The file is rewritten
+ *  in place, since is_valid_user keeps it open between calls.
+ */
+static void make_users_file(struct user_bench *bench) {
+    FILE *file = fopen(USER_FILE_NAME, "w");
+    if (!file) {
+        perror(USER_FILE_NAME);
+        exit(1);
+    }
+    for (long i = 0; i < bench->users; i++)
+        fprintf(file, "user%07ld@bench.local password%07ld\n", i, i);
+    fclose(file);
+    sprintf(bench->name, "user%07ld@bench.local", bench->users / 2);
+    sprintf(bench->password, "password%07ld", bench->users / 2);
+}
+
+static void bench_is_valid_user(void *arg, long iterations) {
+    struct user_bench *bench = arg;
+    for (long i = 0; i < iterations; i++)
+        sink += is_valid_user(bench->name, bench->password);
+}
+
+/* Mailboxes */
+
+/** Internal function that writes a synthetic message to a new
+ *  temporary file, whose name is written to file_name.
+ */
+static int write_message(char *file_name, const char *username, size_t size) {
+    strcpy(file_name, TEMP_FILE_NAME);
+    int fd = mkstemps(file_name, strlen(TEMP_FILE_SUFFIX));
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!file)
+        return -1;
+    size_t written = fprintf(file, "From: <generator@bench.local>\r\nTo: <%s>\r\n"
+                                   "Subject: synthetic message\r\n\r\n", username);
+    for (long line = 0; written < size; line++)
+        written += fprintf(file, "Line %06ld of a synthetic message body, "
+                                 "padded to a typical length.\r\n", line);
+    return fclose(file) == EOF ? -1 : 0;
+}
+
+/** Creates a mailbox in the mail.store of the current directory with a
+ *  number of identical messages, indexed as if each had been delivered
+ *  by save_user_mail. Messages are hard links to a few files (one per
+ *  LINKS_PER_FILE messages), so a large mailbox takes little space.
+ *
+ *  Parameters: username: Owner of the mailbox, which must not exist yet.
+ *              count: Number of messages.
+ *              size: Approximate size of each message, in bytes.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int generate_mailbox(const char *username, long count, size_t size) {
+
+    char source[sizeof(TEMP_FILE_NAME)] = "", mailbox[PATH_MAX], mail_file[PATH_MAX + 32];
+    struct mail_index_record record = { 0 };
+    struct mail_layout layout = { 0 };
+    struct stat file_stat;
+    int rv = 0;
+
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    mailcache_attach(GENERATIONS_FILE_NAME);
+    snprintf(mailbox, sizeof(mailbox), "%s/%s", MAIL_BASE_DIRECTORY, username);
+    if (mkdir(mailbox, 0777) < 0)
+        return -1;
+
+    for (long i = 0; !rv && i < count; i++) {
+        // File systems limit the number of links to a file
+        if (i % LINKS_PER_FILE == 0) {
+            if (*source)
+                unlink(source);
+            if (write_message(source, username, size) < 0 || stat(source, &file_stat) < 0 ||
+                (!i && mailindex_scan(source, &layout) < 0))
+                rv = -1;
+            record.size = file_stat.st_size;
+            record.inode = file_stat.st_ino;
+            record.delivered = (uint64_t) file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+        }
+        snprintf(mail_file, sizeof(mail_file), "%s/%ld" MAIL_FILE_SUFFIX, mailbox, i);
+        record.seq = i;
+        if (!rv && (link(source, mail_file) < 0 || mailindex_append(mailbox, &record, &layout) < 0))
+            rv = -1;
+    }
+    mailindex_free_layout(&layout);
+    mailcache_invalidate(username);
+    if (*source)
+        unlink(source);
+    return rv;
+}
+
+struct mail_bench {
+    long messages;
+    int generated;
+    char username[64];
+    mail_list_t list;
+};
+
+static void bench_load_user_mail(void *arg, long iterations) {
+    struct mail_bench *bench = arg;
+    for (long i = 0; i < iterations; i++) {
+        mail_list_t list = load_user_mail(bench->username);
+        sink += get_mail_count(list, 0);
+        destroy_mail_list(list);
+    }
+}
+
+static void bench_get_mail_item(void *arg, long iterations) {
+    struct mail_bench *bench = arg;
+    for (long i = 0; i < iterations; i++)
+        sink += get_mail_item_size(get_mail_item(bench->list, i % bench->messages));
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-t min_ms] [-f filter] [-k]\n"
+            "       %s -g username count [message_size]\n"
+            "  -t min_ms  minimum time of each measurement (default %d)\n"
+            "  -f filter  only run benchmarks whose name contains filter\n"
+            "  -k         keep the temporary directory with the generated data\n"
+            "  -g         generate a mailbox in the mail.store of the current directory\n",
+            program, program, DEFAULT_MIN_TIME_MS);
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt, keep = 0, status = 0;
+    const char *generate = NULL;
+    while ((opt = getopt(argc, argv, "t:f:kg:")) != -1) {
+        switch (opt) {
+            case 't': min_time_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+            case 'f': filter = optarg; break;
+            case 'k': keep = 1; break;
+            case 'g': generate = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (generate) {
+        if (optind >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        size_t size = optind + 1 < argc ? strtoul(argv[optind + 1], NULL, 10) : DEFAULT_MESSAGE_SIZE;
+        if (generate_mailbox(generate, atol(argv[optind]), size) < 0) {
+            perror("generate_mailbox");
+            return 1;
+        }
+        return 0;
+    }
+
+    char directory[] = "/tmp/microbench.XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) < 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    struct stream line_stream, bytes_stream;
+    line_stream.pattern = make_pattern("RCPT TO:<john.doe@example.com>\r\n", &line_stream.pattern_size);
+    bytes_stream.pattern = make_pattern("0123456789abcdef", &bytes_stream.pattern_size);
+    run_bench("nb_read_line", bench_nb_read_line, &line_stream);
+    run_bench("nb_read_bytes/1024", bench_nb_read_bytes, &bytes_stream);
+
+    run_bench("split", bench_split, NULL);
+    run_bench("parse_email_address", bench_parse_email_address, NULL);
+
+    static const long user_counts[] = { 10, 10000, 1000000 };
+    for (int i = 0; i < sizeof(user_counts) / sizeof(user_counts[0]); i++) {
+        struct user_bench bench = { user_counts[i] };
+        char name[64];
+        snprintf(name, sizeof(name), "is_valid_user/%ld", bench.users);
+        if (!selected(name))
+            continue;
+        make_users_file(&bench);
+        run_bench(name, bench_is_valid_user, &bench);
+    }
+
+    static const long message_counts[] = { 10, 10000, 100000 };
+    struct mail_bench mail_benches[3] = { { 0 } };
+    for (int i = 0; i < 3; i++) {
+        struct mail_bench *bench = &mail_benches[i];
+        char load_name[64], item_name[64], cached_name[64];
+        bench->messages = message_counts[i];
+        snprintf(bench->username, sizeof(bench->username), "mbox%ld@bench.local", bench->messages);
+        snprintf(load_name, sizeof(load_name), "load_user_mail/%ld", bench->messages);
+        snprintf(item_name, sizeof(item_name), "get_mail_item/%ld", bench->messages);
+        snprintf(cached_name, sizeof(cached_name), "load_user_mail/cached/%ld", bench->messages);
+        if (!selected(load_name) && !selected(item_name) && !selected(cached_name))
+            continue;
+
+        uint64_t start = bench_now();
+        if (generate_mailbox(bench->username, bench->messages, DEFAULT_MESSAGE_SIZE) < 0) {
+            perror("generate_mailbox");
+            status = 1;
+            break;
+        }
+        fprintf(stderr, "generated %ld messages in %.2f s\n", bench->messages,
+                (bench_now() - start) / 1e9);
+        bench->generated = 1;
+        run_bench(load_name, bench_load_user_mail, bench);
+        bench->list = load_user_mail(bench->username);
+        run_bench(item_name, bench_get_mail_item, bench);
+        destroy_mail_list(bench->list);
+    }
+
+    // The same loads, served from the metadata cache used by mypopd
+    init_mail_cache(BENCH_CACHE_BUDGET);
+    for (int i = 0; i < 3 && mail_benches[i].generated; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "load_user_mail/cached/%ld", mail_benches[i].messages);
+        run_bench(name, bench_load_user_mail, &mail_benches[i]);
+    }
+
+    if (keep)
+        fprintf(stderr, "data kept in %s\n", directory);
+    else
+        nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
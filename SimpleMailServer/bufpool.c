@@ -0,0 +1,152 @@
+/* bufpool.c
+ * Pool of I/O buffers shared by all connections.
+ *
+ * Connections borrow receive and send buffers only while data is in
+ * flight and give them back once the data is consumed or sent, so an
+ * idle connection holds no buffer. Returned buffers are kept in free
+ * lists, one per power-of-two size class, to be handed to the next
+ * connection without calling malloc.
+ *
+ * The total size of all buffers, borrowed or kept, is capped. When a
+ * buffer would exceed the cap, cached buffers of other sizes are freed
+ * first; if that is not enough, bufpool_get waits for a buffer to be
+ * returned, so connections stop reading instead of the process running
+ * out of memory. With DOFORK, each process has its own pool and cap.
+ */
+
+#include "bufpool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MIN_CLASS_SHIFT 10      // smallest class holds 1 KiB buffers
+#define NUM_CLASSES     9       // largest class holds 256 KiB buffers
+
+// Free buffers are linked through their first bytes
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t returned;
+    size_t limit;
+    size_t allocated;           // bytes in all buffers, borrowed or free
+    struct free_buffer *free[NUM_CLASSES];
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, BUFPOOL_DEFAULT_LIMIT };
+
+/** Internal function that returns the size class of a buffer size, or
+ *  NUM_CLASSES if buffers of that size are not kept in the pool.
+ */
+static int size_class(size_t size) {
+    int class = 0;
+    while (class < NUM_CLASSES && size > (size_t) 1 << (MIN_CLASS_SHIFT + class))
+        class++;
+    return class;
+}
+
+/** Internal function that returns the actual size of the buffers
+ *  allocated for a requested size.
+ */
+static size_t class_size(int class, size_t size) {
+    return class < NUM_CLASSES ? (size_t) 1 << (MIN_CLASS_SHIFT + class) : size;
+}
+
+/** Internal function that frees kept buffers of other classes until a
+ *  number of bytes fits under the cap. Called with the mutex held.
+ */
+static void trim(int keep, size_t size) {
+    for (int class = 0; class < NUM_CLASSES && pool.allocated + size > pool.limit; class++) {
+        while (class != keep && pool.free[class] && pool.allocated + size > pool.limit) {
+            struct free_buffer *buf = pool.free[class];
+            pool.free[class] = buf->next;
+            pool.allocated -= class_size(class, 0);
+            free(buf);
+        }
+    }
+}
+
+/** Internal function that takes a buffer from the pool. Called with
+ *  the mutex held. Returns NULL if the cap does not allow it.
+ */
+static void *take(size_t size) {
+
+    int class = size_class(size);
+    size_t bytes = class_size(class, size);
+
+    if (class < NUM_CLASSES && pool.free[class]) {
+        struct free_buffer *buf = pool.free[class];
+        pool.free[class] = buf->next;
+        return buf;
+    }
+    trim(class, bytes);
+    // A single buffer is always allowed, so that a cap smaller than a
+    // buffer cannot block a connection forever
+    if (pool.allocated && pool.allocated + bytes > pool.limit)
+        return NULL;
+    void *buf = malloc(bytes);
+    if (buf)
+        pool.allocated += bytes;
+    return buf;
+}
+
+/** Sets the maximum number of bytes used by all buffers together.
+ *
+ *  Parameters: bytes: New limit.
+ */
+void bufpool_set_limit(size_t bytes) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.limit = bytes;
+    trim(NUM_CLASSES, 0);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/** Borrows a buffer, waiting for other buffers to be returned if the
+ *  memory cap has been reached.
+ *
+ *  Parameters: size: Minimum size of the buffer, in bytes.
+ *
+ *  Returns: The buffer, or NULL if out of memory.
+ */
+void *bufpool_get(size_t size) {
+    pthread_mutex_lock(&pool.mutex);
+    void *buf;
+    while (!(buf = take(size)) && pool.allocated)
+        pthread_cond_wait(&pool.returned, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+    return buf;
+}
+
+/** Borrows a buffer if possible without exceeding the memory cap.
+ *
+ *  Parameters: size: Minimum size of the buffer, in bytes.
+ *
+ *  Returns: The buffer, or NULL if the cap has been reached.
+ */
+void *bufpool_try_get(size_t size) {
+    pthread_mutex_lock(&pool.mutex);
+    void *buf = take(size);
+    pthread_mutex_unlock(&pool.mutex);
+    return buf;
+}
+
+/** Returns a buffer borrowed with bufpool_get or bufpool_try_get.
+ *
+ *  Parameters: buf: The buffer, may be NULL.
+ *              size: Size passed when the buffer was borrowed.
+ */
+void bufpool_put(void *buf, size_t size) {
+    if (!buf)
+        return;
+    int class = size_class(size);
+    pthread_mutex_lock(&pool.mutex);
+    if (class < NUM_CLASSES && pool.allocated <= pool.limit) {
+        ((struct free_buffer *) buf)->next = pool.free[class];
+        pool.free[class] = buf;
+    } else {
+        pool.allocated -= class_size(class, size);
+        free(buf);
+    }
+    pthread_cond_broadcast(&pool.returned);
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,18 @@
+/* bufpool.h
+ * Pool of I/O buffers shared by all connections, with a cap on the
+ * total memory used by buffers.
+ */
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+
+#define BUFPOOL_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+void bufpool_set_limit(size_t bytes);
+void *bufpool_get(size_t size);
+void *bufpool_try_get(size_t size);
+void bufpool_put(void *buf, size_t size);
+
+#endif
@@ -0,0 +1,119 @@
+/* command.c
+ * Parses protocol command lines and dispatches them to handlers.
+ *
+ * A line is split into words in place. The verb is turned into a
+ * 32-bit key by packing up to four case-folded letters, so finding
+ * its handler takes one integer compare per table entry instead of a
+ * string comparison. Each handler lists the session states it is
+ * accepted in, so state checks are made before the handler runs.
+ */
+
+#include "command.h"
+#include "admission.h"
+#include "metrics.h"
+#include "trace.h"
+
+/** Returns non-zero for the characters that separate words.
+ */
+static inline int is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/** Internal function that builds the key of a verb. Setting bit 5 of
+ *  each byte turns uppercase letters into lowercase ones, and never
+ *  turns a character that is not a letter into a lowercase letter.
+ */
+static uint32_t verb_key(const char *verb, size_t len) {
+    uint32_t key = 0;
+    if (len > 4)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+        key |= (uint32_t) ((unsigned char) verb[i] | 0x20) << (8 * i);
+    return key;
+}
+
+/** Splits a command line into a verb and arguments separated by white
+ *  space. The line is modified: separators after each word are
+ *  replaced by null bytes, and the command points into the line.
+ *
+ *  Parameters: line: Null-terminated command line.
+ *              cmd: Receives the verb, its key and the arguments.
+ *
+ *  Returns: Number of words in the line, zero for an empty line.
+ */
+int cmd_parse(char *line, struct command *cmd) {
+
+    char *pos = line;
+    int words = 0;
+
+    cmd->verb = NULL;
+    cmd->key = 0;
+    cmd->argc = 0;
+    while (1) {
+        while (is_separator(*pos))
+            pos++;
+        if (!*pos)
+            break;
+
+        char *word = pos;
+        while (*pos && !is_separator(*pos))
+            pos++;
+        size_t len = pos - word;
+        if (*pos)
+            *pos++ = 0;
+
+        if (!words) {
+            cmd->verb = word;
+            cmd->key = verb_key(word, len);
+        } else {
+            if (cmd->argc < CMD_MAX_ARGS)
+                cmd->argv[cmd->argc] = word;
+            cmd->argc++;
+        }
+        words++;
+    }
+    return words;
+}
+
+/** Runs the handler of a parsed command.
+ *
+ *  Parameters: table: Handlers of the protocol.
+ *              session: State of the connection, passed to handlers.
+ *              state: Current state of the session, as a single bit
+ *                     to be matched with the states of a handler.
+ *              cmd: Command returned by cmd_parse.
+ *
+ *  The time taken is recorded in the metrics of the verb.
+ *
+ *  Returns: Value returned by the handler that was called, i.e.,
+ *           CMD_CONTINUE or CMD_CLOSE.
+ */
+int cmd_dispatch(const struct command_table *table, void *session, unsigned int state,
+                 struct command *cmd) {
+
+    // Clients over their command rate wait before being timed
+    admission_charge_commands(1);
+    uint64_t start = metrics_now();
+    int rv;
+
+    TRACE3(command_start, trace_session_id, cmd->verb, cmd->key);
+    for (size_t i = 0; cmd->key && i < table->count; i++) {
+        const struct command_handler *handler = &table->handlers[i];
+        if (handler->key != cmd->key)
+            continue;
+        if (!(handler->states & state)) {
+            metrics_add(COUNTER_DENIED_COMMANDS, 1);
+            rv = table->denied(session, handler, cmd);
+        } else {
+            rv = handler->handle(session, cmd);
+        }
+        metrics_command(cmd->key, start);
+        TRACE3(command_end, trace_session_id, cmd->key, rv);
+        return rv;
+    }
+    metrics_add(COUNTER_UNKNOWN_COMMANDS, 1);
+    rv = table->unknown(session, cmd);
+    metrics_command(0, start);
+    TRACE3(command_end, trace_session_id, cmd->key, rv);
+    return rv;
+}
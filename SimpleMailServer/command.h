@@ -0,0 +1,49 @@
+/* command.h
+ * Parses protocol command lines and dispatches them to handlers
+ * through a table, shared by the SMTP and POP3 servers.
+ */
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_MAX_ARGS 8
+
+// Key of a command verb of up to four letters, e.g. CMD_KEY('h','e','l','o')
+// or CMD_KEY('t','o','p',0). Keys are lowercase, so they can be used in
+// switch statements and static tables.
+#define CMD_KEY(a, b, c, d) \
+    ((uint32_t) (a) | (uint32_t) (b) << 8 | (uint32_t) (c) << 16 | (uint32_t) (d) << 24)
+
+// Values returned by handlers
+#define CMD_CONTINUE 0
+#define CMD_CLOSE    1
+
+struct command {
+    char *verb;
+    uint32_t key;               // 0 if the verb is not a valid key
+    int argc;                   // number of arguments after the verb
+    char *argv[CMD_MAX_ARGS];   // only the first CMD_MAX_ARGS are kept
+};
+
+struct command_handler {
+    uint32_t key;
+    unsigned int states;        // bit mask of the states where the command is accepted
+    int (*handle)(void *session, struct command *cmd);
+    const char *denied;         // reason given when used in another state
+};
+
+struct command_table {
+    const struct command_handler *handlers;
+    size_t count;
+    int (*unknown)(void *session, struct command *cmd);
+    int (*denied)(void *session, const struct command_handler *handler, struct command *cmd);
+};
+
+int cmd_parse(char *line, struct command *cmd);
+int cmd_dispatch(const struct command_table *table, void *session, unsigned int state,
+                 struct command *cmd);
+
+#endif
@@ -0,0 +1,340 @@
+/* credentials.c
+ * Password checks for the user file.
+ *
+ * A password in the user file is either in plain text or hashed, as
+ *
+ *   $pbkdf2-sha256$<iterations>$<salt>$<key>
+ *
+ * with the salt and the derived key in hexadecimal. Hashing is slow on
+ * purpose, so successful checks are remembered for CACHE_TTL_MS in a
+ * table in an anonymous shared mapping, created before any connection
+ * handler is forked and protected by a process-shared robust mutex. A
+ * check is identified by an HMAC of the user name, the password and
+ * the stored entry, keyed with a secret drawn at startup: the table
+ * holds no password, and a check is no longer found once the entry of
+ * the user changes. The table is set-associative; a new check replaces
+ * the entry of its set that expires first.
+ *
+ * Hashing is done by at most a fixed number of processes at once, each
+ * holding one of the worker slots, so that a burst of logins cannot
+ * take every CPU away from the listening process and the other
+ * sessions. A process that finds every slot taken waits for one.
+ * Slots are robust mutexes, so the slot of a process that dies while
+ * hashing is freed.
+ */
+
+#include "credentials.h"
+#include "sha256.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#define HASH_PREFIX      "$pbkdf2-sha256$"
+#define MAX_SALT_SIZE    64
+#define MAX_KEY_SIZE     64
+#define SALT_SIZE        16
+#define MAX_ITERATIONS   10000000
+#define MAX_WORKERS      64
+#define CACHE_TTL_MS     (60 * 1000)
+#define SET_BITS         8
+#define SETS             (1 << SET_BITS)
+#define WAYS             4
+
+struct verified_login {
+    unsigned char key[SHA256_SIZE];     // HMAC of the check
+    uint64_t expires_ms;                // 0 if the entry is unused
+};
+
+struct credential_cache {
+    pthread_mutex_t mutex;
+    unsigned int worker_count;
+    pthread_mutex_t workers[MAX_WORKERS];
+    unsigned char secret[SHA256_SIZE];
+    struct verified_login entries[SETS * WAYS];
+};
+
+static struct credential_cache *cache = NULL;
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Internal function that initializes a process-shared robust mutex.
+ */
+static void init_shared_mutex(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/** Internal function that locks a shared mutex, taking it over if its
+ *  owner died. The table holds no state that a partial update could
+ *  make harmful: at worst an entry is lost.
+ */
+static void lock_shared_mutex(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(mutex);
+}
+
+/** Creates the cache of successful checks and the worker slots. Must
+ *  be called before any connection handler is forked, so that all
+ *  processes share them. Without it, every check is hashed, with no
+ *  limit on concurrent hashing.
+ *
+ *  Parameters: workers: Number of processes allowed to hash at once,
+ *                       or 0 for one less than the number of CPUs.
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+int credentials_init(unsigned int workers) {
+
+    if (!workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 1 ? cpus - 1 : 1;
+    }
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    void *shared = mmap(NULL, sizeof(struct credential_cache), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+    struct credential_cache *new_cache = shared;
+    if (getrandom(new_cache->secret, sizeof(new_cache->secret), 0) != sizeof(new_cache->secret)) {
+        munmap(shared, sizeof(struct credential_cache));
+        return -1;
+    }
+
+    init_shared_mutex(&new_cache->mutex);
+    new_cache->worker_count = workers;
+    for (unsigned int i = 0; i < workers; i++)
+        init_shared_mutex(&new_cache->workers[i]);
+    cache = new_cache;
+    return 0;
+}
+
+/** Internal function that decodes hexadecimal digits.
+ *
+ *  Returns: Number of bytes decoded, or -1 if the digits are not valid
+ *           or do not fit.
+ */
+static int parse_hex(const char *hex, size_t length, unsigned char *bytes, size_t capacity) {
+    if (length % 2 || length / 2 > capacity)
+        return -1;
+    for (size_t i = 0; i < length; i++) {
+        char c = hex[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' :
+                    c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0)
+            return -1;
+        if (i % 2)
+            bytes[i / 2] |= digit;
+        else
+            bytes[i / 2] = digit << 4;
+    }
+    return length / 2;
+}
+
+/** Internal function that writes bytes as null-terminated hexadecimal
+ *  digits.
+ */
+static void format_hex(const unsigned char *bytes, size_t size, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++) {
+        hex[2 * i] = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    hex[2 * size] = '\0';
+}
+
+/** Internal function that compares two byte strings in a time that
+ *  does not depend on where they differ.
+ */
+static int equal_bytes(const unsigned char *a, const unsigned char *b, size_t size) {
+    unsigned char diff = 0;
+    for (size_t i = 0; i < size; i++)
+        diff |= a[i] ^ b[i];
+    return !diff;
+}
+
+/** Internal function that takes a worker slot, waiting for one if all
+ *  are taken.
+ *
+ *  Returns: Index of the slot, or -1 if there are no slots.
+ */
+static int take_worker(void) {
+    if (!cache)
+        return -1;
+    for (unsigned int i = 0; i < cache->worker_count; i++) {
+        int rv = pthread_mutex_trylock(&cache->workers[i]);
+        if (rv == EOWNERDEAD)
+            pthread_mutex_consistent(&cache->workers[i]);
+        if (!rv || rv == EOWNERDEAD)
+            return i;
+    }
+    // Waiters are spread over the slots
+    int slot = getpid() % cache->worker_count;
+    lock_shared_mutex(&cache->workers[slot]);
+    return slot;
+}
+
+static void release_worker(int slot) {
+    if (slot >= 0)
+        pthread_mutex_unlock(&cache->workers[slot]);
+}
+
+/** Internal function that checks a password against a hashed entry.
+ *
+ *  Returns: non-zero if the password matches, zero if it does not or
+ *           the entry is not valid.
+ */
+static int check_hash(const char *password, const char *stored) {
+
+    // $pbkdf2-sha256$<iterations>$<salt>$<key>
+    char *end;
+    errno = 0;
+    unsigned long iterations = strtoul(stored + strlen(HASH_PREFIX), &end, 10);
+    if (errno || !iterations || iterations > MAX_ITERATIONS || *end != '$')
+        return 0;
+    const char *salt_hex = end + 1;
+    const char *key_hex = strchr(salt_hex, '$');
+    if (!key_hex)
+        return 0;
+    key_hex++;
+
+    unsigned char salt[MAX_SALT_SIZE], expected[MAX_KEY_SIZE], key[MAX_KEY_SIZE];
+    int salt_size = parse_hex(salt_hex, key_hex - 1 - salt_hex, salt, sizeof(salt));
+    int key_size = parse_hex(key_hex, strlen(key_hex), expected, sizeof(expected));
+    if (salt_size < 0 || key_size <= 0)
+        return 0;
+
+    uint64_t start = metrics_now();
+    int slot = take_worker();
+    pbkdf2_sha256(password, strlen(password), salt, salt_size, iterations, key, key_size);
+    release_worker(slot);
+    metrics_time(TIMER_VERIFY_PASSWORD, start);
+    return equal_bytes(key, expected, key_size);
+}
+
+/** Internal function that computes the key identifying a check in the
+ *  cache.
+ */
+static void login_key(const char *username, const char *password, const char *stored,
+                      unsigned char key[SHA256_SIZE]) {
+    struct hmac_sha256 ctx;
+    hmac_sha256_init(&ctx, cache->secret, sizeof(cache->secret));
+    hmac_sha256_update(&ctx, username, strlen(username) + 1);
+    hmac_sha256_update(&ctx, password, strlen(password) + 1);
+    hmac_sha256_update(&ctx, stored, strlen(stored));
+    hmac_sha256_final(&ctx, key);
+}
+
+/** Internal function that looks for a check in the cache.
+ *
+ *  Returns: non-zero if the check succeeded less than CACHE_TTL_MS ago.
+ */
+static int cache_lookup(const unsigned char key[SHA256_SIZE]) {
+
+    struct verified_login *set = &cache->entries[(key[0] | key[1] << 8) % SETS * WAYS];
+    uint64_t now = now_ms();
+    int found = 0;
+
+    lock_shared_mutex(&cache->mutex);
+    for (int i = 0; i < WAYS && !found; i++)
+        found = set[i].expires_ms > now && equal_bytes(set[i].key, key, SHA256_SIZE);
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+/** Internal function that records a successful check in the cache.
+ */
+static void cache_insert(const unsigned char key[SHA256_SIZE]) {
+
+    struct verified_login *set = &cache->entries[(key[0] | key[1] << 8) % SETS * WAYS];
+    struct verified_login *victim = set;
+
+    lock_shared_mutex(&cache->mutex);
+    for (int i = 0; i < WAYS; i++) {
+        if (equal_bytes(set[i].key, key, SHA256_SIZE)) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].expires_ms < victim->expires_ms)
+            victim = &set[i];
+    }
+    memcpy(victim->key, key, SHA256_SIZE);
+    victim->expires_ms = now_ms() + CACHE_TTL_MS;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Checks a password against the entry of a user in the user file.
+ *
+ *  Parameters: username: Name of the user, as in the user file.
+ *              password: Password given by the client.
+ *              stored: Password entry of the user, in plain text or
+ *                      hashed.
+ *
+ *  Returns: non-zero (true) if the password matches, and zero (false)
+ *           otherwise.
+ */
+int credentials_check(const char *username, const char *password, const char *stored) {
+
+    if (strncmp(stored, HASH_PREFIX, strlen(HASH_PREFIX)))
+        return !strcmp(password, stored);
+    if (!cache)
+        return check_hash(password, stored);
+
+    unsigned char key[SHA256_SIZE];
+    login_key(username, password, stored, key);
+    if (cache_lookup(key)) {
+        metrics_add(COUNTER_LOGIN_CACHE_HITS, 1);
+        return 1;
+    }
+    if (!check_hash(password, stored))
+        return 0;
+    cache_insert(key);
+    return 1;
+}
+
+/** Hashes a password into an entry for the user file, with a random
+ *  salt.
+ *
+ *  Parameters: password: Password to hash.
+ *              iterations: Number of PBKDF2 iterations.
+ *              entry: Receives the entry.
+ *              size: Size of the entry buffer.
+ *
+ *  Returns: 0 on success, -1 if no random salt could be drawn or the
+ *           entry does not fit.
+ */
+int credentials_hash(const char *password, unsigned long iterations, char *entry, size_t size) {
+
+    unsigned char salt[SALT_SIZE], key[SHA256_SIZE];
+    if (!iterations || iterations > MAX_ITERATIONS ||
+        getrandom(salt, sizeof(salt), 0) != sizeof(salt))
+        return -1;
+    pbkdf2_sha256(password, strlen(password), salt, sizeof(salt), iterations, key, sizeof(key));
+
+    char salt_hex[2 * SALT_SIZE + 1], key_hex[2 * SHA256_SIZE + 1];
+    format_hex(salt, sizeof(salt), salt_hex);
+    format_hex(key, sizeof(key), key_hex);
+    int length = snprintf(entry, size, HASH_PREFIX "%lu$%s$%s", iterations, salt_hex, key_hex);
+    return length >= 0 && (size_t) length < size ? 0 : -1;
+}
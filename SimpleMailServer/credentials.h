@@ -0,0 +1,16 @@
+/* credentials.h
+ * Checks passwords against the entries of the user file, in plain text
+ * or hashed with PBKDF2-HMAC-SHA256, with a short-lived cache of
+ * successful checks shared by all server processes.
+ */
+
+#ifndef _CREDENTIALS_H_
+#define _CREDENTIALS_H_
+
+#include <stddef.h>
+
+int credentials_init(unsigned int workers);
+int credentials_check(const char *username, const char *password, const char *stored);
+int credentials_hash(const char *password, unsigned long iterations, char *entry, size_t size);
+
+#endif
@@ -0,0 +1,196 @@
+/* dotstuff.c
+ * Sends message data in the POP3 multi-line format.
+ *
+ * Data is never copied: the caller's data is split at the positions
+ * that need a fix, and the pieces are sent together with the bytes
+ * to be inserted (a dot before a dot that starts a line, a CR before
+ * a bare LF) as a batch of iovecs. Positions that need a fix are
+ * found sixteen bytes at a time with SSE2 when available.
+ *
+ * The status line buffered by the server is sent in the same sendmsg
+ * as the first batch, and a response sent in several batches is sent
+ * with the socket corked. A small segment sent on its own would
+ * otherwise hold back the next one (Nagle) until the client, which is
+ * only reading, sends a delayed ACK.
+ */
+
+#include "dotstuff.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define TERMINATION "\r\n.\r\n"
+
+/** Returns non-zero if a byte needs another byte inserted before it,
+ *  given the byte that precedes it.
+ */
+static inline int needs_fix(char before, char c) {
+    return (c == '.' && before == '\n') || (c == '\n' && before != '\r');
+}
+
+/** Prepares to send data to a socket.
+ *
+ *  Parameters: ds: Object to be initialized.
+ *              fd: Socket file descriptor.
+ */
+void ds_init(struct dot_stuffer *ds, int fd) {
+    ds->fd = fd;
+    ds->count = 0;
+    ds->failed = 0;
+    ds->corked = 0;
+    // The data starts at the beginning of a line
+    ds->prev = '\n';
+}
+
+/** Internal function that sends the queued data, after any output
+ *  buffered with set_send_buffering.
+ *
+ *  Parameters: ds: Object created with ds_init.
+ *
+ *  Returns: 0 on success, -1 if sending failed.
+ */
+static int send_batch(struct dot_stuffer *ds) {
+
+    struct msghdr msg = { 0 };
+    int first = 1, end = ds->count + 1;
+    const char *pending = send_pending(ds->fd, &ds->iov[0].iov_len);
+
+    if (pending) {
+        ds->iov[0].iov_base = (void *) pending;
+        first = 0;
+    }
+    while (!ds->failed && first < end) {
+        msg.msg_iov = ds->iov + first;
+        msg.msg_iovlen = end - first;
+        ssize_t rv = sendmsg(ds->fd, &msg, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0) {
+            ds->failed = 1;
+            break;
+        }
+        metrics_add(COUNTER_BYTES_OUT, rv);
+        // Skip what was sent, which may end in the middle of a piece
+        for (; first < end && (size_t) rv >= ds->iov[first].iov_len; first++)
+            rv -= ds->iov[first].iov_len;
+        if (rv > 0) {
+            ds->iov[first].iov_base = (char *) ds->iov[first].iov_base + rv;
+            ds->iov[first].iov_len -= rv;
+        }
+    }
+    if (pending)
+        send_discard(ds->fd);
+    ds->count = 0;
+    return ds->failed ? -1 : 0;
+}
+
+/** Internal function that adds a piece of data to the batch.
+ */
+static void add_piece(struct dot_stuffer *ds, const char *data, size_t len) {
+    if (!len)
+        return;
+    if (ds->count == DS_BATCH_SIZE)
+        ds_flush(ds);
+    ds->iov[ds->count + 1].iov_base = (void *) data;
+    ds->iov[ds->count + 1].iov_len = len;
+    ds->count++;
+}
+
+/** Internal function that sends everything before a position that
+ *  needs a fix, followed by the byte to be inserted there.
+ */
+static void fix_at(struct dot_stuffer *ds, const char *data, size_t *start, size_t pos) {
+    add_piece(ds, data + *start, pos - *start);
+    add_piece(ds, data[pos] == '.' ? "." : "\r", 1);
+    *start = pos;
+}
+
+/** Queues a block of message data to be sent. The data is not copied,
+ *  so it must remain valid until ds_flush or ds_finish is called;
+ *  batches may also be sent while this function runs. Blocks are
+ *  treated as consecutive parts of the same message.
+ *
+ *  Parameters: ds: Object created with ds_init.
+ *              data: Message data.
+ *              len: Number of bytes in data.
+ *
+ *  Returns: 0 on success, -1 if sending failed.
+ */
+int ds_write(struct dot_stuffer *ds, const char *data, size_t len) {
+
+    size_t start = 0, pos = 1;
+
+    if (!len)
+        return ds->failed ? -1 : 0;
+    if (needs_fix(ds->prev, data[0]))
+        fix_at(ds, data, &start, 0);
+
+#if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i dot = _mm_set1_epi8('.');
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (data + pos));
+        __m128i before = _mm_loadu_si128((const __m128i *) (data + pos - 1));
+        __m128i stuff = _mm_and_si128(_mm_cmpeq_epi8(c, dot), _mm_cmpeq_epi8(before, lf));
+        __m128i bare = _mm_andnot_si128(_mm_cmpeq_epi8(before, cr), _mm_cmpeq_epi8(c, lf));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(stuff, bare));
+        while (mask) {
+            fix_at(ds, data, &start, pos + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; pos < len; pos++)
+        if (needs_fix(data[pos - 1], data[pos]))
+            fix_at(ds, data, &start, pos);
+
+    add_piece(ds, data + start, len - start);
+    ds->prev = data[len - 1];
+    return ds->failed ? -1 : 0;
+}
+
+/** Sends all queued data, so that the data passed to ds_write can be
+ *  reused. Output buffered with set_send_buffering is sent first, so
+ *  responses stay in order. Partial segments are held back by the
+ *  kernel until ds_finish is called.
+ *
+ *  Parameters: ds: Object created with ds_init.
+ *
+ *  Returns: 0 on success, -1 if sending failed.
+ */
+int ds_flush(struct dot_stuffer *ds) {
+    int on = 1;
+    // Fails on sockets other than TCP, which need no corking
+    if (!ds->corked && setsockopt(ds->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        ds->corked = 1;
+    return send_batch(ds);
+}
+
+/** Sends the termination line, after a CRLF if the message data did
+ *  not end with one, and flushes all queued data.
+ *
+ *  Parameters: ds: Object created with ds_init.
+ *
+ *  Returns: 0 on success, -1 if sending failed.
+ */
+int ds_finish(struct dot_stuffer *ds) {
+    if (ds->prev == '\n')
+        add_piece(ds, TERMINATION + 2, strlen(TERMINATION) - 2);
+    else
+        add_piece(ds, TERMINATION, strlen(TERMINATION));
+    int rv = send_batch(ds), off = 0;
+    // Uncorking sends the last partial segment right away
+    if (ds->corked)
+        setsockopt(ds->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    ds->corked = 0;
+    return rv;
+}
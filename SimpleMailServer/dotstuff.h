@@ -0,0 +1,30 @@
+/* dotstuff.h
+ * Sends message data in the POP3 multi-line format: lines starting
+ * with a dot are dot-stuffed, bare LFs become CRLF, and the data is
+ * followed by the termination line.
+ */
+
+#ifndef _DOTSTUFF_H_
+#define _DOTSTUFF_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define DS_BATCH_SIZE 256
+
+struct dot_stuffer {
+    int fd;
+    int count;
+    int failed;
+    int corked;
+    char prev;
+    // The first entry is kept for output buffered by the server
+    struct iovec iov[DS_BATCH_SIZE + 1];
+};
+
+void ds_init(struct dot_stuffer *ds, int fd);
+int ds_write(struct dot_stuffer *ds, const char *data, size_t len);
+int ds_flush(struct dot_stuffer *ds);
+int ds_finish(struct dot_stuffer *ds);
+
+#endif
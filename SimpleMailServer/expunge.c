@@ -0,0 +1,419 @@
+/* expunge.c
+ * Deferred removal of deleted email messages.
+ *
+ * When a session deletes messages, their names and inode numbers are
+ * appended to a tombstone journal in the mailbox directory, and an
+ * empty marker named after the mailbox is created in a queue
+ * directory. A background worker picks up queued mailboxes, claims
+ * their journal by renaming it, unlinks the files in one batch and
+ * then removes the claimed journal. Until then, anyone loading the
+ * mailbox hides the tombstoned messages. Inode numbers are recorded
+ * so that a new message saved under a reused name is never hidden or
+ * removed by mistake.
+ *
+ * Appending to the journal and claiming it are done under a lock on
+ * the journal, so that no entry is appended to a journal that was
+ * already claimed and read.
+ */
+
+#include "expunge.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define JOURNAL_NAME     ".tombstones"
+#define WORK_NAME        ".tombstones.work"
+#define QUEUE_DIRECTORY  ".expunge"
+#define WORKER_INTERVAL  2      // seconds between queue scans
+
+struct tombstone_set {
+    size_t count;
+    size_t capacity;
+    struct tombstone *entries;
+};
+
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_wakeup = PTHREAD_COND_INITIALIZER;
+static char *worker_base = NULL;
+// Process running the worker thread. Forked children get copies of
+// the mutex and condition variable that the worker may have held at
+// the time of the fork, so they must not use them.
+static pid_t worker_pid = 0;
+static void (*worker_expunged)(const char *mailbox) = NULL;
+
+/** Builds the name of the queue marker for a mailbox directory. The
+ *  queue directory is a sibling of the mailbox directories.
+ */
+static void queue_marker(const char *mailbox, char *out, size_t size) {
+    const char *slash = strrchr(mailbox, '/');
+    if (slash)
+        snprintf(out, size, "%.*s/%s/%s", (int) (slash - mailbox), mailbox,
+                 QUEUE_DIRECTORY, slash + 1);
+    else
+        snprintf(out, size, "%s/%s", QUEUE_DIRECTORY, mailbox);
+}
+
+/** Writes the whole buffer to a file descriptor, retrying on partial
+ *  writes. Returns 0 on success or -1 on error.
+ */
+static int write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t rv = write(fd, buf, size);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Internal function that opens a journal and locks it. A journal
+ *  claimed while waiting for the lock no longer has its name, so it is
+ *  left for the current one.
+ *
+ *  Parameters: path: Name of the journal.
+ *              flags: Flags used to open the journal.
+ *
+ *  Returns: Locked file descriptor, to be closed to unlock it, or -1
+ *           on error.
+ */
+static int lock_journal(const char *path, int flags) {
+    while (1) {
+        struct stat opened, current;
+        int fd = open(path, flags, 0600);
+        if (fd < 0)
+            return -1;
+        int rv;
+        while ((rv = flock(fd, LOCK_EX)) < 0 && errno == EINTR)
+            ;
+        if (rv < 0) {
+            close(fd);
+            return -1;
+        }
+        if (fstat(fd, &opened) == 0 && stat(path, &current) == 0 &&
+            opened.st_dev == current.st_dev && opened.st_ino == current.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+/** Records a list of messages to be removed from a mailbox. The
+ *  entries are appended to the mailbox journal and flushed to disk
+ *  before this function returns, so the deletion survives a crash.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              entries: Names (relative to the mailbox) and inode
+ *                       numbers of the messages to be removed.
+ *              count: Number of entries.
+ *
+ *  Returns: 0 if the deletion was recorded, -1 otherwise.
+ */
+int expunge_record(const char *mailbox, const struct tombstone *entries, size_t count) {
+
+    char path[PATH_MAX];
+    char *buf = NULL;
+    size_t size = 0;
+    int rv = 0;
+
+    if (!count)
+        return 0;
+
+    // Format the whole batch first so it is appended with a single write
+    FILE *mem = open_memstream(&buf, &size);
+    if (!mem)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+        fprintf(mem, "%lu %s\n", (unsigned long) entries[i].inode, entries[i].name);
+    if (fclose(mem) == EOF) {
+        free(buf);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", mailbox, JOURNAL_NAME);
+    int fd = lock_journal(path, O_WRONLY | O_APPEND | O_CREAT);
+    if (fd < 0 || write_all(fd, buf, size) < 0 || fsync(fd) < 0)
+        rv = -1;
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    if (rv < 0)
+        return rv;
+
+    // Queue the mailbox for the worker. If this fails the entries are
+    // still picked up by the scan done when the worker starts.
+    queue_marker(mailbox, path, sizeof(path));
+    *strrchr(path, '/') = 0;
+    mkdir(path, 0777);
+    path[strlen(path)] = '/';
+    fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd >= 0)
+        close(fd);
+
+    // Other processes rely on the marker, found by the periodic scan
+    if (worker_pid == getpid()) {
+        pthread_mutex_lock(&worker_mutex);
+        pthread_cond_signal(&worker_wakeup);
+        pthread_mutex_unlock(&worker_mutex);
+    }
+    return 0;
+}
+
+/** Internal function that adds the entries of a journal file to a
+ *  set of tombstones.
+ */
+static void read_journal(const char *file_name, struct tombstone_set *set) {
+
+    FILE *file = fopen(file_name, "r");
+    if (!file) return;
+
+    char line[NAME_MAX + 32];
+    while (fgets(line, sizeof(line), file)) {
+        char *name;
+        unsigned long inode = strtoul(line, &name, 10);
+        if (*name++ != ' ')
+            continue;
+        name[strcspn(name, "\n")] = 0;
+
+        if (set->count == set->capacity) {
+            set->capacity = set->capacity ? set->capacity * 2 : 16;
+            set->entries = realloc(set->entries, set->capacity * sizeof(struct tombstone));
+        }
+        set->entries[set->count].inode = inode;
+        set->entries[set->count].name = strdup(name);
+        set->count++;
+    }
+    fclose(file);
+}
+
+/** Compares tombstones by inode number, for sorting and searching.
+ */
+static int compare_tombstones(const void *a, const void *b) {
+    ino_t x = ((const struct tombstone *) a)->inode;
+    ino_t y = ((const struct tombstone *) b)->inode;
+    return x < y ? -1 : x > y;
+}
+
+/** Loads the messages of a mailbox that were deleted but not yet
+ *  removed by the worker.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *
+ *  Returns: A set of tombstones to be used with expunge_is_pending,
+ *           to be freed with expunge_free. NULL is returned (and is
+ *           a valid, empty, set) if there are no pending deletions.
+ */
+tombstone_set_t expunge_load(const char *mailbox) {
+
+    char path[PATH_MAX];
+    struct tombstone_set *set = calloc(1, sizeof(struct tombstone_set));
+
+    // The journal must be read before the claimed copy: the worker
+    // renames one into the other, and only deletes the claimed copy
+    // after the files it lists are gone.
+    snprintf(path, sizeof(path), "%s/%s", mailbox, JOURNAL_NAME);
+    read_journal(path, set);
+    snprintf(path, sizeof(path), "%s/%s", mailbox, WORK_NAME);
+    read_journal(path, set);
+
+    if (!set->count) {
+        expunge_free(set);
+        return NULL;
+    }
+    qsort(set->entries, set->count, sizeof(struct tombstone), compare_tombstones);
+    return set;
+}
+
+/** Checks if a message is in a set of pending deletions.
+ *
+ *  Parameters: set: Set returned by expunge_load.
+ *              name: Name of the message file, relative to the mailbox.
+ *              inode: Inode number of the message file.
+ *
+ *  Returns: non-zero if the message was deleted, zero otherwise.
+ */
+int expunge_is_pending(tombstone_set_t set, const char *name, ino_t inode) {
+
+    if (!set)
+        return 0;
+
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (set->entries[mid].inode < inode)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < set->count && set->entries[lo].inode == inode; lo++)
+        if (!strcmp(set->entries[lo].name, name))
+            return 1;
+    return 0;
+}
+
+/** Frees all memory used by a set of pending deletions.
+ */
+void expunge_free(tombstone_set_t set) {
+    if (!set)
+        return;
+    for (size_t i = 0; i < set->count; i++)
+        free(set->entries[i].name);
+    free(set->entries);
+    free(set);
+}
+
+/** Internal function that removes the files listed in a claimed
+ *  journal, then the journal itself.
+ */
+static void remove_claimed(const char *mailbox, const char *work) {
+
+    char path[PATH_MAX];
+    struct stat file_stat;
+    struct tombstone_set set = { 0 };
+
+    read_journal(work, &set);
+    for (size_t i = 0; i < set.count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", mailbox, set.entries[i].name);
+        // Only names are reused, so a different inode means the
+        // message was already removed and the name now holds new mail
+        if (lstat(path, &file_stat) == 0 && file_stat.st_ino == set.entries[i].inode) {
+            int removed = unlink(path);
+            // Deletions are carried out in the background
+            TRACE3(mail_unlink, 0, path, removed);
+        }
+        free(set.entries[i].name);
+    }
+    free(set.entries);
+    unlink(work);
+}
+
+/** Internal function that claims the journal of a mailbox by renaming
+ *  it, once the deletions being appended to it are recorded.
+ *
+ *  Returns: 0 if the journal was claimed, -1 if there is none.
+ */
+static int claim_journal(const char *journal, const char *work) {
+    int fd = lock_journal(journal, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int rv = rename(journal, work);
+    close(fd);
+    return rv;
+}
+
+/** Internal function that removes all pending deletions of a mailbox.
+ */
+static void expunge_mailbox(const char *mailbox) {
+
+    char journal[PATH_MAX], work[PATH_MAX];
+    snprintf(journal, sizeof(journal), "%s/%s", mailbox, JOURNAL_NAME);
+    snprintf(work, sizeof(work), "%s/%s", mailbox, WORK_NAME);
+
+    // A claimed journal left by an interrupted run goes first
+    int removed = 0;
+    if (access(work, F_OK) == 0) {
+        remove_claimed(mailbox, work);
+        removed = 1;
+    }
+    // Deletions recorded while a claimed journal is processed start a
+    // new journal, which is claimed in turn
+    while (claim_journal(journal, work) == 0) {
+        remove_claimed(mailbox, work);
+        removed = 1;
+    }
+    if (removed && worker_expunged)
+        worker_expunged(mailbox);
+}
+
+/** Internal function that expunges every mailbox in a directory
+ *  whose name is not hidden. Used with the base directory at startup
+ *  and with the queue directory afterwards.
+ */
+static void expunge_directory(const char *directory, int dequeue) {
+
+    char path[PATH_MAX];
+    DIR *dir = opendir(directory);
+    if (!dir) return;
+
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        if (dir_entry->d_name[0] == '.')
+            continue;
+        if (dequeue) {
+            // Dequeue before claiming, so deletions recorded from now
+            // on queue the mailbox again
+            snprintf(path, sizeof(path), "%s/%s", directory, dir_entry->d_name);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/%s", worker_base, dir_entry->d_name);
+        expunge_mailbox(path);
+    }
+    closedir(dir);
+}
+
+/** Body of the background worker thread.
+ */
+static void *expunge_worker(void *arg) {
+
+    char queue[PATH_MAX];
+    snprintf(queue, sizeof(queue), "%s/%s", worker_base, QUEUE_DIRECTORY);
+
+    // Pick up anything left behind by a previous run
+    expunge_directory(worker_base, 0);
+
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WORKER_INTERVAL;
+
+        pthread_mutex_lock(&worker_mutex);
+        pthread_cond_timedwait(&worker_wakeup, &worker_mutex, &deadline);
+        pthread_mutex_unlock(&worker_mutex);
+
+        expunge_directory(queue, 1);
+    }
+    return NULL;
+}
+
+/** Starts the background thread that removes deleted messages. The
+ *  thread wakes up when deletions are recorded by this process, and
+ *  periodically to handle deletions recorded by other processes
+ *  (e.g., forked connection handlers, which never signal it).
+ *
+ *  Parameters: base_directory: Directory containing all mailboxes.
+ *              expunged: Function called by the worker thread after
+ *                        messages are removed from a mailbox, or
+ *                        NULL.
+ *
+ *  Returns: 0 if the worker is running, -1 otherwise.
+ */
+int expunge_start_worker(const char *base_directory, void (*expunged)(const char *mailbox)) {
+
+    pthread_t thread;
+
+    if (worker_base)
+        return 0;
+    worker_base = strdup(base_directory);
+    worker_expunged = expunged;
+    worker_pid = getpid();
+    if (pthread_create(&thread, NULL, expunge_worker, NULL)) {
+        free(worker_base);
+        worker_base = NULL;
+        worker_pid = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,26 @@
+/* expunge.h
+ * Deferred removal of deleted email messages. Deletions are recorded
+ * in a per-mailbox tombstone journal and the files are unlinked later
+ * by a background worker.
+ */
+
+#ifndef _EXPUNGE_H_
+#define _EXPUNGE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct tombstone {
+    ino_t inode;
+    char *name;
+};
+
+typedef struct tombstone_set *tombstone_set_t;
+
+int expunge_record(const char *mailbox, const struct tombstone *entries, size_t count);
+tombstone_set_t expunge_load(const char *mailbox);
+int expunge_is_pending(tombstone_set_t set, const char *name, ino_t inode);
+void expunge_free(tombstone_set_t set);
+int expunge_start_worker(const char *base_directory, void (*expunged)(const char *mailbox));
+
+#endif
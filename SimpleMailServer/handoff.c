@@ -0,0 +1,271 @@
+/* handoff.c
+ * Listening socket handoff for graceful reloads.
+ *
+ * A server started with a reload socket path listens on a Unix domain
+ * socket at that path. A new instance started with the same path
+ * connects to it before creating its own listeners; the running
+ * instance then sends all its registered listening sockets in a single
+ * message (SCM_RIGHTS), each named so that the new instance can match
+ * them with its own configuration. Once the new instance acknowledges
+ * them, the old one stops accepting connections and drains its
+ * sessions, while the new one accepts from the same sockets: clients
+ * that connect in between wait in the listen queue instead of being
+ * refused. The new instance then takes over the path for the next
+ * reload.
+ */
+
+#include "handoff.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_SOCKETS     16
+#define MAX_NAME        64
+#define ACK_TIMEOUT_MS  5000
+#define HANDOFF_BACKLOG 4
+
+struct named_socket {
+    char name[MAX_NAME];
+    int fd;
+};
+
+// Sockets received from the previous instance, until taken
+static struct named_socket inherited[MAX_SOCKETS];
+static int inherited_count = 0;
+
+// Sockets passed on to the next instance
+static struct named_socket registered[MAX_SOCKETS];
+static int registered_count = 0;
+
+static int listen_fd = -1;
+
+/** Internal function that fills a Unix socket address.
+ *
+ *  Returns: 0 on success, -1 if the path is too long.
+ */
+static int make_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/** Internal function that receives the sockets of the running
+ *  instance listening at an address, if any, and acknowledges them.
+ *
+ *  Returns: Number of sockets received, or -1 if no instance is
+ *           running or the handoff failed; running is set to non-zero
+ *           if an instance was found.
+ */
+static int receive_sockets(const struct sockaddr_un *addr, int *running) {
+
+    *running = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    *running = 1;
+
+    char names[MAX_SOCKETS * MAX_NAME];
+    char control[CMSG_SPACE(MAX_SOCKETS * sizeof(int))];
+    struct iovec iov = { names, sizeof(names) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t size;
+    while ((size = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    struct cmsghdr *cmsg = size > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return -1;
+    }
+
+    // Names are null-terminated, in the order of the descriptors
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[MAX_SOCKETS];
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    const char *name = names;
+    for (int i = 0; i < count; i++) {
+        size_t length = name < names + size ? strnlen(name, names + size - name) : 0;
+        if (length && length < MAX_NAME) {
+            strcpy(inherited[inherited_count].name, name);
+            inherited[inherited_count++].fd = fds[i];
+        } else {
+            close(fds[i]);
+        }
+        name += length + 1;
+    }
+
+    // Only now may the old instance stop accepting
+    char ack = 1;
+    if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+        for (int i = 0; i < inherited_count; i++)
+            close(inherited[i].fd);
+        inherited_count = 0;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return inherited_count;
+}
+
+/** Takes over the listening sockets of a running instance, if one
+ *  listens at the reload socket path, then listens at that path for
+ *  the next instance. Must be called before any listening socket is
+ *  created.
+ *
+ *  Parameters: path: Path of the reload socket.
+ *
+ *  Returns: Number of sockets received (0 if no instance was
+ *           running), or -1 if the handoff failed or the reload socket
+ *           could not be created.
+ */
+int handoff_init(const char *path) {
+
+    struct sockaddr_un addr;
+    int running;
+    if (make_address(path, &addr) < 0)
+        return -1;
+
+    int received = receive_sockets(&addr, &running);
+    if (received >= 0)
+        log_info("handoff: took over %d listening sockets", received);
+    else if (running)
+        return -1;      // the running instance keeps the path
+
+    // The previous instance no longer uses the path, if it ever did
+    unlink(path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        return -1;
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, HANDOFF_BACKLOG) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    return received < 0 ? 0 : received;
+}
+
+/** Takes a listening socket received from the previous instance.
+ *
+ *  Parameters: name: Name the socket was registered with.
+ *
+ *  Returns: The socket descriptor, or -1 if no such socket was
+ *           received.
+ */
+int handoff_take(const char *name) {
+    for (int i = 0; i < inherited_count; i++) {
+        if (!strcmp(inherited[i].name, name)) {
+            int fd = inherited[i].fd;
+            inherited[i] = inherited[--inherited_count];
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/** Closes the sockets received from the previous instance that were
+ *  not taken, e.g., because a listener is no longer configured, so
+ *  that their clients are refused instead of waiting forever.
+ */
+void handoff_drop_unclaimed(void) {
+    for (int i = 0; i < inherited_count; i++) {
+        log_info("handoff: closing unused listening socket %s", inherited[i].name);
+        close(inherited[i].fd);
+    }
+    inherited_count = 0;
+}
+
+/** Adds a listening socket to those passed to the next instance.
+ *
+ *  Parameters: name: Name identifying the socket, e.g., its role and
+ *                    port.
+ *              fd: Listening socket descriptor.
+ */
+void handoff_register(const char *name, int fd) {
+    if (registered_count == MAX_SOCKETS || strlen(name) >= MAX_NAME)
+        return;
+    strcpy(registered[registered_count].name, name);
+    registered[registered_count++].fd = fd;
+}
+
+/** Returns the descriptor of the reload socket, to be polled for a
+ *  new instance, or -1 if there is none.
+ */
+int handoff_fd(void) {
+    return listen_fd;
+}
+
+/** Sends all registered sockets to a new instance connecting to the
+ *  reload socket, and waits for it to acknowledge them. On success,
+ *  the reload socket is closed and the caller must stop accepting
+ *  connections.
+ *
+ *  Returns: 0 if the new instance has the sockets, -1 otherwise.
+ */
+int handoff_send(void) {
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return -1;
+
+    char names[MAX_SOCKETS * MAX_NAME];
+    size_t size = 0;
+    int fds[MAX_SOCKETS];
+    for (int i = 0; i < registered_count; i++) {
+        size_t length = strlen(registered[i].name) + 1;
+        memcpy(names + size, registered[i].name, length);
+        size += length;
+        fds[i] = registered[i].fd;
+    }
+
+    char control[CMSG_SPACE(MAX_SOCKETS * sizeof(int))];
+    struct iovec iov = { names, size };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(registered_count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(registered_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, registered_count * sizeof(int));
+
+    char ack = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (!registered_count || sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ||
+        poll(&pfd, 1, ACK_TIMEOUT_MS) <= 0 || recv(fd, &ack, 1, 0) != 1 || ack != 1) {
+        log_warn("handoff: new instance did not take the listening sockets");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    handoff_close();
+    return 0;
+}
+
+/** Closes the reload socket of this process, e.g., in forked
+ *  connection handlers.
+ */
+void handoff_close(void) {
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+}
@@ -0,0 +1,18 @@
+/* handoff.h
+ * Passes listening sockets from a running server to its replacement
+ * over a Unix domain socket, so that a restart refuses no connection.
+ */
+
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+int handoff_init(const char *path);
+int handoff_take(const char *name);
+void handoff_drop_unclaimed(void);
+void handoff_register(const char *name, int fd);
+
+int handoff_fd(void);
+int handoff_send(void);
+void handoff_close(void);
+
+#endif
@@ -0,0 +1,349 @@
+/* logger.c
+ * Asynchronous logging.
+ *
+ * Each thread that logs gets its own ring of fixed-size records, with
+ * a single producer (the thread) and a single consumer (the writer).
+ * Producers format the message into the next free record and publish
+ * it by advancing the ring head; no lock is taken and no system call
+ * is made, unless the writer is idle. A background writer thread
+ * drains all rings in batches, adds the time stamp, level and thread
+ * ID to each record, and sends the result to the log file with one
+ * write per batch. If a ring is full the record is dropped and counted
+ * instead of blocking the producer; the writer reports the number of
+ * dropped records.
+ *
+ * When the rings are empty the writer marks itself idle and sleeps on
+ * an eventfd. The first record published after that wakes it up, so
+ * an idle process makes no wakeups besides a long timeout. A forked
+ * child starts its own writer when it logs its first record.
+ */
+
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define RING_SIZE       1024    // records per thread, a power of two
+#define RECORD_TEXT     200     // longer messages are truncated
+#define BATCH_SIZE      65536   // bytes written at a time by the writer
+#define IDLE_TIMEOUT    1000    // milliseconds between idle ring scans
+
+struct log_record {
+    struct timespec time;
+    int level;
+    int len;
+    char text[RECORD_TEXT];
+};
+
+struct log_ring {
+    _Atomic unsigned long head;         // next record to be written
+    _Atomic unsigned long tail;         // next record to be read
+    _Atomic int closed;                 // thread has exited
+    long tid;
+    struct log_ring *next;
+    struct log_record records[RING_SIZE];
+};
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static _Atomic int log_level = LOG_LEVEL_INFO;
+static _Atomic unsigned long dropped = 0;
+
+// Rings are added by producers and removed by the writer, both under
+// rings_mutex; only the writer (or log_flush) reads records, under
+// drain_mutex.
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *thread_ring = NULL;
+
+static int log_fd = STDERR_FILENO;
+static int writer_started = 0;
+static unsigned long dropped_reported = 0;
+
+// The writer sets writer_idle before sleeping on wakeup_fd; the first
+// producer that sees it set clears it and wakes the writer. After a
+// fork, writer_needed makes the first record start the child's writer.
+static int wakeup_fd = -1;
+static _Atomic int writer_idle = 0;
+static _Atomic int writer_needed = 0;
+
+static int start_writer(void);
+
+/** Internal function called when a thread that logged exits. The ring
+ *  is freed by the writer once its records are written.
+ */
+static void close_ring(void *ring) {
+    atomic_store(&((struct log_ring *) ring)->closed, 1);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, close_ring);
+}
+
+/** Internal function that returns the ring of the calling thread,
+ *  creating it on first use.
+ */
+static struct log_ring *get_ring(void) {
+
+    if (thread_ring)
+        return thread_ring;
+
+    struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+    if (!ring)
+        return NULL;
+    ring->tid = syscall(SYS_gettid);
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    return thread_ring = ring;
+}
+
+/** Queues a message to be written to the log, if its level is enabled.
+ *  Usually called through the log_error, log_warn, log_info and
+ *  log_debug macros, which are removed at compile time for levels
+ *  above LOG_MAX_LEVEL. A line break is added to the message.
+ *
+ *  Parameters: level: Level of the message, e.g., LOG_LEVEL_INFO.
+ *              fmt: A printf-like formatting string.
+ */
+void log_write(int level, const char *fmt, ...) {
+
+    if (level > atomic_load_explicit(&log_level, memory_order_relaxed))
+        return;
+    struct log_ring *ring = get_ring();
+    if (!ring) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *record = &ring->records[head % RING_SIZE];
+    va_list args;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    va_start(args, fmt);
+    int len = vsnprintf(record->text, RECORD_TEXT, fmt, args);
+    va_end(args);
+    record->len = len < 0 ? 0 : len < RECORD_TEXT ? len : RECORD_TEXT - 1;
+    // Messages used to end with their own line breaks
+    while (record->len && record->text[record->len - 1] == '\n')
+        record->len--;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    if (atomic_load_explicit(&writer_needed, memory_order_relaxed) &&
+        atomic_exchange(&writer_needed, 0))
+        start_writer();
+    // Pairs with the fence in log_writer, so that either the writer
+    // sees the record or this thread sees that it is idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&writer_idle, memory_order_relaxed) &&
+        atomic_exchange(&writer_idle, 0))
+        eventfd_write(wakeup_fd, 1);
+}
+
+/** Internal function that writes a batch to the log file.
+ */
+static void write_batch(const char *batch, size_t size) {
+    while (size > 0) {
+        ssize_t rv = write(log_fd, batch, size);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return;
+        batch += rv;
+        size -= rv;
+    }
+}
+
+/** Internal function that formats one record as a line of the log:
+ *  time stamp, level, thread ID and message.
+ */
+static size_t format_record(char *out, const struct log_record *record, long tid) {
+    struct tm tm;
+    gmtime_r(&record->time.tv_sec, &tm);
+    size_t len = strftime(out, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+    len += sprintf(out + len, ".%06ldZ %-5s [%ld] ", record->time.tv_nsec / 1000,
+                   level_names[record->level], tid);
+    memcpy(out + len, record->text, record->len);
+    len += record->len;
+    out[len++] = '\n';
+    return len;
+}
+
+/** Internal function that writes all queued records and frees the
+ *  rings of threads that have exited. Called with drain_mutex held.
+ *
+ *  Returns: Number of records written.
+ */
+static size_t drain(void) {
+
+    static char batch[BATCH_SIZE];
+    size_t used = 0, count = 0;
+
+    pthread_mutex_lock(&rings_mutex);
+    for (struct log_ring **link = &rings; *link; ) {
+        struct log_ring *ring = *link;
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (; tail != head; tail++, count++) {
+            if (BATCH_SIZE - used < RECORD_TEXT + 64) {
+                write_batch(batch, used);
+                used = 0;
+            }
+            used += format_record(batch + used, &ring->records[tail % RING_SIZE], ring->tid);
+            // Give the record back as soon as it is copied
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+
+        if (closed) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    unsigned long total = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (total != dropped_reported) {
+        used += sprintf(batch + used, "log: %lu records dropped, rings were full\n",
+                        total - dropped_reported);
+        dropped_reported = total;
+    }
+    write_batch(batch, used);
+    return count;
+}
+
+/** Internal function run by the writer thread.
+ */
+static void *log_writer(void *arg) {
+
+    struct pollfd wakeup = { .fd = wakeup_fd, .events = POLLIN };
+    eventfd_t value;
+
+    while (1) {
+        pthread_mutex_lock(&drain_mutex);
+        size_t count = drain();
+        if (!count) {
+            // Records published before the flag was seen are drained
+            // here; later ones wake the writer up
+            atomic_store(&writer_idle, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            count = drain();
+        }
+        pthread_mutex_unlock(&drain_mutex);
+        if (count) {
+            atomic_store(&writer_idle, 0);
+            continue;
+        }
+        // Without an eventfd, poll only waits for the timeout
+        if (poll(&wakeup, 1, IDLE_TIMEOUT) > 0)
+            eventfd_read(wakeup_fd, &value);
+        atomic_store(&writer_idle, 0);
+    }
+    return NULL;
+}
+
+/** Internal function that starts the writer thread.
+ */
+static int start_writer(void) {
+    pthread_t thread;
+    if (wakeup_fd < 0)
+        wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pthread_create(&thread, NULL, log_writer, NULL))
+        return -1;
+    pthread_detach(thread);
+    writer_started = 1;
+    return 0;
+}
+
+/** Internal function called in the child after a fork. Only the
+ *  calling thread exists in the child, so records copied from the
+ *  parent's rings are discarded (the parent writes them). A new writer
+ *  is started with the first record logged by the child, with an
+ *  eventfd of its own.
+ */
+static void restart_after_fork(void) {
+    pthread_mutex_init(&rings_mutex, NULL);
+    pthread_mutex_init(&drain_mutex, NULL);
+    for (struct log_ring *ring = rings; ring; ring = ring->next)
+        atomic_store(&ring->tail, atomic_load(&ring->head));
+    dropped_reported = atomic_load(&dropped);
+    if (wakeup_fd >= 0)
+        close(wakeup_fd);
+    wakeup_fd = -1;
+    atomic_store(&writer_idle, 0);
+    atomic_store(&writer_needed, writer_started);
+}
+
+/** Starts the writer thread. Messages logged before this call are kept
+ *  (up to the size of the ring) and written once the writer starts.
+ *
+ *  Parameters: file_name: File the log is appended to, or NULL to
+ *                         write to the standard error stream.
+ *
+ *  Returns: 0 on success, -1 if the file could not be opened or the
+ *           thread could not be created.
+ */
+int log_init(const char *file_name) {
+
+    if (file_name) {
+        int fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+        log_fd = fd;
+    }
+    if (writer_started)
+        return 0;
+    pthread_atfork(NULL, NULL, restart_after_fork);
+    atexit(log_flush);
+    return start_writer();
+}
+
+/** Sets the most detailed level of messages written to the log.
+ *  Messages above LOG_MAX_LEVEL are never written.
+ *
+ *  Parameters: level: e.g., LOG_LEVEL_DEBUG to write all messages.
+ */
+void log_set_level(int level) {
+    atomic_store(&log_level, level);
+}
+
+/** Writes all queued records right away, e.g., before exiting.
+ */
+void log_flush(void) {
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+/** Returns the number of records dropped because a ring was full.
+ */
+unsigned long log_dropped(void) {
+    return atomic_load(&dropped);
+}
@@ -0,0 +1,53 @@
+/* logger.h
+ * Asynchronous logging: producers copy records into per-thread ring
+ * buffers, and a background thread writes them out in batches.
+ */
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+// Levels, from most to least important
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+// Messages above this level are removed at compile time, e.g., build
+// with -DLOG_MAX_LEVEL=LOG_LEVEL_INFO to drop all debug messages.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+int log_init(const char *file_name);
+void log_set_level(int level);
+void log_flush(void);
+unsigned long log_dropped(void);
+
+void log_write(int level, const char *fmt, ...)
+  __attribute__ ((format(printf, 2, 3)));
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) ((void) 0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void) 0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void) 0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void) 0)
+#endif
+
+#endif
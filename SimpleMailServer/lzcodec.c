@@ -0,0 +1,204 @@
+/* lzcodec.c
+ * A small, self-contained LZ77-family block codec used to compress
+ * stored mail messages.
+ *
+ * A compressed block is a sequence of commands. Each command starts
+ * with a token byte: the high nibble holds the number of literal
+ * bytes that follow, the low nibble holds the length of the match
+ * that follows the literals (minus MIN_MATCH). A nibble value of 15
+ * means the length continues in extra bytes, each added to the
+ * total, until a byte other than 255 is found. After the literals
+ * comes a two-byte little-endian offset back into the already
+ * decoded output. The last command of a block holds only literals
+ * and no offset: the decoder identifies it by reaching the end of
+ * the input right after the literals.
+ */
+
+#include "lzcodec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH  4
+#define MAX_OFFSET 65535
+#define HASH_BITS  12
+#define RUN_MASK   15
+
+/** Reads four bytes from a possibly unaligned address.
+ */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/** Multiplicative hash of a four-byte sequence into the match table.
+ */
+static unsigned int hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** Writes the continuation bytes of a length that did not fit in a
+ *  token nibble.
+ */
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+/** Reads the continuation bytes of a length. Returns 0 on success, or
+ *  -1 if the input ends before the length is complete.
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/** Writes a single command (literals, then an optional match).
+ */
+static unsigned char *emit(unsigned char *op, const unsigned char *lit, size_t nlit,
+                           size_t offset, size_t mlen) {
+    unsigned char *token = op++;
+    size_t mcode = mlen ? mlen - MIN_MATCH : 0;
+
+    *token = (nlit < RUN_MASK ? nlit : RUN_MASK) << 4;
+    if (nlit >= RUN_MASK)
+        op = put_length(op, nlit - RUN_MASK);
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        *token |= mcode < RUN_MASK ? mcode : RUN_MASK;
+        if (mcode >= RUN_MASK)
+            op = put_length(op, mcode - RUN_MASK);
+    }
+    return op;
+}
+
+/** Returns the largest possible compressed size for an input of the
+ *  given size. Buffers passed to lz_compress must be at least this
+ *  big.
+ */
+size_t lz_compress_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+/** Compresses a block of data.
+ *
+ *  Parameters: src: Data to be compressed.
+ *              size: Number of bytes in src, at most LZ_MAX_BLOCK_SIZE.
+ *              dst: Buffer where the compressed data will be stored.
+ *              capacity: Size of dst, at least lz_compress_bound(size).
+ *
+ *  Returns: The number of bytes written to dst, or 0 if the
+ *           parameters are invalid.
+ */
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity) {
+
+    uint32_t table[1 << HASH_BITS];
+    const unsigned char *base = (const unsigned char *) src;
+    const unsigned char *ip = base, *anchor = base;
+    const unsigned char *end = base + size;
+    unsigned char *op = (unsigned char *) dst;
+
+    if (size > LZ_MAX_BLOCK_SIZE || capacity < lz_compress_bound(size))
+        return 0;
+
+    // Table entries hold a position plus one, so that zero means empty
+    memset(table, 0, sizeof(table));
+
+    while (size >= MIN_MATCH && ip <= end - MIN_MATCH) {
+
+        uint32_t seq = read32(ip);
+        unsigned int h = hash32(seq);
+        uint32_t candidate = table[h];
+        table[h] = ip - base + 1;
+
+        const unsigned char *ref = base + candidate - 1;
+        if (!candidate || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+            // Skip faster through data that does not seem to compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const unsigned char *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+        while (mp < end && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        op = emit(op, anchor, ip - anchor, ip - ref, mp - ip);
+        ip = anchor = mp;
+    }
+
+    op = emit(op, anchor, end - anchor, 0, 0);
+    return op - (unsigned char *) dst;
+}
+
+/** Decompresses a block of data produced by lz_compress. The input is
+ *  fully validated, so corrupted data results in an error rather than
+ *  in reads or writes outside the provided buffers.
+ *
+ *  Parameters: src: Compressed data.
+ *              size: Number of bytes in src.
+ *              dst: Buffer where the decompressed data will be stored.
+ *              capacity: Size of dst.
+ *
+ *  Returns: The number of bytes written to dst, or -1 if the data is
+ *           corrupted or does not fit in dst.
+ */
+long lz_decompress(const char *src, size_t size, char *dst, size_t capacity) {
+
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + size;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + capacity;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == RUN_MASK && get_length(&ip, iend, &nlit) < 0)
+            return -1;
+        if (nlit > (size_t) (iend - ip) || nlit > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        // The last command has no match part
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t mlen = token & RUN_MASK;
+        if (mlen == RUN_MASK && get_length(&ip, iend, &mlen) < 0)
+            return -1;
+        mlen += MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst) ||
+            mlen > (size_t) (oend - op))
+            return -1;
+
+        // Matches may overlap their own output, so copy byte by byte
+        const unsigned char *ref = op - offset;
+        while (mlen--)
+            *op++ = *ref++;
+    }
+
+    return op - (unsigned char *) dst;
+}
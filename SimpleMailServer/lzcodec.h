@@ -0,0 +1,20 @@
+/* lzcodec.h
+ * A small, self-contained LZ77-family block codec used to compress
+ * stored mail messages. The format is byte oriented (no entropy
+ * coding), trading some ratio for very fast compression and
+ * decompression.
+ */
+
+#ifndef _LZCODEC_H_
+#define _LZCODEC_H_
+
+#include <stddef.h>
+
+// Largest input accepted by a single call to lz_compress.
+#define LZ_MAX_BLOCK_SIZE 65536
+
+size_t lz_compress_bound(size_t size);
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+long lz_decompress(const char *src, size_t size, char *dst, size_t capacity);
+
+#endif
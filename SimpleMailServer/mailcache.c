@@ -0,0 +1,381 @@
+/* mailcache.c
+ * A cache of mailbox metadata shared by all server processes.
+ *
+ * The cache lives in an anonymous shared mapping created before any
+ * connection handler is forked, protected by a process-shared robust
+ * mutex. Entries are packed one after the other in a data area of
+ * fixed size (the memory budget), and found through an open
+ * addressing hash index. When space is needed, the least recently
+ * used entries are evicted and the remaining entries are moved down
+ * to close the gaps.
+ *
+ * Mailbox generations are counters kept in a small file mapped by
+ * every process, including processes that do not use the cache
+ * (e.g., the SMTP server, which only bumps them). Counters are
+ * indexed by a hash of the mailbox name, so two mailboxes may share a
+ * counter; that only causes extra invalidations.
+ */
+
+#include "mailcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GENERATION_SLOTS 4096
+#define MAX_KEY_SIZE     256
+#define SLOT_EMPTY       0
+#define SLOT_DELETED     UINT32_MAX
+#define ALIGN(n)         (((n) + 7) & ~(size_t) 7)
+
+struct cache_entry {
+    size_t length;          // bytes used by the entry, header included
+    uint64_t generation;
+    uint64_t last_used;
+    size_t data_size;
+    uint32_t slot;          // index slot pointing to this entry
+    uint32_t live;
+    char key[MAX_KEY_SIZE];
+    char data[];
+};
+
+struct cache_header {
+    pthread_mutex_t mutex;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t live_bytes;      // bytes used by live entries
+    size_t used;            // end of the last entry in the data area
+    size_t capacity;        // size of the data area
+    uint32_t nslots;
+    uint32_t deleted_slots;
+    // Slots hold the offset of an entry divided by 8, plus one.
+    uint32_t index[];
+};
+
+static struct cache_header *cache = NULL;
+static char *cache_data = NULL;
+static uint64_t *generations = NULL;
+
+/** FNV-1a hash of a string.
+ */
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 14695981039346656037ull;
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static struct cache_entry *entry_at(size_t offset) {
+    return (struct cache_entry *) (cache_data + offset);
+}
+
+/** Finds the entry for a key. If the key is not found and free_slot
+ *  is not NULL, stores in it the slot where the key can be inserted.
+ */
+static struct cache_entry *lookup(const char *key, uint32_t *free_slot) {
+
+    uint32_t mask = cache->nslots - 1;
+    uint32_t i = hash_key(key) & mask;
+    uint32_t first_free = SLOT_DELETED;
+
+    for (uint32_t n = 0; n < cache->nslots; n++, i = (i + 1) & mask) {
+        uint32_t v = cache->index[i];
+        if (v == SLOT_EMPTY) {
+            if (first_free == SLOT_DELETED)
+                first_free = i;
+            break;
+        }
+        if (v == SLOT_DELETED) {
+            if (first_free == SLOT_DELETED)
+                first_free = i;
+            continue;
+        }
+        struct cache_entry *entry = entry_at((size_t) (v - 1) * 8);
+        if (!strcmp(entry->key, key))
+            return entry;
+    }
+    if (free_slot)
+        *free_slot = first_free;
+    return NULL;
+}
+
+/** Removes an entry from the index. Its space is reclaimed by the
+ *  next compaction.
+ */
+static void remove_entry(struct cache_entry *entry) {
+    cache->index[entry->slot] = SLOT_DELETED;
+    cache->deleted_slots++;
+    cache->entries--;
+    cache->live_bytes -= entry->length;
+    entry->live = 0;
+}
+
+/** Drops all entries.
+ */
+static void reset(void) {
+    memset(cache->index, 0, cache->nslots * sizeof(uint32_t));
+    cache->entries = cache->live_bytes = cache->used = 0;
+    cache->deleted_slots = 0;
+}
+
+/** Moves all live entries to the start of the data area and rebuilds
+ *  the index.
+ */
+static void compact(void) {
+
+    size_t from = 0, to = 0;
+    memset(cache->index, 0, cache->nslots * sizeof(uint32_t));
+    cache->deleted_slots = 0;
+
+    while (from < cache->used) {
+        struct cache_entry *entry = entry_at(from);
+        size_t length = entry->length;
+        if (entry->live) {
+            if (to != from)
+                memmove(cache_data + to, entry, length);
+            entry = entry_at(to);
+            lookup(entry->key, &entry->slot);
+            cache->index[entry->slot] = to / 8 + 1;
+            to += length;
+        }
+        from += length;
+    }
+    cache->used = to;
+}
+
+/** Evicts the least recently used entry.
+ */
+static void evict_lru(void) {
+
+    struct cache_entry *victim = NULL;
+    for (size_t offset = 0; offset < cache->used; offset += entry_at(offset)->length) {
+        struct cache_entry *entry = entry_at(offset);
+        if (entry->live && (!victim || entry->last_used < victim->last_used))
+            victim = entry;
+    }
+    if (victim) {
+        remove_entry(victim);
+        cache->evictions++;
+    }
+}
+
+/** Locks the cache. If a process died while holding the lock, the
+ *  cache contents cannot be trusted and are dropped.
+ */
+static int cache_lock(void) {
+    int rv = pthread_mutex_lock(&cache->mutex);
+    if (rv == EOWNERDEAD) {
+        reset();
+        pthread_mutex_consistent(&cache->mutex);
+        rv = 0;
+    }
+    return rv;
+}
+
+static void cache_unlock(void) {
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Creates the shared cache. Must be called before any connection
+ *  handler is forked, so that all processes share the same cache.
+ *
+ *  Parameters: budget: Maximum amount of memory, in bytes, used by
+ *                      the cache, including its index. Zero disables
+ *                      the cache.
+ *
+ *  Returns: 0 on success, -1 if the cache could not be created.
+ */
+int mailcache_init(size_t budget) {
+
+    if (!budget)
+        return 0;
+
+    // Size the index so that it is at most half full when the data
+    // area holds only the smallest possible entries
+    size_t max_entries = budget / sizeof(struct cache_entry) + 1;
+    uint32_t nslots = 16;
+    while (nslots < 2 * max_entries)
+        nslots *= 2;
+    size_t header = ALIGN(sizeof(struct cache_header) + nslots * sizeof(uint32_t));
+    if (budget <= header + sizeof(struct cache_entry))
+        return -1;
+
+    void *shared = mmap(NULL, budget, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+
+    cache = shared;
+    cache_data = (char *) shared + header;
+    cache->capacity = budget - header;
+    cache->nslots = nslots;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+/** Retrieves a copy of the data cached for a key, if it was built
+ *  from the given generation.
+ *
+ *  Parameters: key: Name of the mailbox.
+ *              generation: Current generation of the mailbox (see
+ *                          mailcache_generation).
+ *              size: Receives the size of the returned data.
+ *
+ *  Returns: A copy of the cached data, to be freed by the caller, or
+ *           NULL if there is no entry for this key and generation.
+ */
+void *mailcache_get(const char *key, uint64_t generation, size_t *size) {
+
+    void *rv = NULL;
+
+    if (!cache || !generations || cache_lock())
+        return NULL;
+
+    struct cache_entry *entry = lookup(key, NULL);
+    if (entry && entry->generation == generation && (rv = malloc(entry->data_size ? entry->data_size : 1))) {
+        memcpy(rv, entry->data, entry->data_size);
+        *size = entry->data_size;
+        entry->last_used = ++cache->clock;
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+
+    cache_unlock();
+    return rv;
+}
+
+/** Stores data for a key, replacing any previous entry. Entries that
+ *  are larger than the whole cache are not stored.
+ *
+ *  Parameters: key: Name of the mailbox.
+ *              generation: Generation of the mailbox the data was
+ *                          built from, read before building it.
+ *              data: Data to be copied into the cache.
+ *              size: Number of bytes in data.
+ */
+void mailcache_put(const char *key, uint64_t generation, const void *data, size_t size) {
+
+    size_t length = ALIGN(sizeof(struct cache_entry) + size);
+    uint32_t slot;
+
+    if (!cache || !generations || strlen(key) >= MAX_KEY_SIZE || length > cache->capacity)
+        return;
+    if (cache_lock())
+        return;
+
+    struct cache_entry *entry = lookup(key, NULL);
+    if (entry)
+        remove_entry(entry);
+    while (cache->capacity - cache->live_bytes < length)
+        evict_lru();
+    if (cache->capacity - cache->used < length || cache->deleted_slots > cache->nslots / 4)
+        compact();
+
+    lookup(key, &slot);
+    entry = entry_at(cache->used);
+    entry->length = length;
+    entry->generation = generation;
+    entry->last_used = ++cache->clock;
+    entry->data_size = size;
+    entry->slot = slot;
+    entry->live = 1;
+    strcpy(entry->key, key);
+    memcpy(entry->data, data, size);
+
+    if (cache->index[slot] == SLOT_DELETED)
+        cache->deleted_slots--;
+    cache->index[slot] = cache->used / 8 + 1;
+    cache->used += length;
+    cache->live_bytes += length;
+    cache->entries++;
+
+    cache_unlock();
+}
+
+/** Copies the current cache statistics. All values are zero if the
+ *  cache is disabled.
+ *
+ *  Parameters: stats: Structure that receives the statistics.
+ */
+void mailcache_get_stats(struct mailcache_stats *stats) {
+
+    memset(stats, 0, sizeof(struct mailcache_stats));
+    if (!cache || cache_lock())
+        return;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->entries;
+    stats->used = cache->live_bytes;
+    stats->capacity = cache->capacity;
+    cache_unlock();
+}
+
+/** Maps the file holding mailbox generations, creating it if needed.
+ *  Calling it again once the file is mapped has no effect.
+ *
+ *  Parameters: generation_file: Name of the generations file.
+ *
+ *  Returns: 0 if the generations are available, -1 otherwise.
+ */
+int mailcache_attach(const char *generation_file) {
+
+    struct stat file_stat;
+    size_t size = GENERATION_SLOTS * sizeof(uint64_t);
+
+    if (generations)
+        return 0;
+
+    int fd = open(generation_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &file_stat) < 0 || (file_stat.st_size < size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    generations = map;
+    return 0;
+}
+
+/** Returns the current generation of a mailbox. Data read from the
+ *  mailbox after this call is at least as recent as this generation.
+ *
+ *  Parameters: key: Name of the mailbox.
+ */
+uint64_t mailcache_generation(const char *key) {
+    if (!generations)
+        return 0;
+    return __atomic_load_n(&generations[hash_key(key) % GENERATION_SLOTS], __ATOMIC_ACQUIRE);
+}
+
+/** Bumps the generation of a mailbox, invalidating any cached data.
+ *  Must be called after the mailbox is modified.
+ *
+ *  Parameters: key: Name of the mailbox.
+ */
+void mailcache_invalidate(const char *key) {
+    if (generations)
+        __atomic_add_fetch(&generations[hash_key(key) % GENERATION_SLOTS], 1, __ATOMIC_RELEASE);
+}
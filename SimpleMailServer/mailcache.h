@@ -0,0 +1,32 @@
+/* mailcache.h
+ * A cache of mailbox metadata shared by all server processes, bounded
+ * by a memory budget and evicted in least-recently-used order. Each
+ * entry is tagged with the mailbox generation it was built from, and
+ * generations are bumped whenever messages are added or removed.
+ */
+
+#ifndef _MAILCACHE_H_
+#define _MAILCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mailcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t used;
+    size_t capacity;
+};
+
+int mailcache_init(size_t budget);
+void *mailcache_get(const char *key, uint64_t generation, size_t *size);
+void mailcache_put(const char *key, uint64_t generation, const void *data, size_t size);
+void mailcache_get_stats(struct mailcache_stats *stats);
+
+int mailcache_attach(const char *generation_file);
+uint64_t mailcache_generation(const char *key);
+void mailcache_invalidate(const char *key);
+
+#endif
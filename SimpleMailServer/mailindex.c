@@ -0,0 +1,449 @@
+/* mailindex.c
+ * Per-mailbox index of message metadata.
+ *
+ * The index is made of two append-only files in the mailbox
+ * directory. The record file holds one fixed-size record per
+ * delivered message. The lines file holds, for each message, the
+ * offsets of its body lines relative to the start of the body; a
+ * record points to its offsets in the lines file.
+ *
+ * Delivery appends to both files without any locking, relying on
+ * O_APPEND writes being atomic. The index only speeds things up: a
+ * message without a valid record is still found by reading the
+ * mailbox directory. This allows the index to be compacted by
+ * rewriting and renaming both files even if a delivery is in
+ * progress. A record written to a file that was just replaced is
+ * lost, which only means that message is handled without the index.
+ * Each lines file has a random epoch, copied into the records that
+ * point into it, so a record is never used with the wrong lines file.
+ */
+
+#include "mailindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define RECORDS_NAME   ".index"
+#define LINES_NAME     ".lines"
+#define INDEX_MAGIC    "SMIX"
+#define LINES_MAGIC    "SMLI"
+#define INDEX_VERSION  2
+#define SCAN_BLOCK     65536
+
+struct index_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct lines_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t epoch;
+};
+
+/** Returns a new random epoch for a lines file.
+ */
+static uint64_t new_epoch(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t) getpid() << 16) ^ random();
+}
+
+/** Reads exactly size bytes at an offset. Returns 0 on success.
+ */
+static int pread_all(int fd, void *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t rv = pread(fd, buf, size, offset);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        buf = (char *) buf + rv;
+        size -= rv;
+        offset += rv;
+    }
+    return 0;
+}
+
+/** Writes the whole buffer with a single write call, as required for
+ *  atomic appends. Returns 0 on success.
+ */
+static int write_once(int fd, const void *buf, size_t size) {
+    ssize_t rv;
+    do {
+        rv = write(fd, buf, size);
+    } while (rv < 0 && errno == EINTR);
+    return rv == (ssize_t) size ? 0 : -1;
+}
+
+/** Creates a file containing only a header, unless the file already
+ *  exists. The file is written under a temporary name and then
+ *  linked into place, so other processes never see a partial header.
+ */
+static void create_with_header(const char *mailbox, const char *name, const void *header, size_t size) {
+
+    char path[PATH_MAX], temp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", mailbox, name);
+    if (access(path, F_OK) == 0)
+        return;
+
+    snprintf(temp, sizeof(temp), "%s/%s.XXXXXX", mailbox, name);
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        return;
+    if (write_once(fd, header, size) == 0)
+        link(temp, path);
+    close(fd);
+    unlink(temp);
+}
+
+/** Replaces a file written by another version of the index with an
+ *  empty one. Records of messages delivered concurrently may be lost,
+ *  which only means those messages are handled without the index.
+ */
+static void replace_with_header(const char *mailbox, const char *name, const void *header, size_t size) {
+
+    char path[PATH_MAX], temp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", mailbox, name);
+    snprintf(temp, sizeof(temp), "%s/%s.XXXXXX", mailbox, name);
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        return;
+    if (write_once(fd, header, size) < 0 || rename(temp, path) < 0)
+        unlink(temp);
+    close(fd);
+}
+
+/** Opens one of the index files for appending, creating it first if
+ *  needed. Both headers start with a magic number and a version; a
+ *  file with a different version is started over.
+ */
+static int open_for_append(const char *mailbox, const char *name, const void *header, size_t size) {
+
+    char path[PATH_MAX];
+    struct index_header found;
+
+    create_with_header(mailbox, name, header, size);
+    snprintf(path, sizeof(path), "%s/%s", mailbox, name);
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd >= 0 && (pread_all(fd, &found, sizeof(found), 0) < 0 || memcmp(&found, header, sizeof(found)))) {
+        close(fd);
+        replace_with_header(mailbox, name, header, size);
+        fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    }
+    return fd;
+}
+
+/** Finds the header section and body line offsets of a message.
+ *
+ *  Parameters: file_name: Name of the file containing the message.
+ *              layout: Receives the layout of the message. Must be
+ *                      freed with mailindex_free_layout.
+ *
+ *  Returns: 0 on success, -1 if the file could not be read or is
+ *           too large to be indexed.
+ */
+int mailindex_scan(const char *file_name, struct mail_layout *layout) {
+
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+        return -1;
+
+    char *buf = malloc(SCAN_BLOCK);
+    size_t capacity = 0;
+    uint64_t pos = 0, line_start = 0, body_start = 0;
+    int in_body = 0, rv = 0;
+    char prev = 0;
+    size_t len;
+
+    memset(layout, 0, sizeof(struct mail_layout));
+    while ((len = fread(buf, 1, SCAN_BLOCK, file)) > 0) {
+        for (size_t i = 0; i < len; prev = buf[i++], pos++) {
+            if (buf[i] != '\n')
+                continue;
+            // The header section ends with the first empty line
+            if (!in_body && (pos == line_start || (pos == line_start + 1 && prev == '\r'))) {
+                in_body = 1;
+                body_start = pos + 1;
+            } else if (in_body) {
+                if (layout->body_lines == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    layout->line_starts = realloc(layout->line_starts, capacity * sizeof(uint32_t));
+                }
+                layout->line_starts[layout->body_lines++] = line_start - body_start;
+            }
+            line_start = pos + 1;
+        }
+    }
+    // A last body line without a line terminator is still a line
+    if (in_body && line_start < pos) {
+        if (layout->body_lines == capacity)
+            layout->line_starts = realloc(layout->line_starts, (capacity + 1) * sizeof(uint32_t));
+        layout->line_starts[layout->body_lines++] = line_start - body_start;
+    }
+
+    layout->header_size = in_body ? body_start : pos;
+    if (ferror(file) || pos > UINT32_MAX) {
+        mailindex_free_layout(layout);
+        rv = -1;
+    }
+    fclose(file);
+    free(buf);
+    return rv;
+}
+
+/** Frees the memory used by a message layout.
+ */
+void mailindex_free_layout(struct mail_layout *layout) {
+    free(layout->line_starts);
+    layout->line_starts = NULL;
+    layout->body_lines = 0;
+}
+
+/** Adds a message to the index of a mailbox.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              record: Record to be appended. The header size, line
+ *                      count and line offset fields are filled in by
+ *                      this function from the layout.
+ *              layout: Layout of the message, from mailindex_scan.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int mailindex_append(const char *mailbox, struct mail_index_record *record,
+                     const struct mail_layout *layout) {
+
+    struct index_header index_header = { INDEX_MAGIC, INDEX_VERSION };
+    struct lines_header lines_header = { LINES_MAGIC, INDEX_VERSION, new_epoch() };
+    size_t lines_size = layout->body_lines * sizeof(uint32_t);
+    int rv = -1;
+
+    record->header_size = layout->header_size;
+    record->body_lines = layout->body_lines;
+    record->lines_offset = 0;
+    record->lines_epoch = 0;
+
+    int lines_fd = open_for_append(mailbox, LINES_NAME, &lines_header, sizeof(lines_header));
+    if (lines_fd >= 0 && pread_all(lines_fd, &lines_header, sizeof(lines_header), 0) == 0 &&
+        (!lines_size || write_once(lines_fd, layout->line_starts, lines_size) == 0)) {
+        // After an append, the file offset is the end of the data written
+        off_t end = lseek(lines_fd, 0, SEEK_CUR);
+        if (end >= 0) {
+            record->lines_offset = lines_size ? end - lines_size : 0;
+            record->lines_epoch = lines_header.epoch;
+        }
+    }
+    if (lines_fd >= 0)
+        close(lines_fd);
+
+    int index_fd = open_for_append(mailbox, RECORDS_NAME, &index_header, sizeof(index_header));
+    if (index_fd >= 0) {
+        rv = write_once(index_fd, record, sizeof(struct mail_index_record));
+        close(index_fd);
+    }
+    return rv;
+}
+
+/** Reads all records in the index of a mailbox. The position of a
+ *  record in the returned array is its slot, used with
+ *  mailindex_read. Records of messages that were removed are still
+ *  returned; callers must check the sequence number and inode.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              records: Receives an array of records, to be freed by
+ *                       the caller.
+ *
+ *  Returns: Number of records, or -1 if there is no valid index.
+ */
+long mailindex_load(const char *mailbox, struct mail_index_record **records) {
+
+    char path[PATH_MAX];
+    struct index_header header;
+    struct stat file_stat;
+    long rv = -1;
+
+    *records = NULL;
+    snprintf(path, sizeof(path), "%s/%s", mailbox, RECORDS_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &file_stat) == 0 && pread_all(fd, &header, sizeof(header), 0) == 0 &&
+        !memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) && header.version == INDEX_VERSION) {
+        // Ignore a partial record at the end, if any
+        long count = (file_stat.st_size - sizeof(header)) / sizeof(struct mail_index_record);
+        *records = malloc(count ? count * sizeof(struct mail_index_record) : 1);
+        if (pread_all(fd, *records, count * sizeof(struct mail_index_record), sizeof(header)) == 0) {
+            rv = count;
+        } else {
+            free(*records);
+            *records = NULL;
+        }
+    }
+    close(fd);
+    return rv;
+}
+
+/** Reads a single index record.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              slot: Position of the record, as in mailindex_load.
+ *              record: Receives the record.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int mailindex_read(const char *mailbox, uint32_t slot, struct mail_index_record *record) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", mailbox, RECORDS_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rv = pread_all(fd, record, sizeof(struct mail_index_record),
+                       sizeof(struct index_header) + (off_t) slot * sizeof(struct mail_index_record));
+    close(fd);
+    return rv;
+}
+
+/** Computes how many bytes of a message hold its header section and
+ *  the first lines of its body, as needed by the POP3 TOP command.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              record: Index record of the message.
+ *              lines: Number of body lines.
+ *              size: Receives the number of bytes.
+ *
+ *  Returns: 0 on success, -1 if the index cannot be used.
+ */
+int mailindex_top_size(const char *mailbox, const struct mail_index_record *record,
+                       uint32_t lines, uint64_t *size) {
+
+    char path[PATH_MAX];
+    struct lines_header header;
+    uint32_t offset;
+
+    if (lines >= record->body_lines) {
+        *size = record->size;
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", mailbox, LINES_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rv = pread_all(fd, &header, sizeof(header), 0);
+    if (!rv && header.epoch != record->lines_epoch)
+        rv = -1;
+    if (!rv)
+        rv = pread_all(fd, &offset, sizeof(offset), record->lines_offset + (off_t) lines * sizeof(uint32_t));
+    close(fd);
+
+    if (!rv)
+        *size = record->header_size + offset;
+    return rv;
+}
+
+/** Rewrites the index of a mailbox, keeping only records of messages
+ *  that still exist. Should only be called while no session uses the
+ *  mailbox, since record slots change.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              is_live: Function that returns non-zero for records
+ *                       that must be kept.
+ *              arg: Passed to is_live.
+ *
+ *  Returns: Number of records removed, or -1 on error.
+ */
+int mailindex_compact(const char *mailbox,
+                      int (*is_live)(const struct mail_index_record *record, void *arg), void *arg) {
+
+    char path[PATH_MAX], temp_index[PATH_MAX], temp_lines[PATH_MAX];
+    struct index_header index_header = { INDEX_MAGIC, INDEX_VERSION };
+    struct lines_header lines_header = { LINES_MAGIC, INDEX_VERSION, new_epoch() };
+    struct mail_index_record *records;
+    struct lines_header old_header;
+    int removed = 0, rv = 0;
+
+    long count = mailindex_load(mailbox, &records);
+    if (count < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/%s", mailbox, LINES_NAME);
+    int old_lines = open(path, O_RDONLY | O_CLOEXEC);
+    if (old_lines >= 0 && pread_all(old_lines, &old_header, sizeof(old_header), 0) < 0) {
+        close(old_lines);
+        old_lines = -1;
+    }
+
+    snprintf(temp_index, sizeof(temp_index), "%s/%s.XXXXXX", mailbox, RECORDS_NAME);
+    snprintf(temp_lines, sizeof(temp_lines), "%s/%s.XXXXXX", mailbox, LINES_NAME);
+    int index_fd = mkstemp(temp_index);
+    int lines_fd = mkstemp(temp_lines);
+    FILE *index_out = index_fd < 0 ? NULL : fdopen(index_fd, "w");
+    FILE *lines_out = lines_fd < 0 ? NULL : fdopen(lines_fd, "w");
+    if (!index_out || !lines_out)
+        rv = -1;
+
+    if (!rv) {
+        fwrite(&index_header, sizeof(index_header), 1, index_out);
+        fwrite(&lines_header, sizeof(lines_header), 1, lines_out);
+    }
+
+    uint64_t lines_pos = sizeof(lines_header);
+    for (long i = 0; !rv && i < count; i++) {
+        struct mail_index_record *record = &records[i];
+        if (!is_live(record, arg)) {
+            removed++;
+            continue;
+        }
+
+        // Copy the line offsets of the message, if they can be found
+        size_t size = record->body_lines * sizeof(uint32_t);
+        uint32_t *starts = size ? malloc(size) : NULL;
+        if (size && (old_lines < 0 || record->lines_epoch != old_header.epoch ||
+                     pread_all(old_lines, starts, size, record->lines_offset) < 0)) {
+            record->lines_epoch = 0;
+        } else {
+            fwrite(starts, 1, size, lines_out);
+            record->lines_offset = lines_pos;
+            record->lines_epoch = lines_header.epoch;
+            lines_pos += size;
+        }
+        free(starts);
+        fwrite(record, sizeof(struct mail_index_record), 1, index_out);
+    }
+
+    if (index_out && fclose(index_out) == EOF)
+        rv = -1;
+    else if (!index_out && index_fd >= 0)
+        close(index_fd);
+    if (lines_out && fclose(lines_out) == EOF)
+        rv = -1;
+    else if (!lines_out && lines_fd >= 0)
+        close(lines_fd);
+    if (old_lines >= 0)
+        close(old_lines);
+    free(records);
+
+    // Replace the lines file first: records from the old index then
+    // have the wrong epoch until the new index is in place
+    if (!rv && removed) {
+        snprintf(path, sizeof(path), "%s/%s", mailbox, LINES_NAME);
+        rv = rename(temp_lines, path);
+        snprintf(path, sizeof(path), "%s/%s", mailbox, RECORDS_NAME);
+        if (!rv)
+            rv = rename(temp_index, path);
+    }
+    if (index_fd >= 0)
+        unlink(temp_index);
+    if (lines_fd >= 0)
+        unlink(temp_lines);
+    return rv < 0 ? -1 : removed;
+}
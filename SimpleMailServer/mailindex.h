@@ -0,0 +1,45 @@
+/* mailindex.h
+ * Per-mailbox index of message metadata, written when messages are
+ * delivered: size, compression, the size of the header section and
+ * the offset of each body line.
+ */
+
+#ifndef _MAILINDEX_H_
+#define _MAILINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAILINDEX_COMPRESSED 0x1
+
+struct mail_index_record {
+    uint32_t seq;
+    uint32_t flags;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t header_size;
+    uint32_t body_lines;
+    uint32_t reserved;
+    uint64_t lines_offset;
+    uint64_t lines_epoch;
+    uint64_t delivered;     // modification time of the file, in nanoseconds
+};
+
+struct mail_layout {
+    uint64_t header_size;
+    uint32_t body_lines;
+    uint32_t *line_starts;
+};
+
+int mailindex_scan(const char *file_name, struct mail_layout *layout);
+void mailindex_free_layout(struct mail_layout *layout);
+int mailindex_append(const char *mailbox, struct mail_index_record *record,
+                     const struct mail_layout *layout);
+long mailindex_load(const char *mailbox, struct mail_index_record **records);
+int mailindex_read(const char *mailbox, uint32_t slot, struct mail_index_record *record);
+int mailindex_top_size(const char *mailbox, const struct mail_index_record *record,
+                       uint32_t lines, uint64_t *size);
+int mailindex_compact(const char *mailbox,
+                      int (*is_live)(const struct mail_index_record *record, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,139 @@
+/* maillock.c
+ * Exclusive per-mailbox locks for POP3 sessions.
+ *
+ * Each mailbox has a lock file that is locked with flock(2). Locks
+ * belong to an open file, so they work the same way for sessions
+ * handled by forked processes and for sessions handled one after the
+ * other by a single process, and they are released by the kernel if
+ * a process dies. Message delivery never takes the lock: messages
+ * are added with link(2), which is atomic.
+ */
+
+#include "maillock.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOCK_FILE_NAME  ".lock"
+#define MIN_BACKOFF_US  1000
+#define MAX_BACKOFF_US  50000
+
+static struct maillock_stats local_stats;
+static struct maillock_stats *stats = &local_stats;
+
+/** Sets up statistics shared by the current process and all its
+ *  future children. Must be called before any connection handler is
+ *  forked; otherwise, each process keeps its own statistics.
+ *
+ *  Returns: 0 on success, -1 if shared memory is not available.
+ */
+int maillock_init(void) {
+    void *shared = mmap(NULL, sizeof(struct maillock_stats), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+    memset(shared, 0, sizeof(struct maillock_stats));
+    stats = shared;
+    return 0;
+}
+
+/** Returns the current time in microseconds from a monotonic clock.
+ */
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Adds one lock acquisition to the statistics.
+ */
+static void record_wait(uint64_t wait_us, int contended) {
+
+    static const uint64_t bounds[] = MAILLOCK_WAIT_BOUNDS;
+    int bucket = 0;
+    while (bucket < MAILLOCK_WAIT_BUCKETS - 1 && wait_us > bounds[bucket])
+        bucket++;
+
+    __atomic_add_fetch(&stats->acquired, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->contended, contended, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->wait_total_us, wait_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->wait_buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stats->wait_max_us, __ATOMIC_RELAXED);
+    while (wait_us > max &&
+           !__atomic_compare_exchange_n(&stats->wait_max_us, &max, wait_us, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** Takes the exclusive lock of a mailbox, creating the mailbox
+ *  directory if needed. If another session holds the lock, retries
+ *  with an increasing delay until the lock is free or the timeout
+ *  expires.
+ *
+ *  Parameters: mailbox: Directory of the mailbox.
+ *              timeout_ms: Maximum time to wait for the lock, in
+ *                          milliseconds. Zero means no waiting.
+ *
+ *  Returns: A lock handle to be passed to maillock_release, or -1 if
+ *           the lock could not be taken. In the latter case errno is
+ *           set to EWOULDBLOCK if the lock is held by another session.
+ */
+int maillock_acquire(const char *mailbox, int timeout_ms) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", mailbox, LOCK_FILE_NAME);
+    mkdir(mailbox, 0777);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    uint64_t start = now_us();
+    uint64_t backoff = MIN_BACKOFF_US;
+    int contended = 0;
+
+    while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        uint64_t waited = now_us() - start;
+        if (errno != EWOULDBLOCK || waited >= (uint64_t) timeout_ms * 1000) {
+            int saved_errno = errno;
+            if (errno == EWOULDBLOCK)
+                __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        contended = 1;
+        usleep(backoff);
+        if (backoff < MAX_BACKOFF_US)
+            backoff *= 2;
+    }
+
+    record_wait(now_us() - start, contended);
+    return fd;
+}
+
+/** Releases a mailbox lock taken with maillock_acquire.
+ *
+ *  Parameters: lock: Lock handle. Negative values are ignored.
+ */
+void maillock_release(int lock) {
+    if (lock >= 0)
+        close(lock);
+}
+
+/** Copies the current lock statistics.
+ *
+ *  Parameters: out: Structure that receives the statistics.
+ */
+void maillock_get_stats(struct maillock_stats *out) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    memcpy(out, stats, sizeof(struct maillock_stats));
+}
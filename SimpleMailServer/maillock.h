@@ -0,0 +1,30 @@
+/* maillock.h
+ * Exclusive per-mailbox locks for POP3 sessions, based on flock(2),
+ * with wait time statistics shared by all server processes.
+ */
+
+#ifndef _MAILLOCK_H_
+#define _MAILLOCK_H_
+
+#include <stdint.h>
+
+// Upper bounds, in microseconds, of the wait time histogram buckets.
+// The last bucket counts everything slower than the last bound.
+#define MAILLOCK_WAIT_BUCKETS 6
+#define MAILLOCK_WAIT_BOUNDS { 0, 1000, 10000, 100000, 1000000 }
+
+struct maillock_stats {
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t timeouts;
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+    uint64_t wait_buckets[MAILLOCK_WAIT_BUCKETS];
+};
+
+int maillock_init(void);
+int maillock_acquire(const char *mailbox, int timeout_ms);
+void maillock_release(int lock);
+void maillock_get_stats(struct maillock_stats *stats);
+
+#endif
@@ -7,39 +7,124 @@
  * Modified: Mar 5, 2022
  */
 
+#define _GNU_SOURCE
+
 #include "mailuser.h"
+#include "credentials.h"
+#include "lzcodec.h"
+#include "expunge.h"
+#include "maillock.h"
+#include "mailcache.h"
+#include "mailindex.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <ctype.h>
 
 #define USER_FILE_NAME "users.txt"
 #define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define COMPRESSED_SUFFIX ".z"
+#define GENERATIONS_FILE_NAME MAIL_BASE_DIRECTORY "/.generations"
+#define NO_INDEX_SLOT UINT32_MAX
+#define COMPACT_MIN_RECORDS 64
+
+// Compressed messages are stored with COMPRESSED_SUFFIX after the mail
+// suffix (e.g., 12.mail.z), so they are told apart by name and never by
+// their contents, which come from the client. They start with a header
+// holding this magic number and the size of the original message, followed by blocks of at most
+// LZ_MAX_BLOCK_SIZE bytes of original data, each preceded by a
+// block_header. Fields are stored in host byte order.
+#define COMPRESSED_MAGIC "SMZ1"
+#define BLOCK_STORED_FLAG 0x80000000u
+
+struct compressed_header {
+    char magic[4];
+    uint32_t block_size;
+    uint64_t raw_size;
+};
+
+struct block_header {
+    uint32_t raw_size;
+    // Size of the data that follows; if BLOCK_STORED_FLAG is set, the
+    // block did not compress and is stored as is.
+    uint32_t stored_size;
+};
+
+struct compressed_stream {
+    FILE *file;
+    size_t avail;
+    size_t pos;
+    char block[LZ_MAX_BLOCK_SIZE];
+    char packed[];
+};
 
 struct user_list {
     char *user;
     struct user_list *next;
 };
 
+// Messages are identified by the sequence number in their file name
+// (e.g., 12 for 12.mail); the full path is built only when needed.
+// The unique ID reported to POP3 clients is built from the inode and
+// modification time of the file, which never change once the message
+// is delivered, and no two files in a mailbox share both.
 struct mail_item {
-    char file_name[NAME_MAX];
-    size_t file_size;
+    uint64_t file_size;
+    uint64_t inode;
+    uint64_t delivered;     // file modification time, in nanoseconds
+    uint32_t seq;
+    uint32_t index_slot;    // position in the mailbox index, or NO_INDEX_SLOT
     unsigned int deleted:1;
+    unsigned int compressed:1;
 };
 
+// A mail list is a single allocation holding the mailbox directory
+// and an array of messages sorted by sequence number.
 struct mail_list {
-    struct mail_item item;
-    struct mail_list *next;
+    char *mailbox;
+    unsigned int count;
+    unsigned int capacity;
+    struct mail_item items[];
 };
 
+static int mail_compression = 0;
+
+/** Internal function that maps the mailbox generations, used to
+ *  invalidate the shared metadata cache. Only the first successful
+ *  call does any work.
+ */
+static void attach_generations(void) {
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    mailcache_attach(GENERATIONS_FILE_NAME);
+}
+
+/** Creates the metadata cache shared by all sessions that load mail
+ *  lists. Must be called before any connection is handled.
+ *
+ *  Parameters: budget: Maximum amount of memory, in bytes, used by
+ *                      the cache. Zero disables the cache.
+ *
+ *  Returns: 0 on success, -1 if the cache could not be created.
+ */
+int init_mail_cache(size_t budget) {
+    attach_generations();
+    return mailcache_init(budget);
+}
+
 /** Internal function that opens the users file list. If file has been
  *  opened before, rewinds the pointer to beginning of the file.
  * 
@@ -60,7 +145,8 @@ static FILE *user_file_list(void) {
  *  considered equivalent), so a username like 'ADMIN' is considered
  *  equivalent to 'admin'. The password check, if performed, is
  *  case-sensitive (i.e., upper-case and lower-case letters are
- *  considered different).
+ *  considered different). Passwords in the user file may be in plain
+ *  text or hashed (see credentials_check).
  *  
  *  Parameters: username: Non-NULL name of the user to check.
  *              password: Plain-text password to check. If NULL, will
@@ -79,7 +165,7 @@ int is_valid_user(const char *username, const char *password) {
     char pw_file[MAX_PASSWORD_SIZE+1];
     while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
         if (!strcasecmp(username, user_file))
-            return password == NULL || !strcmp(password, pw_file);
+            return password == NULL || credentials_check(user_file, password, pw_file);
     }
     return 0;
 }
@@ -107,6 +193,22 @@ void add_user_to_list(user_list_t *list, const char *username) {
     *list = new_list;
 }
 
+/** Adds a user name to a list of users, allocating from an arena
+ *  instead of the heap. A list built this way must not be passed to
+ *  destroy_user_list; it is released when the arena is reset.
+ *
+ *  Parameters: arena: Arena the new entry and copy of the name are
+ *                     allocated from.
+ *              list: address of the list of users to be modified.
+ *              username: Name of the user to be added.
+ */
+void add_user_to_arena_list(arena_t arena, user_list_t *list, const char *username) {
+    user_list_t new_list = arena_alloc(arena, sizeof(struct user_list));
+    new_list->user = arena_strdup(arena, username);
+    new_list->next = *list;
+    *list = new_list;
+}
+
 /** Frees all memory used by a list of users.
  *
  * Parameters: list: list of users to be freed.
@@ -120,8 +222,89 @@ void destroy_user_list(user_list_t list) {
     }
 }
 
+/** Enables or disables compression of newly saved messages. Messages
+ *  already in the mail storage are read correctly in either mode.
+ *
+ *  Parameters: enabled: non-zero if messages saved with
+ *                       save_user_mail should be compressed.
+ */
+void set_mail_compression(int enabled) {
+    mail_compression = enabled;
+}
+
+/** Internal function that writes a compressed copy of a message.
+ *
+ *  Parameters: src_name: Name of the file with the original message.
+ *              dst_name: Name of the compressed file to be created.
+ *
+ *  Returns: 0 if the compressed file was created, -1 otherwise (in
+ *           which case no file is left behind).
+ */
+static int compress_mail_file(const char *src_name, const char *dst_name) {
+
+    FILE *in = fopen(src_name, "r");
+    if (!in) return -1;
+
+    int fd = open(dst_name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        if (fd >= 0) close(fd);
+        fclose(in);
+        return -1;
+    }
+
+    size_t bound = lz_compress_bound(LZ_MAX_BLOCK_SIZE);
+    char *raw = malloc(LZ_MAX_BLOCK_SIZE + bound);
+    char *packed = raw + LZ_MAX_BLOCK_SIZE;
+    struct compressed_header header = { .block_size = LZ_MAX_BLOCK_SIZE, .raw_size = 0 };
+    memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+    int rv = fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : -1;
+
+    size_t len;
+    while (!rv && (len = fread(raw, 1, LZ_MAX_BLOCK_SIZE, in)) > 0) {
+        struct block_header block = { .raw_size = len };
+        size_t packed_len = lz_compress(raw, len, packed, bound);
+        const char *data = packed;
+        if (!packed_len || packed_len >= len) {
+            data = raw;
+            packed_len = len;
+            block.stored_size = BLOCK_STORED_FLAG;
+        }
+        block.stored_size |= packed_len;
+        header.raw_size += len;
+        if (fwrite(&block, sizeof(block), 1, out) != 1 ||
+            fwrite(data, 1, packed_len, out) != packed_len)
+            rv = -1;
+    }
+    if (ferror(in))
+        rv = -1;
+
+    // Now that the total is known, complete the header
+    if (!rv && (fseek(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1))
+        rv = -1;
+    if (fclose(out) == EOF)
+        rv = -1;
+    fclose(in);
+    free(raw);
+
+    if (rv < 0) {
+        int removed = unlink(dst_name);
+        TRACE3(mail_unlink, trace_session_id, dst_name, removed);
+    }
+    return rv;
+}
+
+/** Internal function that returns the modification time of a file in
+ *  nanoseconds, used in the unique ID of a message.
+ */
+static uint64_t file_time(const struct stat *file_stat) {
+    return (uint64_t) file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+}
+
 /** Saves a new email message into the mail storage for a list of
- *  users.
+ *  users. If compression is enabled (see set_mail_compression), the
+ *  stored copy is compressed. The size, layout and unique ID of the
+ *  message are recorded in the index of each mailbox.
  *
  *  This function uses hard links to create the files based on an
  *  existing temporary file. It assumes the temporary file is in the
@@ -132,109 +315,490 @@ void destroy_user_list(user_list_t list) {
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
  *              users: List of recipient users to the message.
+ *              delivered: If not NULL, receives for each user, in the
+ *                         order of the list, non-zero if the message
+ *                         was stored in the user's mailbox.
+ *
+ *  Returns: Number of users the message was stored for.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+int save_user_mail(const char *basefile, user_list_t users, int *delivered) {
   
-    char mail_file[NAME_MAX + 1];
+    uint64_t start = metrics_now();
+    char mail_file[PATH_MAX];
+    char other_file[PATH_MAX];
+    char mailbox[NAME_MAX + 1];
+    char packed_file[NAME_MAX + 1];
+    const char *source = basefile;
+    struct mail_index_record record = { 0 };
+    struct mail_layout layout;
+    struct stat file_stat;
   
     // Create base directory if it doesn't exist yet (error ignored)
     mkdir(MAIL_BASE_DIRECTORY, 0777);
+
+    attach_generations();
+
+    // The layout of the message is indexed once for all recipients
+    int indexed = stat(basefile, &file_stat) == 0 && mailindex_scan(basefile, &layout) == 0;
+    record.size = file_stat.st_size;
+
+    // The compressed copy is created next to the temporary file, so
+    // that it can also be hard linked into the mail storage
+    if (mail_compression) {
+        snprintf(packed_file, sizeof(packed_file), "%s" COMPRESSED_SUFFIX, basefile);
+        if (!compress_mail_file(basefile, packed_file))
+            source = packed_file;
+    }
+    if (source != basefile)
+        record.flags |= MAILINDEX_COMPRESSED;
+    // All recipients share the same file, hence the same inode and
+    // unique ID
+    if (indexed && stat(source, &file_stat) == 0) {
+        record.inode = file_stat.st_ino;
+        record.delivered = file_time(&file_stat);
+    } else
+        indexed = 0;
   
+    int count = 0;
     for (; users; users = users->next) {
     
         // Create a directory for the user if it doesn't exist yet. If it
         // exists mkdir will return an error, which is ignored.
-        int i = 0;
-        sprintf(mail_file, "%s/%s", MAIL_BASE_DIRECTORY, users->user);
-        mkdir(mail_file, 0777);
+        int i = 0, rv;
+        snprintf(mailbox, sizeof(mailbox), "%s/%s", MAIL_BASE_DIRECTORY, users->user);
+        mkdir(mailbox, 0777);
     
-        // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
+        // Tries to create a file called 0.mail (or 0.mail.z if compressed),
+        // if it exists tries 1.mail, and so on. Numbers used by a message
+        // with the other suffix are skipped.
         do {
-            sprintf(mail_file, "%s/%s/%d" MAIL_FILE_SUFFIX, MAIL_BASE_DIRECTORY, users->user, i++);
-        } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+            const char *suffix = source != basefile ? COMPRESSED_SUFFIX : "";
+            snprintf(mail_file, sizeof(mail_file), "%s/%d" MAIL_FILE_SUFFIX "%s", mailbox, i, suffix);
+            snprintf(other_file, sizeof(other_file), "%s/%d" MAIL_FILE_SUFFIX "%s", mailbox, i++,
+                     *suffix ? "" : COMPRESSED_SUFFIX);
+            if (access(other_file, F_OK) == 0) {
+                rv = -1;
+                errno = EEXIST;
+                continue;
+            }
+            rv = link(source, mail_file);
+            TRACE3(mail_link, trace_session_id, mail_file, rv);
+        } while (rv < 0 && errno == EEXIST);
+
+        if (rv == 0 && indexed) {
+            record.seq = i - 1;
+            mailindex_append(mailbox, &record, &layout);
+        }
+        if (rv == 0)
+            count++;
+        if (delivered)
+            *delivered++ = rv == 0;
+        mailcache_invalidate(users->user);
     }
+
+    if (indexed)
+        mailindex_free_layout(&layout);
+    if (source != basefile) {
+        int removed = unlink(source);
+        TRACE3(mail_unlink, trace_session_id, source, removed);
+    }
+    metrics_time(TIMER_SAVE_USER_MAIL, start);
+    return count;
 }
 
-/** Reads the list of available email messages for a username, based
- *  on existing email files created using save_user_mail (or
- *  equivalent). Only file names and sizes are loaded into memory, the
- *  messages themselves are not kept in memory. If the user does not
- *  exist or does not have any messages, an empty list is returned.
+/** Internal function that reads the size of the original message from
+ *  the header of a compressed message.
  *
- *  Parameters: username: Name of the user whose email messages should
- *                        be retrieved.
+ *  Parameters: file_name: Name of the compressed message file.
+ *              raw_size: Receives the size of the original message.
  *
- *  Returns: A mail_list_t object containing a list of email messages
- *           available for the provided username.
+ *  Returns: 0 on success, -1 if the header could not be read.
  */
-mail_list_t load_user_mail(const char *username) {
+static int read_compressed_size(const char *file_name, size_t *raw_size) {
+
+    struct compressed_header header;
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t len = read(fd, &header, sizeof(header));
+    close(fd);
+
+    if (len != sizeof(header) || memcmp(header.magic, COMPRESSED_MAGIC, sizeof(header.magic)))
+        return -1;
+    *raw_size = header.raw_size;
+    return 0;
+}
+
+/** Internal function that builds the name of a message file.
+ */
+static void mail_item_name(mail_item_t item, char *out, size_t size) {
+    snprintf(out, size, "%u" MAIL_FILE_SUFFIX "%s", item->seq, item->compressed ? COMPRESSED_SUFFIX : "");
+}
+
+/** Internal function that builds the path of a message file.
+ */
+static void mail_item_path(mail_list_t list, mail_item_t item, char *out, size_t size) {
+    char name[NAME_MAX + 1];
+    mail_item_name(item, name, sizeof(name));
+    snprintf(out, size, "%s/%s", list->mailbox, name);
+}
+
+/** Internal function that creates an empty mail list for a mailbox
+ *  directory, with space for a number of messages. The directory
+ *  name is stored in the same allocation, after the messages.
+ */
+static struct mail_list *create_mail_list(const char *mailbox, unsigned int capacity) {
+    size_t name_size = strlen(mailbox) + 1;
+    struct mail_list *list = malloc(sizeof(struct mail_list) +
+                                    capacity * sizeof(struct mail_item) + name_size);
+    list->count = 0;
+    list->capacity = capacity;
+    list->mailbox = (char *) &list->items[capacity];
+    memcpy(list->mailbox, mailbox, name_size);
+    return list;
+}
+
+/** Internal function that appends a message to a mail list, growing
+ *  the list if needed.
+ */
+static struct mail_list *append_mail_item(struct mail_list *list, const struct mail_item *item) {
+    if (list->count == list->capacity) {
+        struct mail_list *bigger = create_mail_list(list->mailbox, list->capacity * 2);
+        memcpy(bigger->items, list->items, list->count * sizeof(struct mail_item));
+        bigger->count = list->count;
+        free(list);
+        list = bigger;
+    }
+    list->items[list->count++] = *item;
+    return list;
+}
+
+/** Internal function that parses the sequence number of a message
+ *  file name (e.g., 12.mail or 12.mail.z), and sets the compressed
+ *  flag of the message from the name. Returns 0 if the name is not in
+ *  the format used by save_user_mail.
+ */
+static int parse_mail_seq(const char *name, struct mail_item *item) {
+    char *end;
+    if (!isdigit((unsigned char) name[0]))
+        return 0;
+    errno = 0;
+    unsigned long value = strtoul(name, &end, 10);
+    if (errno || value > UINT32_MAX || strncmp(end, MAIL_FILE_SUFFIX, strlen(MAIL_FILE_SUFFIX)))
+        return 0;
+    end += strlen(MAIL_FILE_SUFFIX);
+    if (*end && strcmp(end, COMPRESSED_SUFFIX))
+        return 0;
+    item->seq = value;
+    item->compressed = *end != '\0';
+    return 1;
+}
+
+/** Compares index records by sequence number, for sorting and
+ *  searching.
+ */
+static int compare_index_records(const void *a, const void *b) {
+    uint32_t x = ((const struct mail_index_record *) a)->seq;
+    uint32_t y = ((const struct mail_index_record *) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/** Internal function that finds the index record of a message in
+ *  records sorted by sequence number. The inode must also match,
+ *  since sequence numbers may be reused after a message is removed.
+ */
+static struct mail_index_record *find_index_record(struct mail_index_record *records, long count,
+                                                   uint32_t seq, uint64_t inode) {
+    struct mail_index_record key = { .seq = seq };
+    if (count <= 0)
+        return NULL;
+    struct mail_index_record *found = bsearch(&key, records, count, sizeof(key), compare_index_records);
+    if (!found)
+        return NULL;
+    // Several records may share a sequence number, so check all of them
+    while (found > records && found[-1].seq == seq)
+        found--;
+    for (; found < records + count && found->seq == seq; found++)
+        if (found->inode == inode)
+            return found;
+    return NULL;
+}
+
+/** Compares messages by sequence number, for sorting.
+ */
+static int compare_mail_items(const void *a, const void *b) {
+    uint32_t x = ((const struct mail_item *) a)->seq;
+    uint32_t y = ((const struct mail_item *) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/** Internal function that reads the list of messages of a user, see
+ *  load_user_mail.
+ */
+static mail_list_t read_user_mail(const char *username) {
   
     char filename[NAME_MAX + 1];
-    sprintf(filename, "%s/%s", MAIL_BASE_DIRECTORY, username);
+    snprintf(filename, sizeof(filename), "%s/%s", MAIL_BASE_DIRECTORY, username);
+
+    // An unchanged mailbox is loaded from the metadata cache. The
+    // generation is read first, so that changes made while the
+    // directory is read below invalidate the new cache entry.
+    size_t cached_size;
+    attach_generations();
+    uint64_t generation = mailcache_generation(username);
+    void *cached = mailcache_get(username, generation, &cached_size);
+    if (cached) {
+        unsigned int count = cached_size / sizeof(struct mail_item);
+        struct mail_list *list = create_mail_list(filename, count);
+        memcpy(list->items, cached, count * sizeof(struct mail_item));
+        list->count = count;
+        free(cached);
+        if (!list->count) {
+            free(list);
+            return NULL;
+        }
+        return list;
+    }
   
     DIR *dir = opendir(filename);
     if (!dir) return NULL;
+
+    // Read pending deletions before the directory, so that a message
+    // is either hidden here or already removed by the worker
+    tombstone_set_t tombstones = expunge_load(filename);
+
+    // Messages found in the index need no stat or header read. The
+    // slot of each record is kept in its reserved field while sorting.
+    struct mail_index_record *records;
+    long record_count = mailindex_load(filename, &records);
+    for (long i = 0; i < record_count; i++)
+        records[i].reserved = i;
+    if (record_count > 0)
+        qsort(records, record_count, sizeof(struct mail_index_record), compare_index_records);
   
     struct stat file_stat;
     struct dirent *dir_entry;
-    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-    struct mail_list *list = NULL;
+    struct mail_list *list = create_mail_list(filename, 16);
+    char path[NAME_MAX + 1];
   
     while ((dir_entry = readdir(dir)) != NULL) {
-    
+
+        struct mail_item item = { 0 };
         if (// Check if it's a regular file (not a directory)
             dir_entry->d_type == DT_REG &&
-            // Check if the filename is big enough to contain the suffix
-            strlen(dir_entry->d_name) > suflen &&
-            // Check if the filename ends with the mail suffix
-            !strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
+            // Check if the filename is a sequence number with the mail suffix
+            parse_mail_seq(dir_entry->d_name, &item) &&
+            // Check that the message was not deleted in an earlier session
+            !expunge_is_pending(tombstones, dir_entry->d_name, dir_entry->d_ino)) {
       
-            struct mail_list *node = malloc(sizeof(struct mail_list));
-            sprintf(node->item.file_name, "%s/%s/%s",
-                    MAIL_BASE_DIRECTORY, username, dir_entry->d_name);
-      
-            if (stat(node->item.file_name, &file_stat) < 0) {
-                free(node);
+            struct mail_index_record *record =
+                find_index_record(records, record_count, item.seq, dir_entry->d_ino);
+            if (record) {
+                item.inode = record->inode;
+                item.file_size = record->size;
+                item.delivered = record->delivered;
+                item.index_slot = record->reserved;
+                list = append_mail_item(list, &item);
                 continue;
             }
+
+            mail_item_path(list, &item, path, sizeof(path));
+            if (stat(path, &file_stat) < 0)
+                continue;
       
-            node->item.file_size = file_stat.st_size;
-            node->item.deleted = 0;
-            struct mail_list *next = list;
-            struct mail_list **prev = &list;
-            while (next && strcmp(node->item.file_name, next->item.file_name) > 0) {
-                prev = &next->next;
-                next = next->next;
-            }
-            node->next = next;
-            *prev = node;
+            size_t raw_size = file_stat.st_size;
+            if (item.compressed && read_compressed_size(path, &raw_size) < 0)
+                continue;
+            item.inode = file_stat.st_ino;
+            item.delivered = file_time(&file_stat);
+            item.file_size = raw_size;
+            item.index_slot = NO_INDEX_SLOT;
+            list = append_mail_item(list, &item);
         }
     }
     closedir(dir);
+    expunge_free(tombstones);
+    free(records);
+
+    qsort(list->items, list->count, sizeof(struct mail_item), compare_mail_items);
+    mailcache_put(username, generation, list->items, list->count * sizeof(struct mail_item));
+    if (!list->count) {
+        free(list);
+        return NULL;
+    }
     return list;
 }
 
+/** Reads the list of available email messages for a username, based
+ *  on existing email files created using save_user_mail (or
+ *  equivalent). Only sequence numbers and sizes are loaded into
+ *  memory, the messages themselves are not kept in memory. Messages
+ *  are sorted by sequence number, i.e., in delivery order. If the
+ *  user does not exist or does not have any messages, an empty list
+ *  is returned.
+ *
+ *  Parameters: username: Name of the user whose email messages should
+ *                        be retrieved.
+ *
+ *  Returns: A mail_list_t object containing a list of email messages
+ *           available for the provided username.
+ */
+mail_list_t load_user_mail(const char *username) {
+    uint64_t start = metrics_now();
+    mail_list_t list = read_user_mail(username);
+    metrics_time(TIMER_LOAD_USER_MAIL, start);
+    return list;
+}
+
+/** Takes the exclusive lock on a user's mailbox, as required by POP3
+ *  for the duration of a session. Saving messages does not need the
+ *  lock and is not blocked by it.
+ *
+ *  Parameters: username: Name of the user whose mailbox is locked.
+ *              timeout_ms: Maximum time to wait if another session
+ *                          holds the lock, in milliseconds.
+ *
+ *  Returns: A lock handle to be passed to unlock_user_mail, or -1 if
+ *           the lock could not be taken.
+ */
+int lock_user_mail(const char *username, int timeout_ms) {
+    char mailbox[NAME_MAX + 1];
+    snprintf(mailbox, sizeof(mailbox), "%s/%s", MAIL_BASE_DIRECTORY, username);
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    return maillock_acquire(mailbox, timeout_ms);
+}
+
+/** Releases a mailbox lock taken with lock_user_mail. Should be
+ *  called after the mail list is destroyed, so that deletions are
+ *  recorded before another session can load the mailbox.
+ *
+ *  Parameters: lock: Lock handle. Negative values are ignored.
+ */
+void unlock_user_mail(int lock) {
+    maillock_release(lock);
+}
+
 /** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+ *  marked to be deleted. Deleted files are recorded in the mailbox
+ *  journal and removed later by the expunge worker (see
+ *  start_expunge_worker); they are no longer returned by
+ *  load_user_mail once this function returns. If the journal cannot
+ *  be written, the files are removed immediately instead.
  *
  *  Parameters: list: List of emails to be deleted.
  *  Return:     number of errors, if any
  */
 int destroy_mail_list(mail_list_t list) {
     int errors = 0;
-    while (list) {
-        if (list->item.deleted) {
-            if (unlink(list->item.file_name) < 0) {
+    size_t count = 0;
+
+    if (!list)
+        return 0;
+
+    for (unsigned int i = 0; i < list->count; i++)
+        count += list->items[i].deleted;
+
+    struct tombstone *entries = count ? malloc(count * sizeof(struct tombstone)) : NULL;
+    char *names = count ? malloc(count * (NAME_MAX + 1)) : NULL;
+    count = 0;
+    for (unsigned int i = 0; i < list->count; i++) {
+        if (list->items[i].deleted) {
+            entries[count].inode = list->items[i].inode;
+            entries[count].name = names + count * (NAME_MAX + 1);
+            mail_item_name(&list->items[i], entries[count].name, NAME_MAX + 1);
+            count++;
+        }
+    }
+
+    int recorded = expunge_record(list->mailbox, entries, count) == 0;
+    free(entries);
+    free(names);
+
+    for (unsigned int i = 0; i < list->count && !recorded; i++) {
+        char path[NAME_MAX + 1];
+        if (list->items[i].deleted) {
+            mail_item_path(list, &list->items[i], path, sizeof(path));
+            int removed = unlink(path);
+            TRACE3(mail_unlink, trace_session_id, path, removed);
+            if (removed < 0) {
                 errors++;
             }
         }
-        mail_list_t next = list->next;
-        free(list);
-        list = next;
     }
+
+    if (count)
+        mailcache_invalidate(strrchr(list->mailbox, '/') + 1);
+    free(list);
     return errors;
 }
 
+/** Internal function used while compacting an index: checks if a
+ *  record belongs to a message that still exists. The argument is
+ *  the list of existing messages.
+ */
+static int is_live_record(const struct mail_index_record *record, void *arg) {
+    struct mail_list *list = arg;
+    struct mail_item key = { .seq = record->seq };
+    struct mail_item *item = bsearch(&key, list->items, list->count,
+                                     sizeof(struct mail_item), compare_mail_items);
+    if (!item)
+        return 0;
+    // A plain and a compressed message may share a sequence number
+    while (item > list->items && item[-1].seq == record->seq)
+        item--;
+    for (; item < list->items + list->count && item->seq == record->seq; item++)
+        if (item->inode == record->inode)
+            return 1;
+    return 0;
+}
+
+/** Internal function called by the expunge worker after messages are
+ *  removed from a mailbox. Drops index records of removed messages
+ *  once they make up most of the index. This is only done if no
+ *  session holds the mailbox, since index slots change.
+ */
+static void compact_mail_index(const char *mailbox) {
+
+    struct dirent *dir_entry;
+    struct mail_index_record *records;
+    long record_count = mailindex_load(mailbox, &records);
+    free(records);
+    if (record_count < COMPACT_MIN_RECORDS)
+        return;
+
+    int lock = maillock_acquire(mailbox, 0);
+    if (lock < 0)
+        return;
+
+    DIR *dir = opendir(mailbox);
+    struct mail_list *list = create_mail_list(mailbox, 16);
+    while (dir && (dir_entry = readdir(dir)) != NULL) {
+        struct mail_item item = { .inode = dir_entry->d_ino };
+        if (dir_entry->d_type == DT_REG && parse_mail_seq(dir_entry->d_name, &item))
+            list = append_mail_item(list, &item);
+    }
+    if (dir)
+        closedir(dir);
+    qsort(list->items, list->count, sizeof(struct mail_item), compare_mail_items);
+
+    if (record_count > 2 * (long) list->count &&
+        mailindex_compact(mailbox, is_live_record, list) > 0)
+        mailcache_invalidate(strrchr(mailbox, '/') + 1);
+
+    free(list);
+    maillock_release(lock);
+}
+
+/** Starts the background removal of deleted messages (see
+ *  destroy_mail_list). Should be called once, before any connection
+ *  is handled.
+ *
+ *  Returns: 0 if the worker is running, -1 otherwise.
+ */
+int start_expunge_worker(void) {
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    return expunge_start_worker(MAIL_BASE_DIRECTORY, compact_mail_index);
+}
+
 /** Returns the number of email messages available in a list of
  *  emails, not counting messages marked for deletion (e.g., if there
  *  are 4 messages, and the second is marked as deleted,
@@ -249,10 +813,9 @@ int destroy_mail_list(mail_list_t list) {
  */
 unsigned int get_mail_count(mail_list_t list, int includedeleted) {
     unsigned int rv = 0;
-    while (list) {
-        if (includedeleted || !list->item.deleted) rv++;
-        list = list->next;
-    }
+    if (!list) return 0;
+    for (unsigned int i = 0; i < list->count; i++)
+        if (includedeleted || !list->items[i].deleted) rv++;
     return rv;
 }
 
@@ -274,13 +837,9 @@ unsigned int get_mail_count(mail_list_t list, int includedeleted) {
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
   
-    while (list) {
-        if (!pos--)
-            return list->item.deleted ? NULL : &list->item;
-        list = list->next;
-    }
-  
-    return NULL;
+    if (!list || pos >= list->count)
+        return NULL;
+    return list->items[pos].deleted ? NULL : &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -292,14 +851,15 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  */
 size_t get_mail_list_size(mail_list_t list) {
     size_t rv = 0;
-    while (list) {
-        rv += list->item.deleted ? 0 : list->item.file_size;
-        list = list->next;
-    }
+    if (!list) return 0;
+    for (unsigned int i = 0; i < list->count; i++)
+        rv += list->items[i].deleted ? 0 : list->items[i].file_size;
     return rv;
 }
 
-/** Returns the total amount of bytes in an email message.
+/** Returns the total amount of bytes in an email message. For
+ *  compressed messages this is the size of the original message, not
+ *  the space used in the mail storage.
  *
  *  Parameters: item: Email message to be assessed.
  *
@@ -309,17 +869,206 @@ size_t get_mail_item_size(mail_item_t item) {
     return item->file_size;
 }
 
+/** Internal function that writes a number in lowercase hexadecimal,
+ *  without leading zeros. Returns the position after the last digit.
+ */
+static char *format_hex(char *out, uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    int shift = 60;
+    while (shift > 0 && !(value >> shift))
+        shift -= 4;
+    for (; shift >= 0; shift -= 4)
+        *out++ = digits[(value >> shift) & 0xf];
+    return out;
+}
+
+/** Builds the unique ID of an email message, as reported by the POP3
+ *  UIDL command. The ID of a message never changes, and is never
+ *  given to another message of the same mailbox. It is taken from the
+ *  metadata loaded with the list, so no file is read.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              uid: Buffer of at least MAIL_UID_SIZE bytes that
+ *                   receives the ID as a null-terminated string.
+ *
+ *  Returns: Length of the ID.
+ */
+size_t get_mail_item_uid(mail_item_t item, char *uid) {
+    char *end = format_hex(uid, item->delivered);
+    *end++ = '.';
+    end = format_hex(end, item->inode);
+    *end = 0;
+    return end - uid;
+}
+
+/** Returns the number of bytes at the start of an email message that
+ *  hold its header section followed by a number of body lines, as
+ *  sent by the POP3 TOP command. Uses the mailbox index if the
+ *  message was indexed at delivery, otherwise reads the message.
+ *
+ *  Parameters: list: List of emails the message belongs to.
+ *              item: Email message to be assessed.
+ *              lines: Number of body lines to include.
+ *
+ *  Returns: Number of bytes, at most the size of the message.
+ */
+size_t get_mail_item_top_size(mail_list_t list, mail_item_t item, unsigned int lines) {
+
+    struct mail_index_record record;
+    uint64_t size;
+
+    if (item->index_slot != NO_INDEX_SLOT &&
+        mailindex_read(list->mailbox, item->index_slot, &record) == 0 &&
+        record.seq == item->seq && record.inode == item->inode &&
+        mailindex_top_size(list->mailbox, &record, lines, &size) == 0)
+        return size;
+
+    // Not indexed: count the bytes of the header and body lines
+    FILE *file = get_mail_item_contents(list, item);
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int in_body = 0;
+
+    size = 0;
+    while (file && (in_body ? lines-- > 0 : 1) && (len = getline(&line, &line_size, file)) > 0) {
+        size += len;
+        if (!in_body && (!strcmp(line, "\n") || !strcmp(line, "\r\n")))
+            in_body = 1;
+    }
+    free(line);
+    if (file)
+        fclose(file);
+    return size;
+}
+
+/** Read function for compressed message streams (see fopencookie).
+ *  Decompresses one block at a time as the caller consumes data.
+ */
+static ssize_t compressed_stream_read(void *cookie, char *buf, size_t size) {
+
+    struct compressed_stream *stream = cookie;
+    struct block_header block;
+
+    if (stream->pos == stream->avail) {
+        if (fread(&block, sizeof(block), 1, stream->file) != 1)
+            return ferror(stream->file) ? -1 : 0;
+
+        size_t stored = block.stored_size & ~BLOCK_STORED_FLAG;
+        if (block.raw_size > LZ_MAX_BLOCK_SIZE || stored > lz_compress_bound(LZ_MAX_BLOCK_SIZE))
+            return -1;
+
+        if (block.stored_size & BLOCK_STORED_FLAG) {
+            if (stored != block.raw_size || fread(stream->block, 1, stored, stream->file) != stored)
+                return -1;
+        } else if (fread(stream->packed, 1, stored, stream->file) != stored ||
+                   lz_decompress(stream->packed, stored, stream->block,
+                                 LZ_MAX_BLOCK_SIZE) != block.raw_size) {
+            return -1;
+        }
+        stream->avail = block.raw_size;
+        stream->pos = 0;
+    }
+
+    if (size > stream->avail - stream->pos)
+        size = stream->avail - stream->pos;
+    memcpy(buf, stream->block + stream->pos, size);
+    stream->pos += size;
+    return size;
+}
+
+/** Close function for compressed message streams (see fopencookie).
+ */
+static int compressed_stream_close(void *cookie) {
+    struct compressed_stream *stream = cookie;
+    int rv = fclose(stream->file);
+    free(stream);
+    return rv;
+}
+
 /** Returns a file pointer that can be used to read the contents of an
  *  email message. The caller is responsible for closing the file
  *  using the `fclose()` function once the data is no longer needed.
+ *  Compressed messages are decompressed as they are read, so the
+ *  caller always sees the original message.
  *
- *  Parameters: item: Email message to be retrieved.
+ *  Parameters: list: List of emails the message belongs to.
+ *              item: Email message to be retrieved.
  *
  *  Returns: FILE * object, or NULL in case of error retrieving the
  *           contents.
  */
-FILE *get_mail_item_contents(mail_item_t item) {
-    return fopen(item->file_name, "r");
+FILE *get_mail_item_contents(mail_list_t list, mail_item_t item) {
+
+    char path[NAME_MAX + 1];
+    mail_item_path(list, item, path, sizeof(path));
+    FILE *file = fopen(path, "r");
+    if (!file || !item->compressed)
+        return file;
+
+    static const cookie_io_functions_t functions = {
+        .read = compressed_stream_read,
+        .close = compressed_stream_close,
+    };
+    struct compressed_header header;
+    struct compressed_stream *stream =
+        malloc(sizeof(*stream) + lz_compress_bound(LZ_MAX_BLOCK_SIZE));
+    FILE *rv = NULL;
+
+    if (stream && fread(&header, sizeof(header), 1, file) == 1) {
+        stream->file = file;
+        stream->avail = stream->pos = 0;
+        rv = fopencookie(stream, "r", functions);
+    }
+    if (!rv) {
+        free(stream);
+        fclose(file);
+    }
+    return rv;
+}
+
+/** Maps the contents of an uncompressed email message into memory,
+ *  so it can be sent without being copied. The mapping must be
+ *  released with release_mail_item_mapping. Compressed messages
+ *  cannot be mapped; use get_mail_item_contents instead.
+ *
+ *  Parameters: list: List of emails the message belongs to.
+ *              item: Email message to be retrieved.
+ *              size: Receives the size of the mapping.
+ *
+ *  Returns: Pointer to the contents, or NULL if the message is
+ *           compressed, empty or could not be mapped.
+ */
+const char *get_mail_item_mapping(mail_list_t list, mail_item_t item, size_t *size) {
+
+    char path[NAME_MAX + 1];
+    struct stat file_stat;
+    void *data = MAP_FAILED;
+
+    if (item->compressed)
+        return NULL;
+    mail_item_path(list, item, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        *size = file_stat.st_size;
+        data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+}
+
+/** Releases a mapping returned by get_mail_item_mapping.
+ *
+ *  Parameters: data: Pointer to the contents.
+ *              size: Size of the mapping.
+ */
+void release_mail_item_mapping(const char *data, size_t size) {
+    munmap((void *) data, size);
 }
 
 /** Marks a message for deletion in the internal email list. Does not
@@ -343,10 +1092,9 @@ unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
   
     unsigned int rv = 0;
   
-    while (list) {
-        rv += list->item.deleted;
-        list->item.deleted = 0;
-        list = list->next;
+    for (unsigned int i = 0; list && i < list->count; i++) {
+        rv += list->items[i].deleted;
+        list->items[i].deleted = 0;
     }
   
     return rv;
@@ -10,10 +10,13 @@
 #ifndef _MAILUSER_H_
 #define _MAILUSER_H_
 
+#include "arena.h"
+
 #include <stdio.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
+#define MAIL_UID_SIZE 34
 
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
@@ -23,19 +26,30 @@ int is_valid_user(const char *username, const char *password);
 
 user_list_t create_user_list(void);
 void add_user_to_list(user_list_t *list, const char *username);
+void add_user_to_arena_list(arena_t arena, user_list_t *list, const char *username);
 void destroy_user_list(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
+void set_mail_compression(int enabled);
+int save_user_mail(const char *basefile, user_list_t users, int *delivered);
+
+int lock_user_mail(const char *username, int timeout_ms);
+void unlock_user_mail(int lock);
 
+int init_mail_cache(size_t budget);
 mail_list_t load_user_mail(const char *username);
 int destroy_mail_list(mail_list_t list);
+int start_expunge_worker(void);
 unsigned int get_mail_count(mail_list_t list, int includedeleted);
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos);
 size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
-FILE *get_mail_item_contents(mail_item_t item);
+size_t get_mail_item_uid(mail_item_t item, char *uid);
+size_t get_mail_item_top_size(mail_list_t list, mail_item_t item, unsigned int lines);
+FILE *get_mail_item_contents(mail_list_t list, mail_item_t item);
+const char *get_mail_item_mapping(mail_list_t list, mail_item_t item, size_t *size);
+void release_mail_item_mapping(const char *data, size_t size);
 void mark_mail_item_deleted(mail_item_t item);
 
 #endif
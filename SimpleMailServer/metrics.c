@@ -0,0 +1,436 @@
+/* metrics.c
+ * Latency histograms and counters shared by all server processes.
+ *
+ * All values live in one block of shared memory that is mapped before
+ * any connection handler is forked, so processes update the same
+ * counters with atomic additions and no lock. Latencies are kept in
+ * log-linear (HDR-style) histograms: each power of two of
+ * microseconds is split in four buckets, so a bucket is never more
+ * than 25% wide, from 1 microsecond up to about 30 seconds.
+ *
+ * A thread started by metrics_serve answers HTTP requests on a port
+ * bound to the loopback address with all values in the Prometheus
+ * text format, together with the mailbox lock and cache statistics.
+ */
+
+#include "metrics.h"
+#include "maillock.h"
+#include "mailcache.h"
+#include "handoff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define SUB_BUCKET_BITS 2
+#define SUB_BUCKETS     (1 << SUB_BUCKET_BITS)
+#define HIST_BUCKETS    100     // the last bucket also holds slower values
+#define MAX_COMMANDS    32      // distinct verbs with their own histogram
+#define ADMIN_BACKLOG   4
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct command_slot {
+    uint32_t key;               // verb key, 0 if the slot is free
+    struct histogram latency;
+};
+
+struct metrics {
+    int64_t counters[COUNTER_COUNT];
+    struct histogram timers[TIMER_COUNT];
+    struct histogram unknown_commands;
+    struct command_slot commands[MAX_COMMANDS];
+};
+
+static const char *timer_names[TIMER_COUNT] = {
+    "session", "load_user_mail", "save_user_mail", "handle_data", "display_mail", "verify_password"
+};
+
+static struct metrics local_metrics;
+static struct metrics *metrics = &local_metrics;
+
+/** Sets up metrics shared by the current process and all its future
+ *  children. Must be called before any connection handler is forked;
+ *  otherwise, each process keeps its own metrics.
+ *
+ *  Returns: 0 on success, -1 if shared memory is not available.
+ */
+int metrics_init(void) {
+    void *shared = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+    memset(shared, 0, sizeof(struct metrics));
+    metrics = shared;
+    return 0;
+}
+
+/** Returns the current time in nanoseconds from a monotonic clock, to
+ *  be passed later to metrics_time or metrics_command.
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Internal function that returns the bucket of a latency. Values
+ *  below SUB_BUCKETS microseconds get a bucket each; above that, the
+ *  position of the highest bit selects a group of buckets and the
+ *  next SUB_BUCKET_BITS bits select the bucket in the group.
+ */
+static int bucket_of(uint64_t us) {
+    if (us < SUB_BUCKETS)
+        return us;
+    int exponent = 63 - __builtin_clzll(us);
+    int sub = (us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    int bucket = (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/** Internal function that returns the upper bound, in microseconds
+ *  and not included in the bucket, of the values in a bucket.
+ */
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket + 1;
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    int sub = bucket % SUB_BUCKETS;
+    return (uint64_t) (SUB_BUCKETS + sub + 1) << (exponent - SUB_BUCKET_BITS);
+}
+
+/** Internal function that adds a latency to a histogram.
+ */
+static void record(struct histogram *hist, uint64_t start) {
+    uint64_t elapsed = metrics_now() - start;
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->buckets[bucket_of(elapsed / 1000)], 1, __ATOMIC_RELAXED);
+}
+
+/** Records the time taken by an operation.
+ *
+ *  Parameters: timer: The operation.
+ *              start: Value returned by metrics_now when the
+ *                     operation started.
+ */
+void metrics_time(enum metrics_timer timer, uint64_t start) {
+    record(&metrics->timers[timer], start);
+}
+
+/** Records the time taken by a command. Each verb gets its own
+ *  histogram, up to MAX_COMMANDS verbs; others are counted with
+ *  unknown commands.
+ *
+ *  Parameters: key: Key of the verb (see CMD_KEY), 0 for a command
+ *                   that is not known by the server.
+ *              start: Value returned by metrics_now when the command
+ *                     was received.
+ */
+void metrics_command(uint32_t key, uint64_t start) {
+
+    for (int i = 0; key && i < MAX_COMMANDS; i++) {
+        struct command_slot *slot = &metrics->commands[i];
+        uint32_t current = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+        // Claim a free slot; if another process claims it first,
+        // current receives the verb it was claimed for
+        if (!current && __atomic_compare_exchange_n(&slot->key, &current, key, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            current = key;
+        if (current == key) {
+            record(&slot->latency, start);
+            return;
+        }
+    }
+    record(&metrics->unknown_commands, start);
+}
+
+/** Adds a value to a counter.
+ *
+ *  Parameters: counter: The counter.
+ *              value: Value to add; negative values are only used
+ *                     for gauges such as COUNTER_ACTIVE_CONNECTIONS.
+ */
+void metrics_add(enum metrics_counter counter, int64_t value) {
+    __atomic_add_fetch(&metrics->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/** Internal function that writes a histogram in the Prometheus text
+ *  format. Labels, if not empty, are written before the bucket bound.
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels,
+                            const struct histogram *hist) {
+    const char *comma = *labels ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cumulative += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, comma,
+                bucket_limit(i) / 1e6, (unsigned long long) cumulative);
+    }
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, (unsigned long long) count);
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels,
+            __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) count);
+}
+
+/** Internal function that writes a counter or gauge.
+ */
+static void write_value(FILE *out, const char *name, const char *type, const char *help,
+                        long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, value);
+}
+
+/** Internal function that writes the mailbox lock wait time histogram,
+ *  whose buckets are defined by maillock.h.
+ */
+static void write_lock_stats(FILE *out) {
+
+    static const uint64_t bounds[] = MAILLOCK_WAIT_BOUNDS;
+    struct maillock_stats lock;
+    uint64_t cumulative = 0;
+
+    maillock_get_stats(&lock);
+    write_value(out, "mail_lock_acquired_total", "counter", "Mailbox locks taken.", lock.acquired);
+    write_value(out, "mail_lock_contended_total", "counter",
+                "Mailbox locks that had to wait for another session.", lock.contended);
+    write_value(out, "mail_lock_timeouts_total", "counter",
+                "Mailbox locks not taken before the timeout.", lock.timeouts);
+    fprintf(out, "# HELP mail_lock_wait_seconds Time waited for mailbox locks.\n"
+                 "# TYPE mail_lock_wait_seconds histogram\n");
+    for (int i = 0; i < MAILLOCK_WAIT_BUCKETS - 1; i++) {
+        cumulative += lock.wait_buckets[i];
+        fprintf(out, "mail_lock_wait_seconds_bucket{le=\"%g\"} %llu\n", bounds[i] / 1e6,
+                (unsigned long long) cumulative);
+    }
+    fprintf(out, "mail_lock_wait_seconds_bucket{le=\"+Inf\"} %llu\n"
+                 "mail_lock_wait_seconds_sum %.6f\nmail_lock_wait_seconds_count %llu\n",
+            (unsigned long long) lock.acquired, lock.wait_total_us / 1e6,
+            (unsigned long long) lock.acquired);
+}
+
+/** Internal function that writes the mailbox metadata cache statistics.
+ */
+static void write_cache_stats(FILE *out) {
+    struct mailcache_stats cache;
+    mailcache_get_stats(&cache);
+    write_value(out, "mail_cache_hits_total", "counter", "Mail lists loaded from the cache.", cache.hits);
+    write_value(out, "mail_cache_misses_total", "counter", "Mail lists read from disk.", cache.misses);
+    write_value(out, "mail_cache_evictions_total", "counter", "Cache entries evicted.", cache.evictions);
+    write_value(out, "mail_cache_entries", "gauge", "Entries in the cache.", cache.entries);
+    write_value(out, "mail_cache_used_bytes", "gauge", "Bytes used by cache entries.", cache.used);
+    write_value(out, "mail_cache_capacity_bytes", "gauge", "Size of the cache.", cache.capacity);
+}
+
+/** Internal function that writes all metrics in the Prometheus text
+ *  format.
+ */
+static void write_metrics(FILE *out) {
+
+    char labels[64];
+    const int64_t *counters = metrics->counters;
+
+    write_value(out, "mail_received_bytes_total", "counter", "Bytes received from clients.",
+                __atomic_load_n(&counters[COUNTER_BYTES_IN], __ATOMIC_RELAXED));
+    write_value(out, "mail_sent_bytes_total", "counter", "Bytes sent to clients.",
+                __atomic_load_n(&counters[COUNTER_BYTES_OUT], __ATOMIC_RELAXED));
+    write_value(out, "mail_connections_total", "counter", "Connections accepted.",
+                __atomic_load_n(&counters[COUNTER_CONNECTIONS], __ATOMIC_RELAXED));
+    write_value(out, "mail_active_connections", "gauge", "Connections being handled.",
+                __atomic_load_n(&counters[COUNTER_ACTIVE_CONNECTIONS], __ATOMIC_RELAXED));
+    write_value(out, "mail_rejected_connections_total", "counter", "Connections turned away by admission limits.",
+                __atomic_load_n(&counters[COUNTER_REJECTED_CONNECTIONS], __ATOMIC_RELAXED));
+    write_value(out, "mail_throttled_total", "counter", "Times a client was slowed down to its rate limits.",
+                __atomic_load_n(&counters[COUNTER_THROTTLED], __ATOMIC_RELAXED));
+    write_value(out, "mail_login_cache_hits_total", "counter", "Password checks answered by the login cache.",
+                __atomic_load_n(&counters[COUNTER_LOGIN_CACHE_HITS], __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP mail_errors_total Errors by kind.\n# TYPE mail_errors_total counter\n");
+    fprintf(out, "mail_errors_total{kind=\"network\"} %lld\n",
+            (long long) __atomic_load_n(&counters[COUNTER_NETWORK_ERRORS], __ATOMIC_RELAXED));
+    fprintf(out, "mail_errors_total{kind=\"unknown_command\"} %lld\n",
+            (long long) __atomic_load_n(&counters[COUNTER_UNKNOWN_COMMANDS], __ATOMIC_RELAXED));
+    fprintf(out, "mail_errors_total{kind=\"bad_sequence\"} %lld\n",
+            (long long) __atomic_load_n(&counters[COUNTER_DENIED_COMMANDS], __ATOMIC_RELAXED));
+    fprintf(out, "mail_errors_total{kind=\"timeout\"} %lld\n",
+            (long long) __atomic_load_n(&counters[COUNTER_TIMEOUTS], __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP mail_operation_duration_seconds Time spent in an operation.\n"
+                 "# TYPE mail_operation_duration_seconds histogram\n");
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "operation=\"%s\"", timer_names[i]);
+        write_histogram(out, "mail_operation_duration_seconds", labels, &metrics->timers[i]);
+    }
+
+    fprintf(out, "# HELP mail_command_duration_seconds Time spent handling a command, by verb.\n"
+                 "# TYPE mail_command_duration_seconds histogram\n");
+    for (int i = 0; i < MAX_COMMANDS; i++) {
+        uint32_t key = __atomic_load_n(&metrics->commands[i].key, __ATOMIC_RELAXED);
+        if (!key)
+            break;
+        char verb[5] = { key & 0xff, key >> 8 & 0xff, key >> 16 & 0xff, key >> 24, 0 };
+        snprintf(labels, sizeof(labels), "verb=\"%s\"", verb);
+        write_histogram(out, "mail_command_duration_seconds", labels, &metrics->commands[i].latency);
+    }
+    write_histogram(out, "mail_command_duration_seconds", "verb=\"unknown\"", &metrics->unknown_commands);
+
+    write_lock_stats(out);
+    write_cache_stats(out);
+}
+
+/** Internal function that answers a request on the admin port. The
+ *  request itself is not parsed: every request gets all metrics.
+ */
+static void answer(int fd) {
+
+    char request[1024];
+    char *body = NULL;
+    size_t size = 0;
+
+    // Read the request headers, so that closing the connection does
+    // not reset it before the client reads the response
+    ssize_t len, total = 0;
+    while (total < sizeof(request) - 1 &&
+           (len = recv(fd, request + total, sizeof(request) - 1 - total, 0)) > 0) {
+        total += len;
+        request[total] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    FILE *out = open_memstream(&body, &size);
+    if (!out)
+        return;
+    write_metrics(out);
+    fclose(out);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", size);
+    send(fd, header, header_len, MSG_NOSIGNAL);
+    for (size_t sent = 0; sent < size; ) {
+        ssize_t rv = send(fd, body + sent, size - sent, MSG_NOSIGNAL);
+        if (rv <= 0)
+            break;
+        sent += rv;
+    }
+    free(body);
+}
+
+// Thread answering on the admin port, and whether it must stop or
+// has stopped (see metrics_stop)
+static struct {
+    pthread_t thread;
+    int running;
+    int stopping;
+    int stopped;
+} admin = { 0 };
+
+/** Signal handler for SIGUSR1, sent to the admin thread to interrupt
+ *  its wait for a connection when it must stop.
+ */
+static void admin_wakeup_handler(int s) {
+}
+
+/** Internal function run by the admin thread.
+ */
+static void *admin_server(void *arg) {
+    int sockfd = (int) (intptr_t) arg;
+    while (!__atomic_load_n(&admin.stopping, __ATOMIC_ACQUIRE)) {
+        int fd = accept(sockfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                sleep(1);
+            continue;
+        }
+        answer(fd);
+        close(fd);
+    }
+    close(sockfd);
+    __atomic_store_n(&admin.stopped, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/** Starts a thread that exports the metrics in the Prometheus text
+ *  format over HTTP, on a port of the loopback address only. The
+ *  listening socket is taken from the previous instance, and passed to
+ *  the next one, in a graceful reload (see handoff.h).
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) of the admin port.
+ *
+ *  Returns: 0 on success, -1 if the port could not be opened.
+ */
+int metrics_serve(const char *port) {
+
+    struct addrinfo hints = { 0 }, *info;
+    int yes = 1, sockfd = -1;
+    char name[64];
+
+    snprintf(name, sizeof(name), "admin:%s", port);
+    sockfd = handoff_take(name);
+    if (sockfd < 0) {
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo("127.0.0.1", port, &hints, &info) != 0)
+            return -1;
+        sockfd = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, info->ai_protocol);
+        if (sockfd >= 0 &&
+            (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 ||
+             bind(sockfd, info->ai_addr, info->ai_addrlen) < 0 ||
+             listen(sockfd, ADMIN_BACKLOG) < 0)) {
+            close(sockfd);
+            sockfd = -1;
+        }
+        freeaddrinfo(info);
+        if (sockfd < 0)
+            return -1;
+    }
+    handoff_register(name, sockfd);
+
+    // Installed without SA_RESTART, so that the signal interrupts accept
+    struct sigaction sa = { 0 };
+    sa.sa_handler = admin_wakeup_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (pthread_create(&admin.thread, NULL, admin_server, (void *) (intptr_t) sockfd)) {
+        close(sockfd);
+        return -1;
+    }
+    admin.running = 1;
+    return 0;
+}
+
+/** Stops answering on the admin port, e.g., once its socket is handed
+ *  to a new instance, so that scrapes only reach the new instance.
+ *  The socket itself keeps listening for the new instance. A request
+ *  being answered is completed first.
+ */
+void metrics_stop(void) {
+    if (!admin.running)
+        return;
+    __atomic_store_n(&admin.stopping, 1, __ATOMIC_RELEASE);
+    // The signal may come before the thread waits again, so it is sent
+    // until the thread stops
+    while (!__atomic_load_n(&admin.stopped, __ATOMIC_ACQUIRE)) {
+        pthread_kill(admin.thread, SIGUSR1);
+        poll(NULL, 0, 10);
+    }
+    pthread_join(admin.thread, NULL);
+    admin.running = 0;
+}
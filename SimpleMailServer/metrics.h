@@ -0,0 +1,46 @@
+/* metrics.h
+ * Latency histograms and counters shared by all server processes,
+ * exported in the Prometheus text format on a local admin port.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// Operations timed with a latency histogram
+enum metrics_timer {
+    TIMER_SESSION,
+    TIMER_LOAD_USER_MAIL,
+    TIMER_SAVE_USER_MAIL,
+    TIMER_HANDLE_DATA,
+    TIMER_DISPLAY_MAIL,
+    TIMER_VERIFY_PASSWORD,
+    TIMER_COUNT
+};
+
+enum metrics_counter {
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_CONNECTIONS,
+    COUNTER_ACTIVE_CONNECTIONS,     // a gauge: incremented and decremented
+    COUNTER_NETWORK_ERRORS,
+    COUNTER_UNKNOWN_COMMANDS,
+    COUNTER_DENIED_COMMANDS,
+    COUNTER_TIMEOUTS,
+    COUNTER_REJECTED_CONNECTIONS,
+    COUNTER_THROTTLED,
+    COUNTER_LOGIN_CACHE_HITS,
+    COUNTER_COUNT
+};
+
+int metrics_init(void);
+int metrics_serve(const char *port);
+void metrics_stop(void);
+
+uint64_t metrics_now(void);
+void metrics_time(enum metrics_timer timer, uint64_t start);
+void metrics_command(uint32_t key, uint64_t start);
+void metrics_add(enum metrics_counter counter, int64_t value);
+
+#endif
@@ -0,0 +1,186 @@
+/* mymaild.c
+ * A single server for SMTP, LMTP and POP3, on any number of listeners.
+ *
+ * Each listener is given as protocol:[address:]port[/limits], e.g.:
+ *
+ *   mymaild smtp:25 pop3:110 smtp:[::1]:2525/per_ip=4 pop3:127.0.0.1:2110
+ *   mymaild smtp:25 lmtp:127.0.0.1:24 pop3:110
+ *
+ * Without an address, a listener binds every local address, IPv4 and
+ * IPv6. Limits (see admission_parse_limits) apply to the listener
+ * only, on top of those given with -L. All protocols share the same
+ * process, so the user directory, the mailbox cache and the metrics
+ * are shared by all sessions.
+ */
+
+#include "mysmtpd.h"
+#include "mypopd.h"
+#include "mailuser.h"
+#include "server.h"
+#include "admission.h"
+#include "handoff.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USAGE "Invalid arguments. Expected: %s [-z] [-c cache_bytes] [-m buffer_bytes] [-l log_file] [-v] " \
+              "[-a admin_port] [-t timeout_seconds] [-L limits] [-r reload_socket] " \
+              "<smtp|lmtp|pop3>:[address:]port[/limits]...\n"
+
+/* Splits a listener specification into its parts.
+*
+*  Parameters: spec:        Specification, kept by the listener.
+*              listener:    Receives the address, port and handler.
+*              limits:      Limits of the listener, changed by those
+*                           of the specification.
+*
+*  Returns: 0 on success, -1 if the specification is not valid.
+*/
+static int parse_listener(char *spec, struct listener *listener, struct admission_limits *limits) {
+
+    char *address = strchr(spec, ':');
+    if (!address)
+        return -1;
+    *address++ = '\0';
+    if (!strcmp(spec, "smtp"))
+        listener->handler = smtp_handle_client;
+    else if (!strcmp(spec, "lmtp"))
+        listener->handler = lmtp_handle_client;
+    else if (!strcmp(spec, "pop3"))
+        listener->handler = pop3_handle_client;
+    else
+        return -1;
+
+    char *spec_limits = strchr(address, '/');
+    if (spec_limits) {
+        *spec_limits++ = '\0';
+        if (admission_parse_limits(spec_limits, limits) < 0)
+            return -1;
+    }
+
+    // IPv6 addresses are written in brackets, as in URLs
+    char *port;
+    if (*address == '[') {
+        char *end = strchr(address, ']');
+        if (!end || end[1] != ':')
+            return -1;
+        *end = '\0';
+        port = end + 2;
+        address++;
+    } else if ((port = strrchr(address, ':'))) {
+        *port++ = '\0';
+    } else {
+        port = address;
+        address = NULL;
+    }
+    if (!*port || (address && !*address))
+        return -1;
+
+    listener->address = address;
+    listener->port = port;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t cache_budget = POP3_DEFAULT_CACHE_BUDGET;
+    const char *log_file = NULL;
+    const char *admin_port = NULL;
+    const char *reload_socket = NULL;
+    struct admission_limits limits;
+    admission_default_limits(&limits);
+    int opt;
+    while ((opt = getopt(argc, argv, "zc:m:l:va:t:L:r:")) != -1) {
+        switch (opt) {
+            case 'z':
+                // Compress messages as they are saved in the mail storage
+                set_mail_compression(1);
+                break;
+            case 'c':
+                // Memory budget, in bytes, of the mailbox metadata cache
+                cache_budget = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                // Memory cap, in bytes, of the network buffers of all
+                // connections together
+                bufpool_set_limit(strtoul(optarg, NULL, 10));
+                break;
+            case 'l':
+                log_file = optarg;
+                break;
+            case 'v':
+                log_set_level(LOG_LEVEL_DEBUG);
+                break;
+            case 'a':
+                admin_port = optarg;
+                break;
+            case 't':
+                // SMTP command timeout and POP3 autologout timer; 0
+                // waits forever
+                smtp_set_timeout(strtoul(optarg, NULL, 10) * 1000);
+                pop3_set_timeout(strtoul(optarg, NULL, 10) * 1000);
+                break;
+            case 'r':
+                // Unix socket used to hand the listening sockets over to a
+                // new instance started with the same path
+                reload_socket = optarg;
+                break;
+            case 'L':
+                // Admission limits of all listeners, e.g.,
+                // max=200,per_ip=8,commands=20/50
+                if (admission_parse_limits(optarg, &limits) < 0) {
+                    fprintf(stderr, "Invalid limits: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+        }
+    }
+
+    int count = argc - optind;
+    struct listener *listeners = calloc(count, sizeof(struct listener));
+    struct admission_limits *listener_limits = calloc(count, sizeof(struct admission_limits));
+    if (count < 1 || !listeners || !listener_limits) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        listener_limits[i] = limits;
+        char *spec = strdup(argv[optind + i]);
+        if (!spec || parse_listener(spec, &listeners[i], &listener_limits[i]) < 0) {
+            fprintf(stderr, "Invalid listener: %s\n", argv[optind + i]);
+            return 1;
+        }
+    }
+
+    if (log_init(log_file) < 0)
+        fprintf(stderr, "Could not start logging to %s, messages will not be logged\n", log_file ? log_file : "stderr");
+    smtp_init();
+    pop3_init(cache_budget);
+    if (metrics_init() < 0)
+        fprintf(stderr, "Could not share metrics between processes\n");
+    if (reload_socket && handoff_init(reload_socket) < 0)
+        fprintf(stderr, "Could not set up reload socket %s, reloads will not be possible\n", reload_socket);
+    if (admin_port && metrics_serve(admin_port) < 0)
+        fprintf(stderr, "Could not open admin port %s, metrics will not be exported\n", admin_port);
+
+    // Each listener has its own limits and counts its own clients
+    for (int i = 0; i < count; i++) {
+        listener_limits[i].reject_reply =
+            listeners[i].handler == pop3_handle_client ? pop3_busy_reply() : smtp_busy_reply();
+        listeners[i].admission = admission_create(&listener_limits[i]);
+        if (!listeners[i].admission)
+            fprintf(stderr, "Could not create admission table, connections will not be limited\n");
+    }
+
+    run_servers(listeners, count);
+
+    return 0;
+}
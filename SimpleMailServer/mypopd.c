@@ -1,17 +1,40 @@
+#include "mypopd.h"
 #include "netbuffer.h"
 #include "mailuser.h"
+#include "credentials.h"
 #include "server.h"
+#include "admission.h"
+#include "handoff.h"
+#include "maillock.h"
+#include "dotstuff.h"
+#include "command.h"
+#include "reply.h"
+#include "arena.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <ctype.h>
-#include <sys/utsname.h>
 
 #define MAX_LINE_LENGTH 1024
 #define TERMINATE_DATA	".\r\n"
+#define LOCK_TIMEOUT_MS	2000
+#define LISTING_CHUNK_SIZE	(256 * 1024)
+#define LISTING_FALLBACK_SIZE	(4 * 1024)
+#define MAIL_BLOCK_SIZE		(64 * 1024)
+#define ARENA_BLOCK_SIZE	(128 * 1024)
+#define LISTING_LINE_MAX	(24 + MAIL_UID_SIZE)
+// Inactivity before the session ends, the minimum allowed by RFC 1939
+#define AUTOLOGOUT_TIMEOUT_MS	(10 * 60 * 1000)
+// Cost of the password hashes made with -H
+#define HASH_ITERATIONS	100000
 
 #define GREETING_MESSAGE    "POP3 server ready"
+#define BUSY_MESSAGE        "[SYS/TEMP] Too many connections, try again later."
 
 #define USER_FOUND_MESSAGE		"Welcome,"
 #define USER_NOT_FOUND_MESSAGE	"No mailbox is found for"
@@ -19,6 +42,8 @@
 #define PASS_CORRECT_MESSAGE			"User authenticated."
 #define PASS_INCORRECT_MESSAGE			"Wrong password, try again."
 #define PASS_USER_UNDEFINED_MESSAGE		"Must call USER first."
+#define PASS_MAILBOX_LOCKED_MESSAGE		"[IN-USE] Mailbox is in use by another session."
+#define PASS_AUTHENTICATED_MESSAGE		"Already authenticated."
 
 #define DELE_SUCCESS_MESSAGE	"Message deleted"
 #define DELE_INVALID_MESSAGE	"Invalid message"
@@ -29,57 +54,201 @@
 #define RETR_NOT_FOUND_MESSAGE	"Item does not exist"
 #define RETR_OCTETS_MESSAGE		"octets"
 
+#define LIST_NOT_FOUND_MESSAGE	"msg does not exist"
+
+#define TOP_INVALID_MESSAGE		"Expected a message number and a non-negative number of lines"
+#define TOP_SUCCESS_MESSAGE		"Displaying message headers and first lines:"
+
+#define UIDL_SUCCESS_MESSAGE	"Unique IDs follow"
+#define UIDL_INVALID_MESSAGE	"Invalid message number"
+#define UIDL_NOT_FOUND_MESSAGE	"Item does not exist"
+
 
 #define RSET_RESTORED_MESSAGE	"messages restored"
 
+#define QUIT_MESSAGE	"quit"
+
+#define CAPA_SUCCESS_MESSAGE	"Capability list follows"
+// Extensions advertised by CAPA (RFC 2449), one per line
+#define CAPABILITIES	"USER\r\nTOP\r\nUIDL\r\nPIPELINING\r\nRESP-CODES\r\n"
+
 #define BAD_FORMAT_MESSAGE			"Bad format for the command."
 #define NOT_AUTHENTICATED_MESSAGE	"Log in first."
 #define UNKNOWN_COMMAND_MESSAGE		"Unknown command. Try again"
 
 // Commands
-#define PASS "pass"
-#define USER "user"
-#define NOOP "noop"
-#define QUIT "quit"
-#define STAT "stat"
-#define LIST "list"
-#define RETR "retr"
-#define DELE "dele"
-#define RSET "rset"
+#define PASS CMD_KEY('p', 'a', 's', 's')
+#define USER CMD_KEY('u', 's', 'e', 'r')
+#define NOOP CMD_KEY('n', 'o', 'o', 'p')
+#define QUIT CMD_KEY('q', 'u', 'i', 't')
+#define STAT CMD_KEY('s', 't', 'a', 't')
+#define LIST CMD_KEY('l', 'i', 's', 't')
+#define RETR CMD_KEY('r', 'e', 't', 'r')
+#define DELE CMD_KEY('d', 'e', 'l', 'e')
+#define RSET CMD_KEY('r', 's', 'e', 't')
+#define TOP  CMD_KEY('t', 'o', 'p', 0)
+#define UIDL CMD_KEY('u', 'i', 'd', 'l')
+#define CAPA CMD_KEY('c', 'a', 'p', 'a')
+
+// Session states (RFC 1939), as bits for the command table
+#define STATE_AUTHORIZATION	0x1
+#define STATE_TRANSACTION	0x2
+#define ANY_STATE			(STATE_AUTHORIZATION | STATE_TRANSACTION)
 
 // Codes
 #define OK  "+OK"
 #define ERR "-ERR"
 
-static void handle_client(int fd);
+struct pop3_session {
+	int fd;
+	unsigned int state;
+	char username[MAX_LINE_LENGTH + 1];	// empty until USER succeeds
+	int mailbox_lock;
+	struct mail_list* list;
+	int update;		// QUIT received, deleted messages are removed
+	arena_t arena;		// memory used by a single command, reset after it
+	struct reply reply;
+};
+
+// Changed with -t
+static unsigned int autologout_timeout_ms = AUTOLOGOUT_TIMEOUT_MS;
+
+/* Sets up the state shared by all POP3 sessions: lock statistics, the
+*  mailbox cache and the expunge worker. Must be called before any
+*  client is handled. Parts that cannot be set up are reported and
+*  done without.
+*
+*  Parameters: cache_budget:	Memory budget, in bytes, of the mailbox
+*								metadata cache.
+*/
+void pop3_init(size_t cache_budget) {
+	if (maillock_init() < 0)
+		fprintf(stderr, "Could not share lock statistics between processes\n");
+	if (init_mail_cache(cache_budget) < 0)
+		fprintf(stderr, "Could not create mailbox cache, mail lists will be read from disk\n");
+	if (start_expunge_worker() < 0)
+		fprintf(stderr, "Could not start expunge worker, deleted messages will be kept\n");
+	if (credentials_init(0) < 0)
+		fprintf(stderr, "Could not create login cache, every hashed password will be checked\n");
+}
 
-int main(int argc, char* argv[]) {
+/* Changes the inactivity allowed before the autologout timer ends a
+*  session.
+*
+*  Parameters: timeout_ms:	Time in milliseconds; 0 waits forever.
+*/
+void pop3_set_timeout(unsigned int timeout_ms) {
+	autologout_timeout_ms = timeout_ms;
+}
+
+/* Returns the reply sent to clients turned away by admission limits.
+*/
+const char* pop3_busy_reply(void) {
+	return ERR " " BUSY_MESSAGE "\r\n";
+}
 
-	if (argc != 2) {
-		fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+#if !defined(NO_MAIN)
+/* Prints the user file entry of a password read from the standard
+*  input, hashed.
+*
+*  Returns: Exit status of the program.
+*/
+static int print_password_hash(void) {
+	char password[MAX_PASSWORD_SIZE + 2];
+	char entry[MAX_PASSWORD_SIZE + 1];
+	if (!fgets(password, sizeof(password), stdin)) {
+		fprintf(stderr, "Expected a password on standard input\n");
 		return 1;
 	}
-
-	run_server(argv[1], handle_client);
-
+	password[strcspn(password, "\r\n")] = '\0';
+	if (credentials_hash(password, HASH_ITERATIONS, entry, sizeof(entry)) < 0) {
+		fprintf(stderr, "Could not hash password\n");
+		return 1;
+	}
+	printf("%s\n", entry);
 	return 0;
 }
 
-/* Counts the number of times a given character occurs in the string.
-*
-*  Parameters: character:   Character to look for.
-*              str:         String to crawl through.
-*
-*  Returns: Number of times character appears in the string
-*/
-static int get_char_count(const char character, const char* str) {
-	int count = 0;
-	for (int i = 0; i < strlen(str); i++) {
-		if (str[i] == character)
-			count++;
+int main(int argc, char* argv[]) {
+
+	size_t cache_budget = POP3_DEFAULT_CACHE_BUDGET;
+	const char* log_file = NULL;
+	const char* admin_port = NULL;
+	const char* reload_socket = NULL;
+	struct admission_limits limits;
+	admission_default_limits(&limits);
+	limits.reject_reply = pop3_busy_reply();
+	int opt;
+	while ((opt = getopt(argc, argv, "Hc:m:l:va:t:L:r:")) != -1) {
+		switch (opt) {
+			case 'H':
+				// Hashes a password for the user file, e.g.,
+				// echo secret | mypopd -H
+				return print_password_hash();
+			case 'c':
+				// Memory budget, in bytes, of the mailbox metadata cache
+				cache_budget = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				// Memory cap, in bytes, of the network buffers of all
+				// connections together
+				bufpool_set_limit(strtoul(optarg, NULL, 10));
+				break;
+			case 'l':
+				log_file = optarg;
+				break;
+			case 'v':
+				log_set_level(LOG_LEVEL_DEBUG);
+				break;
+			case 'a':
+				admin_port = optarg;
+				break;
+			case 't':
+				// Inactivity allowed before the autologout timer ends
+				// the session; 0 waits forever
+				pop3_set_timeout(strtoul(optarg, NULL, 10) * 1000);
+				break;
+			case 'r':
+				// Unix socket used to hand the listening sockets over to a
+				// new instance started with the same path
+				reload_socket = optarg;
+				break;
+			case 'L':
+				// Admission limits, e.g., max=200,per_ip=8,commands=20/50
+				if (admission_parse_limits(optarg, &limits) < 0) {
+					fprintf(stderr, "Invalid limits: %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Invalid arguments. Expected: %s [-H] [-c cache_bytes] [-m buffer_bytes] [-l log_file] [-v] [-a admin_port] [-t timeout_seconds] [-L limits] [-r reload_socket] <port>\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		fprintf(stderr, "Invalid arguments. Expected: %s [-H] [-c cache_bytes] [-m buffer_bytes] [-l log_file] [-v] [-a admin_port] [-t timeout_seconds] [-L limits] [-r reload_socket] <port>\n", argv[0]);
+		return 1;
 	}
-	return count;
+
+	if (log_init(log_file) < 0)
+		fprintf(stderr, "Could not start logging to %s, messages will not be logged\n", log_file ? log_file : "stderr");
+	pop3_init(cache_budget);
+	if (metrics_init() < 0)
+		fprintf(stderr, "Could not share metrics between processes\n");
+	if (reload_socket && handoff_init(reload_socket) < 0)
+		fprintf(stderr, "Could not set up reload socket %s, reloads will not be possible\n", reload_socket);
+	if (admin_port && metrics_serve(admin_port) < 0)
+		fprintf(stderr, "Could not open admin port %s, metrics will not be exported\n", admin_port);
+	admission_t admission = admission_create(&limits);
+	if (!admission)
+		fprintf(stderr, "Could not create admission table, connections will not be limited\n");
+
+	run_server(argv[optind], pop3_handle_client, admission);
+
+	return 0;
 }
+#endif
 
 /* Checks if the string only contains numeric characters
 *
@@ -89,259 +258,428 @@ static int get_char_count(const char character, const char* str) {
 *			0 if the string contains any other type of character
 */
 static int is_valid_int(const char* str) {
-	for (int i = 0; i < strlen(str); i++) {
-		if (!isdigit(str[i]))
+	for (; *str; str++) {
+		if (!isdigit((unsigned char) *str))
 			return 0;
 	}
 	return 1;
 }
 
 
-/* Reads the given mail and displays each line in a net buffer
-*  CONSTRAINTS: assumes that a live connection has been established (net_buffer)
-*				!! assumes that mail is valid and NOT NULL !!
-*				Every line is (length < MAX_LINE_LENGTH)
+/* Sends the contents of the given mail, dot-stuffed and with bare LFs
+*  converted to CRLF, followed by the termination line. Uncompressed mail is
+*  mapped into memory and sent straight from the mapping; compressed mail is
+*  read and sent one block at a time.
 *
-*  Parameters:	fd:		File descriptor used by the net buffer to communicae with the client
+*  Parameters:	fd:		File descriptor used to communicate with the client
+*				list:	Mail list the mail item belongs to
 *				mail:	Source mail item to read the data from
+*				arena:	Arena the read buffer is allocated from
 *
 */
-void display_mail(const int fd, const struct mail_item* mail) {
-	FILE* file = get_mail_item_contents(mail);
-	char line[MAX_LINE_LENGTH];
+void display_mail(const int fd, struct mail_list* list, struct mail_item* mail, arena_t arena) {
+	struct dot_stuffer ds;
+	size_t size;
+
+	ds_init(&ds, fd);
+	const char* data = get_mail_item_mapping(list, mail, &size);
+	if (data) {
+		ds_write(&ds, data, size);
+		ds_finish(&ds);
+		release_mail_item_mapping(data, size);
+		return;
+	}
 
-	while (fgets(line, MAX_LINE_LENGTH, file)) {
-		if (line[0] == TERMINATE_DATA[0])
-			send_formatted(fd, "%c%s", TERMINATE_DATA[0], line);
+	FILE* file = get_mail_item_contents(list, mail);
+	char* block = arena_alloc(arena, MAIL_BLOCK_SIZE);
+	while (file && (size = fread(block, 1, MAIL_BLOCK_SIZE, file)) > 0 &&
+		   ds_write(&ds, block, size) == 0 && ds_flush(&ds) == 0)
+		;
+	ds_finish(&ds);
+	if (file)
+		fclose(file);
+}
+
+/* Sends the header section of the given mail and a number of lines of its
+*  body, as required by the TOP command. The mailbox index gives the number
+*  of bytes to send, so uncompressed mail is sent straight from a mapping,
+*  and compressed mail is fetched with a single read.
+*
+*  Parameters:	fd:		File descriptor used to communicate with the client
+*				list:	Mail list the mail item belongs to
+*				mail:	Source mail item to read the data from
+*				lines:	Number of body lines to send
+*				arena:	Arena the read buffer is allocated from
+*/
+static void display_mail_top(const int fd, struct mail_list* list, struct mail_item* mail, unsigned int lines,
+							 arena_t arena) {
+	struct dot_stuffer ds;
+	size_t size = get_mail_item_top_size(list, mail, lines), mapped;
+
+	ds_init(&ds, fd);
+	const char* data = get_mail_item_mapping(list, mail, &mapped);
+	if (data) {
+		ds_write(&ds, data, size < mapped ? size : mapped);
+		ds_finish(&ds);
+		release_mail_item_mapping(data, mapped);
+		return;
+	}
+
+	FILE* file = get_mail_item_contents(list, mail);
+	char* buffer = arena_alloc(arena, size + 1);
+	size_t len = file && buffer ? fread(buffer, 1, size, file) : 0;
+	ds_write(&ds, buffer, len);
+	ds_finish(&ds);
+	if (file)
+		fclose(file);
+}
+
+/* Sends the response to LIST or UIDL without arguments: one line per message
+*  not marked as deleted, with its size or unique ID, followed by the
+*  termination line. The list is walked once, with lines formatted directly
+*  into a large chunk, borrowed from the buffer pool, that is sent whenever
+*  it fills up.
+*
+*  Parameters:	fd:		File descriptor used to communicate with the client
+*				list:	Mail list of the session
+*				uidl:	1 to send unique IDs (UIDL), 0 to send sizes (LIST)
+*/
+static void send_listing(const int fd, struct mail_list* list, int uidl) {
+	unsigned int total = get_mail_count(list, 1);
+	char fallback[LISTING_FALLBACK_SIZE];
+	char* chunk = bufpool_try_get(LISTING_CHUNK_SIZE);
+	size_t chunk_size = chunk ? LISTING_CHUNK_SIZE : sizeof(fallback);
+	char* pos;
+
+	// Past the memory cap, the listing is sent in smaller pieces
+	if (!chunk)
+		chunk = fallback;
+	if (uidl) {
+		pos = stpcpy(chunk, OK " " UIDL_SUCCESS_MESSAGE "\r\n");
+	} else {
+		pos = format_uint(stpcpy(chunk, OK " "), get_mail_count(list, 0));
+		pos = format_uint(stpcpy(pos, " messages, ("), get_mail_list_size(list));
+		pos = stpcpy(pos, " octets)\r\n");
+	}
+
+	for (unsigned int i = 0; i < total; i++) {
+		struct mail_item* mail = get_mail_item(list, i);
+		if (!mail)
+			continue;
+		if (chunk + chunk_size - pos < LISTING_LINE_MAX) {
+			send_all(fd, chunk, pos - chunk);
+			pos = chunk;
+		}
+		pos = format_uint(pos, i + 1);
+		*pos++ = ' ';
+		if (uidl)
+			pos += get_mail_item_uid(mail, pos);
 		else
-			send_formatted(fd, "%s", line);
+			pos = format_uint(pos, get_mail_item_size(mail));
+		*pos++ = '\r';
+		*pos++ = '\n';
+	}
+	memcpy(pos, TERMINATE_DATA, strlen(TERMINATE_DATA));
+	pos += strlen(TERMINATE_DATA);
+	send_all(fd, chunk, pos - chunk);
+	if (chunk != fallback)
+		bufpool_put(chunk, LISTING_CHUNK_SIZE);
+}
+
+static int do_user(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc != 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	reply_begin(&session->reply);
+	if (is_valid_user(cmd->argv[0], NULL)) {
+		reply_append_str(&session->reply, OK " " USER_FOUND_MESSAGE " ");
+		strcpy(session->username, cmd->argv[0]);
+	} else {
+		reply_append_str(&session->reply, ERR " " USER_NOT_FOUND_MESSAGE " ");
+	}
+	reply_append_str(&session->reply, cmd->argv[0]);
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static int do_pass(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc != 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!session->username[0]) {
+		reply_literal(session->fd, ERR " " PASS_USER_UNDEFINED_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!is_valid_user(session->username, cmd->argv[0])) {
+		reply_literal(session->fd, ERR " " PASS_INCORRECT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	// RFC 1939 requires exclusive access to the maildrop
+	session->mailbox_lock = lock_user_mail(session->username, LOCK_TIMEOUT_MS);
+	if (session->mailbox_lock < 0) {
+		log_warn("server: could not lock mailbox for %s", session->username);
+		reply_literal(session->fd, ERR " " PASS_MAILBOX_LOCKED_MESSAGE "\r\n");
+		return CMD_CONTINUE;
 	}
-	send_formatted(fd, "%s", TERMINATE_DATA);
-	fclose(file);
+	session->state = STATE_TRANSACTION;
+	session->list = load_user_mail(session->username);
+	reply_literal(session->fd, OK " " PASS_CORRECT_MESSAGE "\r\n");
+	return CMD_CONTINUE;
 }
 
-void handle_client(int fd) {
-	struct utsname my_uname;
-	uname(&my_uname);
+static int do_noop(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	reply_literal(session->fd, OK "\r\n");
+	return CMD_CONTINUE;
+}
+
+static int do_quit(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	session->update = 1;
+	reply_literal(session->fd, OK " " QUIT_MESSAGE "\r\n");
+	return CMD_CLOSE;
+}
+
+static int do_capa(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	reply_literal(session->fd, OK " " CAPA_SUCCESS_MESSAGE "\r\n" CAPABILITIES TERMINATE_DATA);
+	return CMD_CONTINUE;
+}
+
+static int do_stat(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, OK " ");
+	reply_append_uint(&session->reply, get_mail_count(session->list, 0));
+	reply_append_str(&session->reply, " ");
+	reply_append_uint(&session->reply, get_mail_list_size(session->list));
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static int do_list(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc > 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!cmd->argc) {
+		send_listing(session->fd, session->list, 0);
+		return CMD_CONTINUE;
+	}
+	struct mail_item* mail = is_valid_int(cmd->argv[0]) ? get_mail_item(session->list, atoi(cmd->argv[0]) - 1) : NULL;
+	if (!mail) {
+		reply_literal(session->fd, ERR " " LIST_NOT_FOUND_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, OK " ");
+	reply_append_uint(&session->reply, atoi(cmd->argv[0]));
+	reply_append_str(&session->reply, " ");
+	reply_append_uint(&session->reply, get_mail_item_size(mail));
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static int do_retr(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc != 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!is_valid_int(cmd->argv[0])) {
+		reply_literal(session->fd, ERR " " RETR_INVALID_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	struct mail_item* mail = get_mail_item(session->list, atoi(cmd->argv[0]) - 1);
+	if (!mail) {
+		reply_literal(session->fd, ERR " " RETR_NOT_FOUND_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, OK " ");
+	reply_append_uint(&session->reply, get_mail_item_size(mail));
+	reply_append_str(&session->reply, " " RETR_OCTETS_MESSAGE);
+	reply_send(session->fd, &session->reply);
+	uint64_t start = metrics_now();
+	display_mail(session->fd, session->list, mail, session->arena);
+	metrics_time(TIMER_DISPLAY_MAIL, start);
+	return CMD_CONTINUE;
+}
+
+static int do_top(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc != 2) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!is_valid_int(cmd->argv[0]) || !is_valid_int(cmd->argv[1])) {
+		reply_literal(session->fd, ERR " " TOP_INVALID_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	struct mail_item* mail = get_mail_item(session->list, atoi(cmd->argv[0]) - 1);
+	if (!mail) {
+		reply_literal(session->fd, ERR " " RETR_NOT_FOUND_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	reply_literal(session->fd, OK " " TOP_SUCCESS_MESSAGE "\r\n");
+	display_mail_top(session->fd, session->list, mail, strtoul(cmd->argv[1], NULL, 10), session->arena);
+	return CMD_CONTINUE;
+}
+
+static int do_uidl(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	char uid[MAIL_UID_SIZE];
+	if (cmd->argc > 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!cmd->argc) {
+		send_listing(session->fd, session->list, 1);
+		return CMD_CONTINUE;
+	}
+	if (!is_valid_int(cmd->argv[0])) {
+		reply_literal(session->fd, ERR " " UIDL_INVALID_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	struct mail_item* mail = get_mail_item(session->list, atoi(cmd->argv[0]) - 1);
+	if (!mail) {
+		reply_literal(session->fd, ERR " " UIDL_NOT_FOUND_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, OK " ");
+	reply_append_uint(&session->reply, atoi(cmd->argv[0]));
+	reply_append_str(&session->reply, " ");
+	reply_append(&session->reply, uid, get_mail_item_uid(mail, uid));
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static int do_dele(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	if (cmd->argc != 1) {
+		reply_literal(session->fd, ERR " " BAD_FORMAT_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	if (!is_valid_int(cmd->argv[0])) {
+		reply_literal(session->fd, ERR " " DELE_INVALID_MESSAGE "\r\n");
+		return CMD_CONTINUE;
+	}
+	struct mail_item* mail = get_mail_item(session->list, atoi(cmd->argv[0]) - 1);
+	if (mail) {
+		mark_mail_item_deleted(mail);
+		reply_literal(session->fd, OK " " DELE_SUCCESS_MESSAGE "\r\n");
+	} else {
+		reply_literal(session->fd, ERR " " DELE_NOT_FOUND_MESSAGE "\r\n");
+	}
+	return CMD_CONTINUE;
+}
+
+static int do_rset(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	unsigned int count = reset_mail_list_deleted_flag(session->list);
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, OK " ");
+	reply_append_uint(&session->reply, count);
+	reply_append_str(&session->reply, " " RSET_RESTORED_MESSAGE);
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static int do_unknown(void* arg, struct command* cmd) {
+	struct pop3_session* session = arg;
+	reply_literal(session->fd, ERR " " UNKNOWN_COMMAND_MESSAGE "\r\n");
+	return CMD_CONTINUE;
+}
+
+static int do_denied(void* arg, const struct command_handler* handler, struct command* cmd) {
+	struct pop3_session* session = arg;
+	reply_begin(&session->reply);
+	reply_append_str(&session->reply, ERR " ");
+	reply_append_str(&session->reply, handler->denied);
+	reply_send(session->fd, &session->reply);
+	return CMD_CONTINUE;
+}
+
+static const struct command_handler pop3_handlers[] = {
+	{ USER, STATE_AUTHORIZATION, do_user, PASS_AUTHENTICATED_MESSAGE },
+	{ PASS, STATE_AUTHORIZATION, do_pass, PASS_AUTHENTICATED_MESSAGE },
+	{ QUIT, ANY_STATE,           do_quit, NULL },
+	{ CAPA, ANY_STATE,           do_capa, NULL },
+	{ NOOP, STATE_TRANSACTION,   do_noop, NOT_AUTHENTICATED_MESSAGE },
+	{ STAT, STATE_TRANSACTION,   do_stat, NOT_AUTHENTICATED_MESSAGE },
+	{ LIST, STATE_TRANSACTION,   do_list, NOT_AUTHENTICATED_MESSAGE },
+	{ RETR, STATE_TRANSACTION,   do_retr, NOT_AUTHENTICATED_MESSAGE },
+	{ TOP,  STATE_TRANSACTION,   do_top,  NOT_AUTHENTICATED_MESSAGE },
+	{ UIDL, STATE_TRANSACTION,   do_uidl, NOT_AUTHENTICATED_MESSAGE },
+	{ DELE, STATE_TRANSACTION,   do_dele, NOT_AUTHENTICATED_MESSAGE },
+	{ RSET, STATE_TRANSACTION,   do_rset, NOT_AUTHENTICATED_MESSAGE },
+};
+
+static const struct command_table pop3_commands = {
+	pop3_handlers, sizeof(pop3_handlers) / sizeof(pop3_handlers[0]), do_unknown, do_denied
+};
+
+void pop3_handle_client(int fd) {
 	char recvbuf[MAX_LINE_LENGTH + 1];
 	net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+	nb_set_timeout(nb, autologout_timeout_ms);
+	struct pop3_session session = { .fd = fd, .state = STATE_AUTHORIZATION, .mailbox_lock = -1,
+									.arena = arena_create(ARENA_BLOCK_SIZE) };
+	struct command cmd;
+	uint64_t start = metrics_now();
 
-	/* TO BE COMPLETED BY THE STUDENT */
-	struct mail_list* m_list = NULL;
-	unsigned int mail_count = 0;
-
-	char* username = NULL;
-	int authenticated = 0;
+	// Responses are buffered and only sent once every command already
+	// received is handled, so pipelined commands get their responses
+	// in a single write
+	set_send_buffering(fd, 1);
 
 	//send the greeting message
-	send_formatted(fd, "%s %s\r\n", OK, GREETING_MESSAGE);
+	reply_literal(fd, OK " " GREETING_MESSAGE "\r\n");
 	while (1) {
+		if (!nb_has_line(nb) && send_flush(fd) < 0) {
+			log_info("server: Could not send responses. Aborting connection fd: %d", fd);
+			metrics_add(COUNTER_NETWORK_ERRORS, 1);
+			break;
+		}
 		int connectionState = nb_read_line(nb, recvbuf);
+		// Autologout: the session ends without a response
+		if (connectionState < 0 && nb_timed_out(nb)) {
+			log_info("server: Autologout timer expired. Closing connection fd: %d", fd);
+			break;
+		}
 		// Connection interrupted, throw it out!
 		if (connectionState <= 0) {
-			dlog("server: Connection interrupted. Aborting connection fd: %d", fd);
+			log_info("server: Connection interrupted. Aborting connection fd: %d", fd);
+			if (connectionState < 0)
+				metrics_add(COUNTER_NETWORK_ERRORS, 1);
 			break;
 		}
-		recvbuf[MAX_LINE_LENGTH] = NULL;    // Security reasons, the end of the string will always end with a NULL 
-											// in case the user input doesn't contain any (very bad thing!!)
-
-		int argcount = get_char_count(' ', recvbuf);
-		char* line[argcount + 1];
-		split(recvbuf, line);
 
 		// Empty response, ignore.
-		if (line[0] == NULL) {
+		if (!cmd_parse(recvbuf, &cmd))
 			continue;
-		}
-
-		//USER
-		if (!strcasecmp(line[0], USER)) {
-
-			dlog("server: received USER command\n");
-			if (argcount != 1 || !line[1]) {
-				send_formatted(fd, "%s %s\r\n", ERR, BAD_FORMAT_MESSAGE);
-				continue;
-			}
-			char* message = USER_NOT_FOUND_MESSAGE;
-			char* code = ERR;
-			if (is_valid_user(line[1], NULL)) {
-				message = USER_FOUND_MESSAGE;
-				code = OK;
-				username = strdup(line[1]);
-			}
-			send_formatted(fd, "%s %s %s\r\n", code, message, line[1]);
-
-		}
-
-		//PASS
-		else if (!strcasecmp(line[0], PASS)) {
-
-			dlog("server: received PASS command\n");
-			if (argcount != 1 || !line[1]) {
-				send_formatted(fd, "%s %s\r\n", ERR, BAD_FORMAT_MESSAGE);
-				continue;
-			}
-			if (!username) {
-				send_formatted(fd, "%s %s\r\n", ERR, PASS_USER_UNDEFINED_MESSAGE);
-				continue;
-			}
-			char* message = PASS_INCORRECT_MESSAGE;
-			char* code = ERR;
-			if (is_valid_user(username, line[1])) {
-				message = PASS_CORRECT_MESSAGE;
-				code = OK;
-				authenticated++;
-				m_list = load_user_mail(username);
-			}
-			send_formatted(fd, "%s %s\r\n", code, message);
-		}
 
-		//do easy NOOP first
-		else if (!strcasecmp(line[0], NOOP)) {
-			dlog("server: received NOOP command\n");
-			if (!authenticated) {
-				send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-			} else
-                send_formatted(fd, "%s\r\n", OK);
-		}
-		//QUIT
-		else if (!strcasecmp(line[0], QUIT)) {
-			dlog("server: received QUIT command\n");
-			send_formatted(fd, "%s %s\r\n", OK, QUIT);
+		log_debug("server: received %s command", cmd.verb);
+		int rv = cmd_dispatch(&pop3_commands, &session, session.state, &cmd);
+		arena_reset(session.arena);
+		if (rv == CMD_CLOSE)
 			break;
-		}
-		//STAT
-		else if (!strcasecmp(line[0], STAT)) {
-			dlog("server: received STAT command\n");
-			if (!authenticated) {
-				send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-			} else if (m_list != NULL){
-                   mail_count = get_mail_count(m_list, 0);
-                   int list_size = (int)get_mail_list_size(m_list);
-                   send_formatted(fd, "+OK %d %d\r\n", mail_count, list_size);
-            } else {
-                //mail list is empty
-                mail_count = 0;
-                send_formatted(fd, "+OK 0 0\r\n");
-            }
-          }
-
-		//LIST
-		else if (!strcasecmp(line[0], LIST)) {
-
-            dlog("server: received LIST command\n");
-            if (!authenticated) {
-                send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-                continue;
-            }
-            if (!line[1]){
-                int mail_size = (int)get_mail_list_size(m_list);
-                unsigned int mc = get_mail_count(m_list, 0);
-                unsigned int mail_count_del = get_mail_count(m_list, 1);
-                if (mc == 0){
-                    send_formatted(fd, "+OK 0 0\r\n");
-                    send_formatted(fd, ".\r\n");
-                } else {
-                    send_formatted(fd, "+OK %d messages, (%d octets)\r\n", mc, mail_size);
-                    for (int i = 0; i < mail_count_del; ++i) {
-                        struct mail_item* mailItem = get_mail_item(m_list, i);
-                        if (mailItem != NULL) {
-                            int size =(int) get_mail_item_size(mailItem);
-                            send_formatted(fd, "%d %d\r\n", i+1, size);
-                        }
-                    }
-                    send_formatted(fd, ".\r\n");
-                }
-            }
-            else{
-                if (atoi(line[1] == 0) ){
-                    send_formatted(fd, "-ERR msg does not exist\r\n");
-                } else {
-                    struct mail_item *mailItem = get_mail_item(m_list, atoi(line[1]) - 1);
-                    if (mailItem != NULL) {
-                        int size = (int) get_mail_item_size(mailItem);
-                        send_formatted(fd, "+OK %d %d\r\n", atoi(line[1]), size);
-                    } else {
-                        send_formatted(fd, "-ERR msg does not exist");
-                    }
-                }
-
-            }
-		}
-		//RETR
-		else if (!strcasecmp(line[0], RETR)) {
-			dlog("server: received RETR command\n");
-			if (!authenticated) {
-				send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-				continue;
-			}
-			if (argcount != 1 || !line[1]) {
-				send_formatted(fd, "%s %s\r\n", ERR, BAD_FORMAT_MESSAGE);
-				continue;
-			}
-			if (!is_valid_int(line[1])) {
-				send_formatted(fd, "%s %s\r\n", ERR, RETR_INVALID_MESSAGE);
-				continue;
-			}
-
-			int num_msg = atoi(line[1]);
-			struct mail_item* mail = get_mail_item(m_list, num_msg - 1);
-			if (!mail) {
-				send_formatted(fd, "%s %s\r\n", ERR, RETR_NOT_FOUND_MESSAGE);
-				continue;
-			}
-			send_formatted(fd, "%s %d %s\r\n", OK, get_mail_item_size(mail), RETR_OCTETS_MESSAGE);
-			display_mail(fd, mail);
-		}
-		//DELE
-		else if (!strcasecmp(line[0], DELE)) {
-			dlog("server: received DELE command\n");
-            struct mail_item* mail;
-            if (!authenticated) {
-				send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-				continue;
-			}
-			if (argcount != 1 || !line[1]) {
-				send_formatted(fd, "%s %s\r\n", ERR, BAD_FORMAT_MESSAGE);
-				continue;
-			}
-			//checking msg validity
-			if (!is_valid_int(line[1])) {
-				send_formatted(fd, "%s %s\r\n", ERR, DELE_INVALID_MESSAGE);
-				continue;
-			}
-			int num_msg = atoi(line[1]);
-
-			mail = get_mail_item(m_list, num_msg - 1);
-			if (mail != NULL) {
-				mark_mail_item_deleted(mail);
-				//mail_count = get_mail_count(m_list, 0);
-				send_formatted(fd, "%s %s\r\n", OK, DELE_SUCCESS_MESSAGE);
-			}
-			else {
-				send_formatted(fd, "%s %s\r\n", ERR, DELE_NOT_FOUND_MESSAGE);
-			}
-		}
-		//RSET
-		else if (!strcasecmp(line[0], RSET)) {
-
-			dlog("server: received RSET command\n");
-			if (!authenticated) {
-				send_formatted(fd, "%s %s\r\n", ERR, NOT_AUTHENTICATED_MESSAGE);
-				continue;
-			} else {
-                unsigned int count = reset_mail_list_deleted_flag(m_list);
-                send_formatted(fd, "%s %d %s\r\n", OK, count, RSET_RESTORED_MESSAGE);
-            }
-		}
-		// Unknown commands
-		else {
-			dlog("server: received unknown command\n");
-			send_formatted(fd, "%s %s\r\n", ERR, UNKNOWN_COMMAND_MESSAGE);
-		}
 	}
+	set_send_buffering(fd, 0);
 	nb_destroy(nb);
-	destroy_mail_list(m_list);
-	if (username)
-		free(username);
+	// Messages marked as deleted are only removed when the session
+	// enters the UPDATE state with QUIT, not on autologout or when the
+	// connection is lost (RFC 1939)
+	if (!session.update)
+		reset_mail_list_deleted_flag(session.list);
+	destroy_mail_list(session.list);
+	unlock_user_mail(session.mailbox_lock);
+	arena_destroy(session.arena);
+	metrics_time(TIMER_SESSION, start);
 }
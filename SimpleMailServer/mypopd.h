@@ -0,0 +1,19 @@
+/* mypopd.h
+ * POP3 protocol handling, used by the mypopd server and, with the
+ * SMTP handling, by the combined mymaild server.
+ */
+
+#ifndef _MYPOPD_H_
+#define _MYPOPD_H_
+
+#include <stddef.h>
+
+// Memory budget of the mailbox metadata cache, changed with -c
+#define POP3_DEFAULT_CACHE_BUDGET (8 * 1024 * 1024)
+
+void pop3_init(size_t cache_budget);
+void pop3_set_timeout(unsigned int timeout_ms);
+const char *pop3_busy_reply(void);
+void pop3_handle_client(int fd);
+
+#endif
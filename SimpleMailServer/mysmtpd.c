@@ -1,20 +1,45 @@
+#include "mysmtpd.h"
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "admission.h"
+#include "handoff.h"
+#include "command.h"
+#include "reply.h"
+#include "arena.h"
+#include "bufpool.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <ctype.h>
 
 #define MAX_LINE_LENGTH 1024
 #define TEMP_FILE_NAME  "mail.XXXXXX.tmp"
+#define TEMP_FILE_SUFFIX ".tmp"
 #define TERMINATE_DATA  ".\r\n"
+#define ARENA_BLOCK_SIZE    (64 * 1024)
+#define DATA_BUFFER_SIZE    (32 * 1024)
+
+// Server timeouts: RFC 5321 section 4.5.3.2.7 asks the server to wait
+// at least 5 minutes for each command, and section 4.5.3.2.5 gives the
+// client 3 minutes to send each block of message data
+#define GREETING_TIMEOUT_MS     (5 * 60 * 1000)     // first command after the greeting
+#define COMMAND_TIMEOUT_MS      (5 * 60 * 1000)     // each later command
+#define DATA_BLOCK_TIMEOUT_MS   (3 * 60 * 1000)     // each wait for message data
 
 #define WELCOME_MESSAGE "Simple Mail Transfer Service Ready"
+#define LMTP_WELCOME_MESSAGE "Local Mail Transfer Service Ready"
 #define OK_MESSAGE      "OK"
 #define CLOSE_MESSAGE   "Service closing transmission channel"
+#define TIMEOUT_MESSAGE "Timeout exceeded, closing transmission channel"
+#define BUSY_MESSAGE    "Too many connections, try again later"
 
 #define HELO_GREET_MESSAGE          "greets"
 #define HELO_INVALID_ARGS_MESSAGE   "expected a single argument with a domain identifier"
@@ -27,6 +52,7 @@
 #define MAIL_INVALID_ARGS_MESSAGE   "expected a 'FROM:' and the sender's email address <FROM:<sender@domain.com>>"
 #define MAIL_SENDER_EXISTS_MESSAGE  "Sender already exists! Must reset (RSET) to change it"
 #define MAIL_NO_HELO_MESSAGE        "HELO/EHLO command was not called. Must call HELO/EHLO first"
+#define MAIL_NO_LHLO_MESSAGE        "LHLO command was not called. Must call LHLO first"
 
 #define RCPT_INVALID_ARGS_MESSAGE   "expected a 'TO:' and the recipient's email address <TO:<recipient@domain.com>>"
 #define RCPT_USER_NOT_FOUND_MESSAGE "Recipient is not a registered user in this server"
@@ -36,56 +62,194 @@
 #define DATA_READY_MESSAGE      "Ready to accept mail. End with '.' to end the message"
 #define DATA_SUCCESS_MESSAGE    "Mail accepted for delivery"
 #define DATA_FAILURE_MESSAGE    "Message denied"
+#define DATA_DELIVERED_MESSAGE  "Mail delivered to mailbox"
+#define DATA_NOT_STORED_MESSAGE "Could not store message in mailbox"
 
 #define USER_EXISTS_MESSAGE     "User found"
 #define USER_NOT_FOUND_MESSAGE  "User not found"
 
 #define INVALID_COMMAND_MESSAGE "is not a valid command"
 
-#define HELO "helo"
-#define EHLO "ehlo"
-#define NOOP "noop"
-#define QUIT "quit"
-#define VRFY "vrfy"
-#define MAIL "mail"
-#define RCPT "rcpt"
-#define DATA "data"
-#define RSET "rset"
-#define EXPN "expn"
-#define HELP "help"
-
-#define CODE_CONNECT    220
-#define CODE_CLOSE      221
-#define CODE_SUCCESS    250
-
-#define CODE_START_DATA_INPUT   354
-
-#define CODE_INVALID_COMMAND    500
-#define CODE_INVALID_ARGS       501
-#define CODE_COMMAND_NO_SUPPORT 502
-#define CODE_BAD_SEQUENCE       503
-#define CODE_GENERAL_FAILURE    550
-#define CODE_USER_NOT_LOCAL     551
-#define CODE_BAD_DATA_INPUT     554
+#define HELO CMD_KEY('h', 'e', 'l', 'o')
+#define EHLO CMD_KEY('e', 'h', 'l', 'o')
+#define LHLO CMD_KEY('l', 'h', 'l', 'o')
+#define NOOP CMD_KEY('n', 'o', 'o', 'p')
+#define QUIT CMD_KEY('q', 'u', 'i', 't')
+#define VRFY CMD_KEY('v', 'r', 'f', 'y')
+#define MAIL CMD_KEY('m', 'a', 'i', 'l')
+#define RCPT CMD_KEY('r', 'c', 'p', 't')
+#define DATA CMD_KEY('d', 'a', 't', 'a')
+#define RSET CMD_KEY('r', 's', 'e', 't')
+#define EXPN CMD_KEY('e', 'x', 'p', 'n')
+#define HELP CMD_KEY('h', 'e', 'l', 'p')
+
+// Session states, as bits for the command table
+#define STATE_CONNECTED     0x1     // HELO/EHLO not called yet
+#define STATE_READY         0x2     // no mail transaction started
+#define STATE_SENDER        0x4     // MAIL accepted, no recipient yet
+#define STATE_RECIPIENT     0x8     // at least one RCPT accepted
+#define ANY_STATE           (STATE_CONNECTED | STATE_READY | STATE_SENDER | STATE_RECIPIENT)
+
+// Reply codes are strings, so that constant replies are a single literal
+#define CODE_CONNECT    "220"
+#define CODE_CLOSE      "221"
+#define CODE_UNAVAILABLE "421"
+#define CODE_SUCCESS    "250"
+#define CODE_LOCAL_ERROR "451"
+
+#define CODE_START_DATA_INPUT   "354"
+
+#define CODE_INVALID_COMMAND    "500"
+#define CODE_INVALID_ARGS       "501"
+#define CODE_COMMAND_NO_SUPPORT "502"
+#define CODE_BAD_SEQUENCE       "503"
+#define CODE_GENERAL_FAILURE    "550"
+#define CODE_USER_NOT_LOCAL     "551"
+#define CODE_BAD_DATA_INPUT     "554"
 
 #define FROM_PREFIX     "FROM:"
 #define TO_PREFIX       "TO:"
 #define ADDRESS_START   '<'
 #define ADDRESS_END     '>'
 
-static void handle_client(int fd);
+struct smtp_session {
+    int fd;
+    unsigned int state;
+    net_buffer_t nb;
+    arena_t arena;              // transaction state, reset when it ends
+    struct user_list *users;
+    struct reply reply;
+    unsigned int recipients;    // accepted RCPT commands, in the list of users
+    int lmtp;                   // non-zero if the client speaks LMTP
+};
+
+// Replies that include the host name, formatted once at startup
+static struct reply_template welcome_reply;
+static struct reply_template lmtp_welcome_reply;
+static struct reply_template close_reply;
+static struct reply_template timeout_reply;
+static char busy_reply[128];
+
+// Limits for the greeting and command timeouts, changed with -t
+static unsigned int greeting_timeout_ms = GREETING_TIMEOUT_MS;
+static unsigned int command_timeout_ms = COMMAND_TIMEOUT_MS;
+static struct reply_template greet_prefix;
+static struct reply_template lhlo_prefix;
+
+/* Formats the replies that include the host name. Must be called
+*  before any client is handled.
+*/
+void smtp_init(void) {
+    struct utsname my_uname;
+    uname(&my_uname);
+    reply_template_init(&welcome_reply, "%s %s %s\r\n", CODE_CONNECT, my_uname.__domainname, WELCOME_MESSAGE);
+    reply_template_init(&lmtp_welcome_reply, "%s %s %s\r\n", CODE_CONNECT, my_uname.__domainname, LMTP_WELCOME_MESSAGE);
+    reply_template_init(&close_reply, "%s %s %s\r\n", CODE_CLOSE, my_uname.__domainname, CLOSE_MESSAGE);
+    reply_template_init(&timeout_reply, "%s %s %s\r\n", CODE_UNAVAILABLE, my_uname.__domainname, TIMEOUT_MESSAGE);
+    reply_template_init(&greet_prefix, "%s %s %s ", CODE_SUCCESS, my_uname.nodename, HELO_GREET_MESSAGE);
+    reply_template_init(&lhlo_prefix, "%s-%s %s ", CODE_SUCCESS, my_uname.nodename, HELO_GREET_MESSAGE);
+    snprintf(busy_reply, sizeof(busy_reply), "%s %s %s\r\n", CODE_UNAVAILABLE, my_uname.__domainname, BUSY_MESSAGE);
+}
+
+/* Changes the time allowed for each command, the first included.
+*
+*  Parameters: timeout_ms: Time in milliseconds; 0 waits forever.
+*/
+void smtp_set_timeout(unsigned int timeout_ms) {
+    greeting_timeout_ms = command_timeout_ms = timeout_ms;
+}
+
+/* Returns the reply sent to clients turned away by admission limits
+*  (see smtp_init).
+*/
+const char *smtp_busy_reply(void) {
+    return busy_reply;
+}
 
+#if !defined(NO_MAIN)
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    const char *log_file = NULL;
+    const char *admin_port = NULL;
+    const char *reload_socket = NULL;
+    void (*handler)(int) = smtp_handle_client;
+    struct admission_limits limits;
+    admission_default_limits(&limits);
+    int opt;
+    while ((opt = getopt(argc, argv, "zMm:l:va:t:L:r:")) != -1) {
+        switch (opt) {
+            case 'z':
+                // Compress messages as they are saved in the mail storage
+                set_mail_compression(1);
+                break;
+            case 'M':
+                // Speak LMTP (RFC 2033) for local delivery behind a
+                // front-end MTA
+                handler = lmtp_handle_client;
+                break;
+            case 'm':
+                // Memory cap, in bytes, of the network buffers of all
+                // connections together
+                bufpool_set_limit(strtoul(optarg, NULL, 10));
+                break;
+            case 'l':
+                log_file = optarg;
+                break;
+            case 'v':
+                log_set_level(LOG_LEVEL_DEBUG);
+                break;
+            case 'a':
+                admin_port = optarg;
+                break;
+            case 't':
+                // Time allowed for each command, the first included; 0
+                // waits forever
+                smtp_set_timeout(strtoul(optarg, NULL, 10) * 1000);
+                break;
+            case 'r':
+                // Unix socket used to hand the listening sockets over to a
+                // new instance started with the same path
+                reload_socket = optarg;
+                break;
+            case 'L':
+                // Admission limits, e.g., max=200,per_ip=8,commands=20/50
+                if (admission_parse_limits(optarg, &limits) < 0) {
+                    fprintf(stderr, "Invalid limits: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Invalid arguments. Expected: %s [-z] [-M] [-m buffer_bytes] [-l log_file] [-v] [-a admin_port] [-t timeout_seconds] [-L limits] [-r reload_socket] <port>\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        fprintf(stderr, "Invalid arguments. Expected: %s [-z] [-M] [-m buffer_bytes] [-l log_file] [-v] [-a admin_port] [-t timeout_seconds] [-L limits] [-r reload_socket] <port>\n", argv[0]);
         return 1;
     }
 
-    run_server(argv[1], handle_client);
+    if (log_init(log_file) < 0)
+        fprintf(stderr, "Could not start logging to %s, messages will not be logged\n", log_file ? log_file : "stderr");
+
+    if (metrics_init() < 0)
+        fprintf(stderr, "Could not share metrics between processes\n");
+    if (reload_socket && handoff_init(reload_socket) < 0)
+        fprintf(stderr, "Could not set up reload socket %s, reloads will not be possible\n", reload_socket);
+    if (admin_port && metrics_serve(admin_port) < 0)
+        fprintf(stderr, "Could not open admin port %s, metrics will not be exported\n", admin_port);
+
+    smtp_init();
+    limits.reject_reply = smtp_busy_reply();
+    admission_t admission = admission_create(&limits);
+    if (!admission)
+        fprintf(stderr, "Could not create admission table, connections will not be limited\n");
+
+    run_server(argv[optind], handler, admission);
 
     return 0;
 }
+#endif
 
 /* Counts the number of times a given character occurs in the string.
 *
@@ -96,8 +260,8 @@ int main(int argc, char *argv[]) {
 */
 static int get_char_count(const char character, const char* str) {
     int count = 0;
-    for (int i = 0; i < strlen(str); i++) {
-        if (str[i] == character)
+    for (; *str; str++) {
+        if (*str == character)
             count++;
     }
     return count;
@@ -141,35 +305,59 @@ static int contains_prefix(const char* str, const char* prefix) {
     return !strncasecmp(str, prefix, strlen(prefix));
 }
 
-/* Writes a file in a line-per-line basis from a connection.
+/* Writes all bytes of a buffer to a file, retrying after partial writes.
+*
+*  Parameters: file:    File descriptor to write to
+*              data:    Bytes to write
+*              len:     Number of bytes in data
+*/
+static void write_all(int file, const char* data, size_t len) {
+    while (len) {
+        ssize_t rv = write(file, data, len);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return;
+        data += rv;
+        len -= rv;
+    }
+}
+
+/* Writes a file in a line-per-line basis from a connection. Lines are
+*  gathered in a buffer taken from the transaction arena and written in
+*  large blocks.
 *
 *  Parameters: nb:          Net buffer to extract user input from
-*              filename:    Name of the file to write to. Generates file if it does not exist
+*              file:        File descriptor of the file to write to
+*              arena:       Arena the write buffer is allocated from
 *
 *  Returns: 1 if operation is successful
 *           0 if an error has occurred and the transaction did not complete
 */
-int handle_data(struct net_buffer* nb, const char* filename) {
-    FILE* tempfile = fopen(filename, "a");          // Open the temp file, makes it if it does not exist for some reason
+static int handle_data(struct net_buffer* nb, int file, arena_t arena) {
     int terminate_strlen = strlen(TERMINATE_DATA);  // Length of the terminating string, useful for later
+    char* buffer = arena_alloc(arena, DATA_BUFFER_SIZE);
+    size_t used = 0, total = 0;
 
+    TRACE1(data_begin, trace_session_id);
     while (1) {
         char recvbuf[MAX_LINE_LENGTH + 1];
         char* sneakyPointerMath = recvbuf;  // For now, set this to point at the beginning of the string
 
         int connectionState = nb_read_line(nb, recvbuf);
-        recvbuf[MAX_LINE_LENGTH] = NULL;    // Security reasons, the end of the array will always end with a NULL
+        recvbuf[MAX_LINE_LENGTH] = 0;       // Security reasons, the end of the array will always end with a NULL
         // in case it doesn't contain any
 
         // Connection interrupted, throw it out!
         if (connectionState <= 0) {
-            fclose(tempfile);
+            TRACE3(data_end, trace_session_id, total, 0);
             return 0;
         }
 
         // Case where line is exactly DATA_TERMINATE, ending the message
         if (!strncasecmp(recvbuf, TERMINATE_DATA, terminate_strlen)) {
-            fclose(tempfile);
+            write_all(file, buffer, used);
+            TRACE3(data_end, trace_session_id, total, 1);
             return 1;
         }
         // Case where the stem DATA_TERMINATE string (without CRLF) is appended as an extra
@@ -183,227 +371,352 @@ int handle_data(struct net_buffer* nb, const char* filename) {
         // (in normal cases, this is "." so advance by 1)
         // I love pointer arithmetic LMAO
 
-        fputs(sneakyPointerMath, tempfile);
+        size_t len = strlen(sneakyPointerMath);
+        if (used + len > DATA_BUFFER_SIZE) {
+            write_all(file, buffer, used);
+            used = 0;
+        }
+        memcpy(buffer + used, sneakyPointerMath, len);
+        used += len;
+        total += len;
     }
 }
 
-void handle_client(int fd) {
-    struct utsname my_uname;
-    struct user_list* users = create_user_list();
-    uname(&my_uname);
+/* Ends the current mail transaction, if any, forgetting the sender and
+*  recipients. Everything allocated for the transaction is released at
+*  once by resetting the arena.
+*
+*  Parameters: session: Session whose transaction is ended.
+*/
+static void reset_transaction(struct smtp_session* session) {
+    if (session->state == STATE_CONNECTED)
+        return;
+    session->users = create_user_list();
+    session->recipients = 0;
+    arena_reset(session->arena);
+    session->state = STATE_READY;
+}
 
-    int has_helo = 0;       // Did the client call HELO/EHLO at least once?
-    int has_sender = 0;     // Is sender present?
-    int has_recipient = 0;  // Is there a recipient?
+static int do_helo(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    // Bad arguments and syntax
+    if (cmd->argc != 1) {
+        log_debug("server: received EHLO/HELO command but failed due to bad arguments");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " HELO_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    if (session->state == STATE_CONNECTED)
+        session->state = STATE_READY;
+    reply_begin(&session->reply);
+    reply_append_template(&session->reply, &greet_prefix);
+    reply_append_str(&session->reply, cmd->argv[0]);
+    reply_send(session->fd, &session->reply);
+    return CMD_CONTINUE;
+}
 
-    // Welcome message
-    send_formatted(fd, "%d %s %s\r\n", CODE_CONNECT, my_uname.__domainname, WELCOME_MESSAGE);
+/* Greets an LMTP client. The reply is that of EHLO, with the
+*  extensions an LMTP server must support.
+*/
+static int do_lhlo(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    // Bad arguments and syntax
+    if (cmd->argc != 1) {
+        log_debug("server: received LHLO command but failed due to bad arguments");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " HELO_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    if (session->state == STATE_CONNECTED)
+        session->state = STATE_READY;
+    reply_begin(&session->reply);
+    reply_append_template(&session->reply, &lhlo_prefix);
+    reply_append_str(&session->reply, cmd->argv[0]);
+    reply_append_str(&session->reply, "\r\n" CODE_SUCCESS " PIPELINING");
+    reply_send(session->fd, &session->reply);
+    return CMD_CONTINUE;
+}
 
-    while (1) {
-        char recvbuf[MAX_LINE_LENGTH + 1];
-        net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
-        recvbuf[MAX_LINE_LENGTH] = NULL;    // Security reasons, the end of the array will always end with a NULL
-        // in case it doesn't contain any
+static int do_noop(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reply_literal(session->fd, CODE_SUCCESS " " OK_MESSAGE "\r\n");
+    return CMD_CONTINUE;
+}
 
-        /* TO BE COMPLETED BY THE STUDENT */
+static int do_quit(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reply_send_template(session->fd, &close_reply);
+    return CMD_CLOSE;
+}
 
-        int connectionState = nb_read_line(nb, recvbuf);
-        // Connection interrupted, throw it out!
-        if (connectionState <= 0) {
-            dlog("server: Connection interrupted. Aborting connection fd: %d", fd);
-            nb_destroy(nb);
-            break;
-        }
+static int do_vrfy(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    if (cmd->argc != 1) {
+        // Case where there are too many or too little args
+        log_debug("server: received VRFY command but failed to bad arguments");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " VRFY_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    if (is_valid_user(cmd->argv[0], NULL))
+        reply_literal(session->fd, CODE_SUCCESS " " USER_EXISTS_MESSAGE "\r\n");
+    else
+        reply_literal(session->fd, CODE_GENERAL_FAILURE " " USER_NOT_FOUND_MESSAGE "\r\n");
+    return CMD_CONTINUE;
+}
 
-        char raw_recvbuf[MAX_LINE_LENGTH + 1];    // raw buffer before being split; useful for debugging
-        strcpy(raw_recvbuf, recvbuf);
-        int argcount = get_char_count(' ', recvbuf);
-        char* line[argcount + 1];
-        split(recvbuf, line);
+static int do_mail(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    // Bad arguments and syntax
+    if (cmd->argc != 1 || !contains_prefix(cmd->argv[0], FROM_PREFIX)) {
+        log_debug("server: received MAIL command but failed due to bad arguments");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " MAIL_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    char address[MAX_LINE_LENGTH];
+    // Bad email address format, cannot extract the address
+    if (!parse_email_address(cmd->argv[0], address)) {
+        log_debug("server: received MAIL command but failed due to bad syntax");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " MAIL_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    session->state = STATE_SENDER;
+    reply_literal(session->fd, CODE_SUCCESS " " OK_MESSAGE "\r\n");
+    return CMD_CONTINUE;
+}
 
-        // Empty line, ignore!
-        if (line[0] == NULL) {
-            nb_destroy(nb);
-            continue;
-        }
+static int do_rcpt(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    // Bad arguments and syntax
+    if (cmd->argc != 1 || !contains_prefix(cmd->argv[0], TO_PREFIX)) {
+        log_debug("server: received RCPT command but failed due to bad arguments");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " RCPT_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    char address[MAX_LINE_LENGTH];
+    // Bad email address format, cannot extract the address
+    if (!parse_email_address(cmd->argv[0], address)) {
+        log_debug("server: received RCPT command but failed due to bad syntax");
+        reply_literal(session->fd, CODE_INVALID_ARGS " " INVALID_ARGS_MESSAGE " " RCPT_INVALID_ARGS_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    // This user is not local
+    if (!is_valid_user(address, NULL)) {
+        log_debug("server: received RCPT command but user does not exist");
+        reply_literal(session->fd, CODE_USER_NOT_LOCAL " " RCPT_USER_NOT_FOUND_MESSAGE "\r\n");
+        return CMD_CONTINUE;
+    }
+    add_user_to_arena_list(session->arena, &session->users, address);
+    session->recipients++;
+    session->state = STATE_RECIPIENT;
+    reply_literal(session->fd, CODE_SUCCESS " " OK_MESSAGE "\r\n");
+    return CMD_CONTINUE;
+}
 
-        // HELO/EHLO
-        if (!strcasecmp(line[0], EHLO) || !strcasecmp(line[0], HELO)) {
-            // Bad arguments and syntax
-            if (argcount != 1 || line[1] == NULL) {
-                dlog("server: received EHLO/HELO command but failed due to bad arguments. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, HELO_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-            dlog("server: received HELO/EHLO command. Line: %s", raw_recvbuf);
-            has_helo++;
-            send_formatted(fd, "%d %s %s %s\r\n", CODE_SUCCESS, my_uname.nodename, HELO_GREET_MESSAGE, line[1]);
-        }
+/* Delivers a received message to the mailbox of each recipient, and
+*  tells an LMTP client which deliveries succeeded, in the order of
+*  the RCPT commands.
+*
+*  Parameters: session: Session of the client.
+*              file:    Temporary file with the message.
+*/
+static void deliver_message(struct smtp_session* session, const char* file) {
+    if (!session->lmtp) {
+        save_user_mail(file, session->users, NULL);
+        reply_literal(session->fd, CODE_SUCCESS " " DATA_SUCCESS_MESSAGE "\r\n");
+        return;
+    }
 
-            // NOOP
-        else if (!strcasecmp(line[0], NOOP)) {
-            dlog("server: received NOOP command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d %s\r\n", CODE_SUCCESS, OK_MESSAGE);
-        }
+    int* delivered = arena_alloc(session->arena, session->recipients * sizeof(int));
+    save_user_mail(file, session->users, delivered);
+    // The list of users is in the reverse order of the RCPT commands
+    for (unsigned int i = session->recipients; i-- > 0; ) {
+        if (delivered[i])
+            reply_literal(session->fd, CODE_SUCCESS " " DATA_DELIVERED_MESSAGE "\r\n");
+        else
+            reply_literal(session->fd, CODE_LOCAL_ERROR " " DATA_NOT_STORED_MESSAGE "\r\n");
+    }
+}
 
-            // QUIT
-        else if (!strcasecmp(line[0], QUIT)) {
-            dlog("server: received QUIT command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d %s %s\r\n", CODE_CLOSE, my_uname.__domainname, CLOSE_MESSAGE);
-            nb_destroy(nb);
-            break;
-        }
+static int do_data(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reply_literal(session->fd, CODE_START_DATA_INPUT " " DATA_READY_MESSAGE "\r\n");
+
+    char tempfile[] = TEMP_FILE_NAME;
+    int file = mkstemps(tempfile, strlen(TEMP_FILE_SUFFIX));
+
+    // Each wait for data is limited, but not the message as a whole,
+    // so that large messages can be sent over slow links
+    nb_set_timeout(session->nb, DATA_BLOCK_TIMEOUT_MS);
+
+    // Connection interrupted and the nb is probably garbage now too,
+    // terminate connection!!
+    uint64_t start = metrics_now();
+    int completed = handle_data(session->nb, file, session->arena);
+    metrics_time(TIMER_HANDLE_DATA, start);
+    if (file >= 0)
+        close(file);
+    if (!completed) {
+        if (file >= 0)
+            unlink(tempfile);
+        if (nb_timed_out(session->nb)) {
+            log_info("server: DATA command timed out. Closing connection fd: %d", session->fd);
+            reply_send_template(session->fd, &timeout_reply);
+        } else
+            log_info("server: DATA command interrupted due to a network issue. Aborting connection fd: %d", session->fd);
+        return CMD_CLOSE;
+    }
 
-            // VRFY
-        else if (!strcasecmp(line[0], VRFY)) {
-            if (argcount != 1 || line[1] == NULL) {
-                // Case where there are too many or too little args or
-                // a null username
-                dlog("server: received VRFY command but failed to bad arguments. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, VRFY_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-
-            dlog("server: received VRFY command. Line: %s", raw_recvbuf);
-            // Defaults to the user not being found
-            int code = CODE_GENERAL_FAILURE;
-            char* msg = USER_NOT_FOUND_MESSAGE;
-            // If user is found, switch
-            if (is_valid_user(line[1], NULL)) {
-                code = CODE_SUCCESS;
-                msg = USER_EXISTS_MESSAGE;
-            }
-            send_formatted(fd, "%d %s\r\n", code, msg);
-        }
+    // The message was read but could not be stored
+    if (file < 0) {
+        log_error("server: DATA command failed, could not create a temporary file");
+        // An LMTP client expects a reply for each recipient
+        unsigned int replies = session->lmtp ? session->recipients : 1;
+        while (replies--)
+            reply_literal(session->fd, CODE_BAD_DATA_INPUT " " DATA_FAILURE_MESSAGE "\r\n");
+        reset_transaction(session);
+        return CMD_CONTINUE;
+    }
 
-            // MAIL
-        else if (!strcasecmp(line[0], MAIL)) {
-            // Bad arguments and syntax
-            if (argcount != 1 || line[1] == NULL || !contains_prefix(line[1], FROM_PREFIX)) {
-                dlog("server: received MAIL command but failed due to bad arguments. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, MAIL_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-            // Sender already exists and there can be no more than 1 sender
-            if (has_sender) {
-                dlog("server: received MAIL command but sender already exists. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s\r\n", CODE_BAD_SEQUENCE, MAIL_SENDER_EXISTS_MESSAGE);
-                continue;
-            }
-            // Client did not HELO/EHLO
-            if (!has_helo) {
-                dlog("server: received MAIL command but HELO/EHLO was not called. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s\r\n", CODE_BAD_SEQUENCE, MAIL_NO_HELO_MESSAGE);
-                continue;
-            }
-            char address[strlen(line[1])];
-            // Bad email address format, cannot extract the address
-            if (!parse_email_address(line[1], address)) {
-                dlog("server: received MAIL command but failed due to bad syntax. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, MAIL_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-
-            dlog("server: received MAIL command. Line: %s", raw_recvbuf);
-
-            has_sender++;
-            send_formatted(fd, "%d %s\r\n", CODE_SUCCESS, OK_MESSAGE);
-        }
+    // Success, mail sent with no problems
+    deliver_message(session, tempfile);
+    unlink(tempfile);
+    log_info("server: DATA command finished. Filename: %s", tempfile);
+    reset_transaction(session);
+    return CMD_CONTINUE;
+}
 
-            // RCPT
-        else if (!strcasecmp(line[0], RCPT)) {
-            // Bad arguments and syntax
-            if (argcount != 1 || line[1] == NULL || !contains_prefix(line[1], TO_PREFIX)) {
-                dlog("server: received RCPT command but failed due to bad arguments. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, RCPT_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-            // No sender set, MAIL was not called prior
-            if (!has_sender) {
-                dlog("server: received RCPT command but no sender address was provided. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s\r\n", CODE_BAD_SEQUENCE, RCPT_NO_SENDER_MESSAGE);
-                continue;
-            }
-
-            char address[strlen(line[1])];
-            // Bad email address format, cannot extract the address
-            if (!parse_email_address(line[1], address)) {
-                dlog("server: received RCPT command but failed due to bad syntax. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s %s\r\n", CODE_INVALID_ARGS, INVALID_ARGS_MESSAGE, RCPT_INVALID_ARGS_MESSAGE);
-                continue;
-            }
-            // This user is not local
-            if (!is_valid_user(address, NULL)) {
-                dlog("server: received RCPT command but user does not exist. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s\r\n", CODE_USER_NOT_LOCAL, RCPT_USER_NOT_FOUND_MESSAGE);
-                continue;
-            }
-
-            dlog("server: received RCPT command. Line: %s", raw_recvbuf);
-            add_user_to_list(&users, address);
-            has_recipient++;
-            send_formatted(fd, "%d %s\r\n", CODE_SUCCESS, OK_MESSAGE);
-        }
+static int do_rset(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reset_transaction(session);
+    reply_literal(session->fd, CODE_SUCCESS " " OK_MESSAGE "\r\n");
+    return CMD_CONTINUE;
+}
 
-            // DATA
-        else if (!strcasecmp(line[0], DATA)) {
-            // No recipient, throw it out!
-            if (!has_recipient) {
-                dlog("server: received DATA command but no sender address was provided. Line: %s", raw_recvbuf);
-                send_formatted(fd, "%d %s\r\n", CODE_BAD_SEQUENCE, DATA_NO_RCPT_MESSAGE);
-                continue;
-            }
-            dlog("server: received DATA command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d %s\r\n", CODE_START_DATA_INPUT, DATA_READY_MESSAGE);
-
-            char tempfile[] = TEMP_FILE_NAME;
-            mkstemp(tempfile);
-
-            int state = handle_data(nb, tempfile);
-
-            // Success, mail sent with no problems
-            if (state) {
-                save_user_mail(tempfile, users);
-                unlink(tempfile);
-                dlog("server: DATA command finished. Filename: %s", tempfile);
-                send_formatted(fd, "%d %s\r\n", CODE_SUCCESS, DATA_SUCCESS_MESSAGE);
-            }
-                // Connection interrupted and the nb is probably garbage now too
-                // destroy and terminate connection!!
-            else {
-                unlink(tempfile);
-                dlog("server: DATA command interrupted due to a network issue. Aborting connection fd: %d", fd);
-                nb_destroy(nb);
-                break;
-            }
+// Unsupported commands EXPN and HELP
+static int do_unsupported(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reply_begin(&session->reply);
+    reply_append_str(&session->reply, CODE_COMMAND_NO_SUPPORT " \"");
+    reply_append_str(&session->reply, cmd->verb);
+    reply_append_str(&session->reply, "\" " UNSUPPORTED_COMMAND_MESSAGE);
+    reply_send(session->fd, &session->reply);
+    return CMD_CONTINUE;
+}
 
-        }
-            // RSET
-        else if (!strcasecmp(line[0], RSET)) {
-            has_sender = 0;
-            has_recipient = 0;
+static int do_unknown(void* arg, struct command* cmd) {
+    struct smtp_session* session = arg;
+    reply_begin(&session->reply);
+    reply_append_str(&session->reply, CODE_INVALID_COMMAND " \"");
+    reply_append_str(&session->reply, cmd->verb);
+    reply_append_str(&session->reply, "\" " INVALID_COMMAND_MESSAGE);
+    reply_send(session->fd, &session->reply);
+    return CMD_CONTINUE;
+}
 
-            destroy_user_list(users);
-            users = create_user_list();
+static int do_denied(void* arg, const struct command_handler* handler, struct command* cmd) {
+    struct smtp_session* session = arg;
+    const char* message = handler->denied;
+    // MAIL is refused both before HELO/EHLO and during a transaction
+    if (handler->key == MAIL && session->state == STATE_CONNECTED)
+        message = session->lmtp ? MAIL_NO_LHLO_MESSAGE : MAIL_NO_HELO_MESSAGE;
+    log_debug("server: received %s command in the wrong state", cmd->verb);
+    reply_begin(&session->reply);
+    reply_append_str(&session->reply, CODE_BAD_SEQUENCE " ");
+    reply_append_str(&session->reply, message);
+    reply_send(session->fd, &session->reply);
+    return CMD_CONTINUE;
+}
 
-            dlog("server: received RSET command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d %s\r\n", CODE_SUCCESS, OK_MESSAGE);
-        }
+static const struct command_handler smtp_handlers[] = {
+    { HELO, ANY_STATE,       do_helo,        NULL },
+    { EHLO, ANY_STATE,       do_helo,        NULL },
+    { MAIL, STATE_READY,     do_mail,        MAIL_SENDER_EXISTS_MESSAGE },
+    { RCPT, STATE_SENDER | STATE_RECIPIENT, do_rcpt, RCPT_NO_SENDER_MESSAGE },
+    { DATA, STATE_RECIPIENT, do_data,        DATA_NO_RCPT_MESSAGE },
+    { RSET, ANY_STATE,       do_rset,        NULL },
+    { NOOP, ANY_STATE,       do_noop,        NULL },
+    { QUIT, ANY_STATE,       do_quit,        NULL },
+    { VRFY, ANY_STATE,       do_vrfy,        NULL },
+    { EXPN, ANY_STATE,       do_unsupported, NULL },
+    { HELP, ANY_STATE,       do_unsupported, NULL },
+};
+
+static const struct command_table smtp_commands = {
+    smtp_handlers, sizeof(smtp_handlers) / sizeof(smtp_handlers[0]), do_unknown, do_denied
+};
+
+// LMTP is SMTP with LHLO in place of HELO/EHLO (RFC 2033)
+static const struct command_handler lmtp_handlers[] = {
+    { LHLO, ANY_STATE,       do_lhlo,        NULL },
+    { MAIL, STATE_READY,     do_mail,        MAIL_SENDER_EXISTS_MESSAGE },
+    { RCPT, STATE_SENDER | STATE_RECIPIENT, do_rcpt, RCPT_NO_SENDER_MESSAGE },
+    { DATA, STATE_RECIPIENT, do_data,        DATA_NO_RCPT_MESSAGE },
+    { RSET, ANY_STATE,       do_rset,        NULL },
+    { NOOP, ANY_STATE,       do_noop,        NULL },
+    { QUIT, ANY_STATE,       do_quit,        NULL },
+    { VRFY, ANY_STATE,       do_vrfy,        NULL },
+    { EXPN, ANY_STATE,       do_unsupported, NULL },
+    { HELP, ANY_STATE,       do_unsupported, NULL },
+};
+
+static const struct command_table lmtp_commands = {
+    lmtp_handlers, sizeof(lmtp_handlers) / sizeof(lmtp_handlers[0]), do_unknown, do_denied
+};
+
+/* Handles a client connection until it is closed, in SMTP or LMTP.
+*
+*  Parameters: fd:      Socket of the client.
+*              lmtp:    Non-zero if the client speaks LMTP.
+*/
+static void handle_client(int fd, int lmtp) {
+    char recvbuf[MAX_LINE_LENGTH + 1];
+    struct smtp_session session = { fd, STATE_CONNECTED, nb_create(fd, MAX_LINE_LENGTH),
+                                    arena_create(ARENA_BLOCK_SIZE), create_user_list() };
+    const struct command_table* commands = lmtp ? &lmtp_commands : &smtp_commands;
+    struct command cmd;
+    uint64_t start = metrics_now();
+    session.lmtp = lmtp;
 
-            // Unsupported commands EXPN and HELP
-        else if (!strcasecmp(line[0], EXPN) || !strcasecmp(line[0], HELP)) {
-            dlog("server: received unsupported command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d \"%s\" %s\r\n", CODE_COMMAND_NO_SUPPORT, line[0], UNSUPPORTED_COMMAND_MESSAGE);
-        }
+    // Welcome message
+    reply_send_template(fd, lmtp ? &lmtp_welcome_reply : &welcome_reply);
 
-            // Everything else
-        else {
-            dlog("server: received unknown command. Line: %s", raw_recvbuf);
-            send_formatted(fd, "%d \"%s\" %s\r\n", CODE_INVALID_COMMAND, line[0], INVALID_COMMAND_MESSAGE);
+    while (1) {
+        nb_set_timeout(session.nb, session.state == STATE_CONNECTED ? greeting_timeout_ms : command_timeout_ms);
+        int connectionState = nb_read_line(session.nb, recvbuf);
+        // The client was silent for too long
+        if (connectionState < 0 && nb_timed_out(session.nb)) {
+            log_info("server: Connection timed out. Closing connection fd: %d", fd);
+            reply_send_template(fd, &timeout_reply);
+            break;
+        }
+        // Connection interrupted, throw it out!
+        if (connectionState <= 0) {
+            log_info("server: Connection interrupted. Aborting connection fd: %d", fd);
+            if (connectionState < 0)
+                metrics_add(COUNTER_NETWORK_ERRORS, 1);
+            break;
         }
 
-        nb_destroy(nb);
+        // Empty line, ignore!
+        if (!cmd_parse(recvbuf, &cmd))
+            continue;
+
+        log_debug("server: received %s command", cmd.verb);
+        if (cmd_dispatch(commands, &session, session.state, &cmd) == CMD_CLOSE)
+            break;
     }
 
-    destroy_user_list(users);
-}
\ No newline at end of file
+    nb_destroy(session.nb);
+    arena_destroy(session.arena);
+    metrics_time(TIMER_SESSION, start);
+}
+
+void smtp_handle_client(int fd) {
+    handle_client(fd, 0);
+}
+
+/* Handles a client that delivers mail with LMTP, e.g., a front-end
+*  MTA. Messages are stored directly, and each recipient gets its own
+*  reply after DATA.
+*/
+void lmtp_handle_client(int fd) {
+    handle_client(fd, 1);
+}
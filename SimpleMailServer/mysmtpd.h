@@ -0,0 +1,15 @@
+/* mysmtpd.h
+ * SMTP and LMTP protocol handling, used by the mysmtpd server and, with the
+ * POP3 handling, by the combined mymaild server.
+ */
+
+#ifndef _MYSMTPD_H_
+#define _MYSMTPD_H_
+
+void smtp_init(void);
+void smtp_set_timeout(unsigned int timeout_ms);
+const char *smtp_busy_reply(void);
+void smtp_handle_client(int fd);
+void lmtp_handle_client(int fd);
+
+#endif
@@ -3,26 +3,46 @@
  * file descriptor based on a stdio-style buffer.
  * Author  : Jonatan Schroeder
  * Modified: Nov 6, 2021
+ *
+ * The buffer memory is borrowed from the shared buffer pool only while
+ * received data is waiting to be read, so idle connections hold none.
+ *
+ * Waiting for data is bounded by a timer on the process's timer wheel,
+ * re-armed for each wait (see nb_set_timeout). Other timers, such as
+ * an overall deadline, can end the connection with nb_expire; timers
+ * expire while a read is waiting. A connection that timed out returns
+ * -1 from every read, with errno set to ETIMEDOUT.
  */
 
 #include "netbuffer.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "timerwheel.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
 
 struct net_buffer {
     int    fd;
     size_t max_bytes;
     size_t avail_data;
-    // Buffer set as size zero, but since it's the last member of the
-    // struct, it is possible to malloc additional memory after this
-    // struct to be used as part of the buffer (e.g., nb->buf[5] will
-    // read from a location 5 bytes ahead of the end of the buffer).
-    char   buf[0];
+    // Borrowed from the buffer pool while avail_data is not zero, NULL
+    // otherwise
+    char  *buf;
+    unsigned int timeout_ms;    // limit for each wait, 0 for none
+    int    timed_out;
+    struct timer timer;
 };
 
+static void wait_expired(void *nb) {
+    nb_expire(nb);
+}
+
 /** Creates a new buffer for handling data read from a socket.
  *
  *  Note: The maximum buffer size passed as parameter will also
@@ -40,10 +60,14 @@ struct net_buffer {
  */
 net_buffer_t nb_create(int fd, size_t max_buffer_size) {
 
-    net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+    net_buffer_t nb = malloc(sizeof(struct net_buffer));
     nb->fd          = fd;
     nb->max_bytes   = max_buffer_size;
     nb->avail_data  = 0;
+    nb->buf         = NULL;
+    nb->timeout_ms  = 0;
+    nb->timed_out   = 0;
+    timer_init(&nb->timer, wait_expired, nb);
     return nb;
 }
 
@@ -52,9 +76,104 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
  *  Parameters: nb: buffer object to be freed.
  */
 void nb_destroy(net_buffer_t nb) {
+    timer_cancel(&nb->timer);
+    bufpool_put(nb->buf, nb->max_bytes);
     free(nb);
 }
 
+/** Internal function that returns the buffer to the pool once all
+ *  received data has been read.
+ */
+static void nb_consumed(net_buffer_t nb) {
+    if (!nb->avail_data && nb->buf) {
+        bufpool_put(nb->buf, nb->max_bytes);
+        nb->buf = NULL;
+    }
+}
+
+/** Sets the time limit for each wait for data from the client, e.g.,
+ *  for the next command. The limit applies to waits started after the
+ *  call.
+ *
+ *  Parameters: nb: buffer object of the connection.
+ *              timeout_ms: Limit in milliseconds, or 0 for no limit.
+ */
+void nb_set_timeout(net_buffer_t nb, unsigned int timeout_ms) {
+    nb->timeout_ms = timeout_ms;
+}
+
+/** Marks a connection as timed out: the current wait for data, if
+ *  any, and all later reads fail. Called when the wait timer expires,
+ *  and by other timers that end a connection.
+ */
+void nb_expire(net_buffer_t nb) {
+    if (!nb->timed_out)
+        metrics_add(COUNTER_TIMEOUTS, 1);
+    nb->timed_out = 1;
+}
+
+/** Returns non-zero if a connection timed out, so that a failed read
+ *  can be told apart from a network error.
+ */
+int nb_timed_out(net_buffer_t nb) {
+    return nb->timed_out;
+}
+
+/** Internal function that waits until the socket is readable, running
+ *  the timers of the process as they expire.
+ *
+ *  Returns: 0 if the socket is readable (or poll failed, which recv
+ *           will report), -1 if the connection timed out.
+ */
+static int nb_wait(net_buffer_t nb) {
+
+    struct pollfd pfd = { nb->fd, POLLIN, 0 };
+    if (nb->timeout_ms && !nb->timed_out)
+        timer_arm(&nb->timer, nb->timeout_ms);
+    while (!nb->timed_out) {
+        int rv = poll(&pfd, 1, timer_next_ms());
+        timer_run();
+        if (rv > 0 || (rv < 0 && errno != EINTR))
+            break;
+    }
+    timer_cancel(&nb->timer);
+    if (nb->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/** Internal function that receives data into the buffer. If no data
+ *  is buffered, waits for the socket to become readable before
+ *  borrowing a buffer from the pool, so that a connection waiting for
+ *  its client does not hold one. The wait is also needed whenever a
+ *  timer could end it.
+ *
+ *  Returns: The value returned by recv, or -1 if the connection timed
+ *           out.
+ */
+static int nb_receive(net_buffer_t nb) {
+
+    if ((!nb->buf || nb->timeout_ms || timer_next_ms() >= 0 || nb->timed_out) && nb_wait(nb) < 0) {
+        nb_consumed(nb);
+        return -1;
+    }
+    if (!nb->buf) {
+        nb->buf = bufpool_get(nb->max_bytes);
+        if (!nb->buf)
+            return -1;
+    }
+    int rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+    if (rv <= 0) {
+        nb_consumed(nb);
+    } else {
+        metrics_add(COUNTER_BYTES_IN, rv);
+        admission_charge_bytes(rv);
+    }
+    return rv;
+}
+
 /** Reads a single line from the socket/buffer (i.e., a string ending
  *  in LF, aka "\n"). If the socket returns more than one line in a
  *  single call to recv, returns a single line and caches the
@@ -92,13 +211,15 @@ int nb_read_line(net_buffer_t nb, char out[]) {
 
 	// Check if the buffer has space for more data to be received
 	if (nb->avail_data < nb->max_bytes) {
-	    rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+	    rv = nb_receive(nb);
 	    // If recv returns an error, return the same error.
 	    if (rv < 0)
 		return rv;
 	    // If recv returns 0 (i.e., end of data), return whatever is
 	    // available in the buffer.
 	    if (rv == 0) {
+		if (!nb->avail_data)
+		    return 0;
 		eos = nb->buf + nb->avail_data - 1;
 		break;
 	    }
@@ -119,6 +240,7 @@ int nb_read_line(net_buffer_t nb, char out[]) {
     // remaining data to the start of the buffer.
     if (nb->avail_data)
 	memmove(nb->buf, eos + 1, nb->avail_data);
+    nb_consumed(nb);
     return rv;
 }
 
@@ -130,7 +252,7 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
 
 	// Check if the buffer has space for more data to be received
 	if (nb->avail_data < nb->max_bytes) {
-	    rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+	    rv = nb_receive(nb);
 	    // If recv returns an error, return the same error.
 	    if (rv < 0)
 		return rv;
@@ -155,5 +277,19 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
     // remaining data to the start of the buffer.
     if (nb->avail_data)
 	memmove(nb->buf, &nb->buf[num], nb->avail_data);
+    nb_consumed(nb);
     return num;
 }
+
+/** Checks if a complete line was already received, i.e., if the next
+ *  call to nb_read_line can return without waiting for the socket.
+ *  Used to process pipelined commands before sending responses.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *
+ *  Returns: non-zero if a full line (or a full buffer) is available,
+ *           zero otherwise.
+ */
+int nb_has_line(net_buffer_t nb) {
+    return nb->buf && (nb->avail_data == nb->max_bytes || memchr(nb->buf, '\n', nb->avail_data) != NULL);
+}
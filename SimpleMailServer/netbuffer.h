@@ -15,4 +15,8 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size);
 void nb_destroy(net_buffer_t nb);
 int nb_read_line(net_buffer_t nb, char out[]);
 int nb_read_bytes(net_buffer_t nb, char out[], size_t num);
+int nb_has_line(net_buffer_t nb);
+void nb_set_timeout(net_buffer_t nb, unsigned int timeout_ms);
+void nb_expire(net_buffer_t nb);
+int nb_timed_out(net_buffer_t nb);
 #endif
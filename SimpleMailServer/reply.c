@@ -0,0 +1,91 @@
+/* reply.c
+ * Builds protocol replies without printf-style formatting or heap
+ * allocation.
+ */
+
+#define _GNU_SOURCE
+
+#include "reply.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+/** Formats a reply, or the fixed start of a reply, once. Meant to be
+ *  called at startup for replies that include host information.
+ *
+ *  Parameters: template: Receives the formatted text.
+ *              fmt: printf-like format of the text.
+ *              additional parameters based on string format.
+ */
+void reply_template_init(struct reply_template *template, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vasprintf(&template->text, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        template->text = "";
+        len = 0;
+    }
+    template->len = len;
+}
+
+/** Sends a template as a complete reply.
+ *
+ *  Returns: Same as send_all.
+ */
+int reply_send_template(int fd, const struct reply_template *template) {
+    return send_all(fd, template->text, template->len);
+}
+
+/** Starts building a new reply in a buffer.
+ */
+void reply_begin(struct reply *reply) {
+    reply->len = 0;
+}
+
+/** Appends text to a reply. Text that does not fit in the buffer is
+ *  dropped; room for the line terminator is always kept.
+ *
+ *  Parameters: reply: Reply being built.
+ *              text: Text to append.
+ *              len: Number of bytes in text.
+ */
+void reply_append(struct reply *reply, const char *text, size_t len) {
+    size_t room = REPLY_MAX_SIZE - 2 - reply->len;
+    if (len > room)
+        len = room;
+    memcpy(reply->data + reply->len, text, len);
+    reply->len += len;
+}
+
+/** Appends a null-terminated string to a reply.
+ */
+void reply_append_str(struct reply *reply, const char *text) {
+    reply_append(reply, text, strlen(text));
+}
+
+/** Appends the decimal representation of a number to a reply.
+ */
+void reply_append_uint(struct reply *reply, unsigned long long value) {
+    char digits[20];
+    reply_append(reply, digits, format_uint(digits, value) - digits);
+}
+
+/** Appends a preformatted template to a reply.
+ */
+void reply_append_template(struct reply *reply, const struct reply_template *template) {
+    reply_append(reply, template->text, template->len);
+}
+
+/** Ends a reply built with the functions above with CRLF and sends
+ *  it.
+ *
+ *  Returns: Same as send_all.
+ */
+int reply_send(int fd, struct reply *reply) {
+    memcpy(reply->data + reply->len, "\r\n", 2);
+    return send_all(fd, reply->data, reply->len + 2);
+}
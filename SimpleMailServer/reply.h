@@ -0,0 +1,39 @@
+/* reply.h
+ * Builds protocol replies without printf-style formatting or heap
+ * allocation. Constant replies are string literals, replies that
+ * depend on the host are formatted once at startup, and variable
+ * fields are appended to a per-connection buffer.
+ */
+
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <stddef.h>
+
+#define REPLY_MAX_SIZE 1280
+
+// Sends a reply that is a string literal, e.g. reply_literal(fd, "250 OK\r\n")
+#define reply_literal(fd, text) send_all((fd), (char *) (text), sizeof(text) - 1)
+
+struct reply {
+    size_t len;
+    char data[REPLY_MAX_SIZE];
+};
+
+struct reply_template {
+    size_t len;
+    char *text;
+};
+
+void reply_template_init(struct reply_template *template, const char *fmt, ...)
+  __attribute__ ((format(printf, 2, 3)));
+int reply_send_template(int fd, const struct reply_template *template);
+
+void reply_begin(struct reply *reply);
+void reply_append(struct reply *reply, const char *text, size_t len);
+void reply_append_str(struct reply *reply, const char *text);
+void reply_append_uint(struct reply *reply, unsigned long long value);
+void reply_append_template(struct reply *reply, const struct reply_template *template);
+int reply_send(int fd, struct reply *reply);
+
+#endif
@@ -13,9 +13,17 @@
  */
 
 #include "server.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "handoff.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -28,8 +36,27 @@
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
 
 #define BACKLOG 10     // how many pending connections queue will hold
+#define DRAIN_TIMEOUT_MS (2 * 60 * 1000)   // sessions left after a handoff
+#define REAP_INTERVAL_MS 1000
+#define SEND_BUFFER_SIZE 65536  // data kept while output is buffered
+
+// Output buffered for a connection, see set_send_buffering. The data
+// buffer is borrowed from the buffer pool only while output is waiting
+// to be sent.
+static struct {
+    int fd;
+    size_t used;
+    char *data;
+} send_buffer = { -1, 0, NULL };
+
+// Identifies the connection being handled, in logs and tracepoints:
+// the process ID of the listener and a count of accepted connections.
+uint64_t trace_session_id = 0;
+
 /**
  *  Split a line into individual parts separated by white space
  *
@@ -50,34 +77,103 @@ int split(char *buf, char *parts[]) {
     return i - 1;
 }
 
-int be_verbose = 1;
-/**
- * Print a log message to the standard error stream, if be_verbose is 1
- *
- * Parameters: fmt:     A printf-line formating string
- *
- *
- **/
-void dlog(const char *fmt, ...) {
-    va_list args;
-    if (be_verbose) {
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
-    }
-}
+// Connection handlers still running, so that they can be waited for
+// after the listening socket is handed off, with the connection each
+// was admitted for. Only the listening thread reaps them: signals may
+// be delivered to any thread of the process.
+struct child {
+    pid_t pid;
+    struct admission_slot slot;
+};
+
+static struct {
+    struct child *list;
+    size_t count;
+    size_t capacity;
+} children = { NULL, 0, 0 };
+
+// Listening sockets of all listeners, with room after them for the
+// reload socket, and the listener each socket belongs to
+static struct {
+    struct pollfd *fds;
+    const struct listener **owners;
+    int count;
+} sockets = { NULL, NULL, 0 };
 
-/** Signal handler used to destroy zombie children (forked) processes
- *  once they finish executing.
+/** Signal handler for SIGCHLD. Finished children are reaped by the
+ *  listening loop (see reap_children); the signal only interrupts its
+ *  wait, when delivered to that thread, so that they are reaped right
+ *  away.
  */
 static void sigchld_handler(int s) {
+}
+
+/** Destroys zombie children (forked) processes once they finish
+ *  executing, removes them from the list of running children and
+ *  releases their connections, even if they did not exit normally.
+ */
+static void reap_children(void) {
 
     // waitpid() might overwrite errno, so we save and restore it:
     int saved_errno = errno;
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (size_t i = 0; i < children.count; i++) {
+            if (children.list[i].pid == pid) {
+                admission_release(&children.list[i].slot);
+                children.list[i] = children.list[--children.count];
+                break;
+            }
+        }
+    }
     errno = saved_errno;
 }
 
+#if defined(DOFORK)
+/** Adds a connection handler to the list of running children.
+ *
+ *  Returns: 0 on success, -1 if the list cannot grow.
+ */
+static int add_child(pid_t pid, const struct admission_slot *slot) {
+    if (children.count == children.capacity) {
+        size_t capacity = children.capacity ? children.capacity * 2 : 16;
+        struct child *list = realloc(children.list, capacity * sizeof(struct child));
+        if (!list)
+            return -1;
+        children.list = list;
+        children.capacity = capacity;
+    }
+    children.list[children.count].pid = pid;
+    children.list[children.count++].slot = *slot;
+    return 0;
+}
+#endif
+
+/** Waits for the running connection handlers to finish, up to
+ *  DRAIN_TIMEOUT_MS, then terminates those left.
+ */
+static void drain_children(void) {
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reap_children();
+    log_info("server: draining %zu sessions", children.count);
+
+    while (children.count) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= DRAIN_TIMEOUT_MS)
+            break;
+        poll(NULL, 0, DRAIN_TIMEOUT_MS - elapsed < 100 ? DRAIN_TIMEOUT_MS - elapsed : 100);
+        reap_children();
+    }
+
+    if (children.count)
+        log_warn("server: terminating %zu sessions after the drain timeout", children.count);
+    for (size_t i = 0; i < children.count; i++)
+        kill(children.list[i].pid, SIGTERM);
+}
+
 /** Signal handler used to catch seg faults
  */
 static void sigsegv_handler(int s) {
@@ -108,44 +204,67 @@ static void *get_in_addr(struct sockaddr *sa) {
         return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Internal function that adds a listening socket to those polled by
+ *  run_servers. The reload socket, if any, is polled after them.
+ */
+static void add_socket(int fd, const struct listener *listener) {
+    struct pollfd *fds = realloc(sockets.fds, (sockets.count + 2) * sizeof(struct pollfd));
+    const struct listener **owners = realloc(sockets.owners, (sockets.count + 1) * sizeof(*owners));
+    if (fds)
+        sockets.fds = fds;
+    if (owners)
+        sockets.owners = owners;
+    if (!fds || !owners) {
+        perror("server: realloc");
+        exit(1);
+    }
+    sockets.fds[sockets.count] = (struct pollfd) { fd, POLLIN, 0 };
+    sockets.owners[sockets.count++] = listener;
+}
+
+/** Creates a server socket for every address of a listener (e.g., for
+ *  both the IPv4 and the IPv6 wildcard addresses), or takes it over
+ *  from the previous instance, ready to accept connections. Exits the
+ *  program if no socket can be created.
  *
- *  Parameters: port: String corresponding to the port number (or
- *                    name) where the server will listen for new
- *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *  Parameters: listener: Address and port to listen on.
  */
-void run_server(const char *port, void (*handler)(int)) {
-  
-    int sockfd; // fd used for listening connections
-    int new_fd; // fd used to transfer data to/from an accepted connection
+static void open_listener(const struct listener *listener) {
+
+    int sockfd;
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
     int yes = 1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
-  
+    int opened = 0;
+    char host[NI_MAXHOST];
+    char name[NI_MAXHOST + 64];
+
     memset(&hints, 0, sizeof hints);
-    hints.ai_family   = AF_UNSPEC;   // use IPv4 or IPv6, whichever is available
+    hints.ai_family   = AF_UNSPEC;   // use IPv4 and IPv6, whichever are available
     hints.ai_socktype = SOCK_STREAM; // create a stream (TCP) socket server
     hints.ai_flags    = AI_PASSIVE;  // use any available connection
   
     // Gets information about available socket types and protocols
-    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(listener->address, listener->port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
     }
   
-    // loop through all the results and bind to the first we can
+    // loop through all the results and bind to all we can
     for(p = servinfo; p != NULL; p = p->ai_next) {
+
+        // Sockets are named after the address they are bound to, so that
+        // the next instance finds them whatever order addresses come in
+        if (getnameinfo(p->ai_addr, p->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST))
+            continue;
+        snprintf(name, sizeof(name), "server:[%s]:%s", host, listener->port);
+        if ((sockfd = handoff_take(name)) >= 0) {
+            log_info("server: listening socket for [%s]:%s taken over", host, listener->port);
+            handoff_register(name, sockfd);
+            add_socket(sockfd, listener);
+            opened++;
+            continue;
+        }
     
         // create socket object
         if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
@@ -168,6 +287,13 @@ void run_server(const char *port, void (*handler)(int)) {
         exit(1);
     }
 #endif
+
+        // an IPv6 socket would otherwise take IPv4 connections too, and
+        // the IPv4 address of the same port could not be bound
+        if (p->ai_family == AF_INET6 &&
+            setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
+            perror("server: setsockopt IPV6_V6ONLY");
+        }
     
         // bind to the specified port number
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -176,24 +302,114 @@ void run_server(const char *port, void (*handler)(int)) {
             continue;
         }
     
-        // if the code reaches this point, the socket was properly created and bound
-        break;
+        // set up a queue of incoming connections to be received by the server
+        if (listen(sockfd, BACKLOG) == -1) {
+            perror("listen");
+            exit(1);
+        }
+
+        handoff_register(name, sockfd);
+        add_socket(sockfd, listener);
+        opened++;
     }
   
     // all done with this structure
     freeaddrinfo(servinfo);
   
-    // if p is null, the loop above could not create a socket for any available address
-    if (p == NULL)  {
+    // if nothing was opened, the loop above could not create a socket for any available address
+    if (!opened)  {
         fprintf(stderr, "server: failed to bind\n");
         exit(1);
     }
-  
-    // set up a queue of incoming connections to be received by the server
-    if (listen(sockfd, BACKLOG) == -1) {
-        perror("listen");
-        exit(1);
+}
+
+/** Internal function that accepts a connection on a listening socket.
+ *  A new forked process is created for the new client (if DOFORK is
+ *  defined), calling the handler of the listener for this client.
+ *  Clients over the admission limits of the listener get its reject
+ *  reply and are disconnected without starting a handler.
+ */
+static void accept_connection(int sockfd, const struct listener *listener) {
+
+    static uint32_t accepted = 0;
+    int new_fd; // fd used to transfer data to/from an accepted connection
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size = sizeof(their_addr);
+    struct admission_slot slot;
+    char s[INET6_ADDRSTRLEN];
+
+    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+    if (new_fd == -1) {
+        perror("accept");
+        return;
+    }
+    
+    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
+              s, sizeof(s));
+    metrics_add(COUNTER_CONNECTIONS, 1);
+    if (admission_admit(listener->admission, (struct sockaddr *) &their_addr, &slot) < 0) {
+        log_debug("server: rejected connection from %s", s);
+        admission_reject(listener->admission, new_fd);
+        return;
     }
+    trace_session_id = (uint64_t) getpid() << 32 | ++accepted;
+    log_info("server: got connection from %s on port %s, session %" PRIx64, s, listener->port, trace_session_id);
+    TRACE2(conn_accept, trace_session_id, new_fd);
+    
+    // Create a new process to handle the new client; parent process
+    // will wait for another client.
+#if defined(DOFORK)
+    pid_t pid = fork();
+    if (!pid) {
+        // this is the child process, which doesn't need the listeners, close
+        for (int i = 0; i < sockets.count; i++)
+            close(sockets.fds[i].fd);
+        handoff_close();
+#endif
+        catch_segv();
+        admission_attach(&slot);
+        metrics_add(COUNTER_ACTIVE_CONNECTIONS, 1);
+        listener->handler(new_fd);
+        metrics_add(COUNTER_ACTIVE_CONNECTIONS, -1);
+        TRACE2(conn_close, trace_session_id, new_fd);
+        close(new_fd);
+#if defined(DOFORK)
+        exit(0);
+    }
+    
+    // Parent proceeds from here. In parent, client socket is not needed.
+    // The connection is released when the child is reaped; if it cannot
+    // be tracked, it is released now, so that it is never leaked.
+    if (pid < 0 || add_child(pid, &slot) < 0)
+        admission_release(&slot);
+    close(new_fd);
+#else
+        admission_release(&slot);
+#endif
+}
+
+/** Creates server sockets for several listeners, listens for new
+ *  connections on all of them and accepts them, each with the handler
+ *  and admission limits of its listener (see accept_connection).
+ *
+ *  If a reload socket was set up (see handoff_init), the listening
+ *  sockets are taken from the previous instance when there is one, and
+ *  are handed to the next instance when it connects. This function
+ *  then stops accepting connections, waits for the sessions in
+ *  progress to finish and returns.
+ *
+ *  Parameters: listeners: Listeners to serve; they must remain valid
+ *                         while the server runs.
+ *              count: Number of listeners.
+ */
+void run_servers(const struct listener *listeners, int count) {
+  
+    struct sigaction sa;
+    int rv;
+
+    for (int i = 0; i < count; i++)
+        open_listener(&listeners[i]);
+    handoff_drop_unclaimed();
   
     // set up a signal handler to kill zombie forked processes when they exit
     sa.sa_handler = sigchld_handler;
@@ -204,40 +420,54 @@ void run_server(const char *port, void (*handler)(int)) {
         exit(1);
     }
   
-    dlog("server: waiting for connections...\n");
+    log_info("server: waiting for connections...");
   
     while(1) {
-        // wait for new client to connect
-        sin_size = sizeof(their_addr);
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (new_fd == -1) {
-            perror("accept");
+        // wait for new clients to connect, or for a new instance to
+        // take over; while handlers run, wake up now and then to reap
+        // those that finished, in case SIGCHLD went to another thread
+        struct pollfd *reload = &sockets.fds[sockets.count];
+        *reload = (struct pollfd) { handoff_fd(), POLLIN, 0 };
+        rv = poll(sockets.fds, sockets.count + 1, children.count ? REAP_INTERVAL_MS : -1);
+        reap_children();
+        if (rv <= 0) {
+            if (rv < 0 && errno != EINTR)
+                perror("poll");
             continue;
         }
-    
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-                  s, sizeof(s));
-        dlog("server: got connection from %s\n", s);
-    
-        // Create a new process to handle the new client; parent process
-        // will wait for another client.
-#if defined(DOFORK)
-        if (!fork()) {
-            // this is the child process
-            close(sockfd); // child doesn't need the listener, close
-#endif
-            catch_segv();
-            handler(new_fd);
-            close(new_fd);
-#if defined(DOFORK)
-            exit(0);
+        if ((reload->revents & POLLIN) && handoff_send() == 0) {
+            log_info("server: listening sockets handed off, no longer accepting");
+            for (int i = 0; i < sockets.count; i++)
+                close(sockets.fds[i].fd);
+            metrics_stop();
+            drain_children();
+            return;
+        }
+        for (int i = 0; i < sockets.count; i++) {
+            if (sockets.fds[i].revents & POLLIN)
+                accept_connection(sockets.fds[i].fd, sockets.owners[i]);
         }
-    
-        // Parent proceeds from here. In parent, client socket is not needed.
-        close(new_fd);
-#endif
     }
+}
 
+/** Creates a server socket at the specified port number, for every
+ *  local address, listens for new connections and accepts them (see
+ *  run_servers).
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) where the server will listen for new
+ *                    connections.
+ *              handler: Function to be called when a new connection
+ *                       is accepted. Will receive, as the only
+ *                       parameter, the file descriptor corresponding
+ *                       to the newly accepted connection.
+ *              admission: Admission table of the listener (see
+ *                         admission_create), or NULL to handle every
+ *                         client.
+ */
+void run_server(const char *port, void (*handler)(int), admission_t admission) {
+    struct listener listener = { NULL, port, handler, admission };
+    run_servers(&listener, 1);
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -259,6 +489,25 @@ void run_server(const char *port, void (*handler)(int)) {
  *           size. Otherwise, returns -1.
  */
 int send_all(int fd, char buf[], size_t size) {
+
+    if (fd == send_buffer.fd) {
+        // If the memory cap does not allow another buffer, the data is
+        // sent right away instead
+        if (!send_buffer.data)
+            send_buffer.data = bufpool_try_get(SEND_BUFFER_SIZE);
+        // Keep small writes for the next flush; larger ones go out
+        // right after the data already buffered
+        if (send_buffer.data && send_buffer.used + size <= SEND_BUFFER_SIZE) {
+            memcpy(send_buffer.data + send_buffer.used, buf, size);
+            send_buffer.used += size;
+            return size;
+        }
+        int buffered = send_buffer.data != NULL;
+        if (send_flush(fd) < 0)
+            return -1;
+        if (buffered && size <= SEND_BUFFER_SIZE)
+            return send_all(fd, buf, size);
+    }
   
     size_t rem = size;
     while (rem > 0) {
@@ -266,12 +515,124 @@ int send_all(int fd, char buf[], size_t size) {
         // If there was an error, interrupt sending and returns an error
         if (rv <= 0)
             return rv;
+        metrics_add(COUNTER_BYTES_OUT, rv);
         buf += rv;
         rem -= rv;
     }
     return size;
 }
 
+/** Sends any data buffered for a socket descriptor (see
+ *  set_send_buffering).
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *
+ *  Returns: 0 if all buffered data was sent, -1 otherwise. Data that
+ *           could not be sent is discarded.
+ */
+int send_flush(int fd) {
+
+    size_t size;
+    const char *data = send_pending(fd, &size);
+    int rv = 0;
+    if (data) {
+        send_buffer.fd = -1;
+        rv = send_all(fd, (char *) data, size);
+        send_buffer.fd = fd;
+    }
+    send_discard(fd);
+    return rv < 0 ? -1 : 0;
+}
+
+/** Returns the data buffered for a socket descriptor (see
+ *  set_send_buffering), so that it can be sent in the same call as
+ *  the data that follows it. The data stays buffered until
+ *  send_discard is called.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              size: Receives the number of bytes buffered.
+ *
+ *  Returns: Pointer to the buffered data, or NULL if there is none.
+ */
+const char *send_pending(int fd, size_t *size) {
+
+    if (fd != send_buffer.fd || !send_buffer.data || !send_buffer.used)
+        return NULL;
+    *size = send_buffer.used;
+    return send_buffer.data;
+}
+
+/** Drops the data buffered for a socket descriptor, after the caller
+ *  sent it (see send_pending).
+ *
+ *  Parameters: fd: Socket file descriptor.
+ */
+void send_discard(int fd) {
+
+    if (fd != send_buffer.fd || !send_buffer.data)
+        return;
+    send_buffer.used = 0;
+    bufpool_put(send_buffer.data, SEND_BUFFER_SIZE);
+    send_buffer.data = NULL;
+}
+
+/** Starts or stops buffering the output of a socket descriptor. While
+ *  buffering is enabled, data passed to send_all or send_formatted
+ *  is only sent when send_flush is called or the buffer fills up, so
+ *  that several responses can be sent together. Only one descriptor
+ *  is buffered at a time; stopping flushes the buffered data.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              enabled: non-zero to start buffering, zero to stop.
+ */
+void set_send_buffering(int fd, int enabled) {
+
+    if (!enabled) {
+        send_flush(fd);
+        if (fd == send_buffer.fd)
+            send_buffer.fd = -1;
+        return;
+    }
+    if (send_buffer.fd >= 0 && send_buffer.fd != fd)
+        set_send_buffering(send_buffer.fd, 0);
+    send_buffer.fd = fd;
+}
+
+/** Writes the decimal representation of an unsigned number, two
+ *  digits at a time. Used instead of printf-style formatting where
+ *  many numbers are sent, e.g., in message listings. No terminating
+ *  null byte is written.
+ *
+ *  Parameters: out: Buffer with space for at least 20 characters.
+ *              value: Number to be written.
+ *
+ *  Returns: Pointer to the position after the last digit written.
+ */
+char *format_uint(char *out, unsigned long long value) {
+
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, &pairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &pairs[value * 2], 2);
+    } else {
+        *--p = '0' + value;
+    }
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(out, p, len);
+    return out + len;
+}
+
 /**
  * return val rounded up to be a multiple of chunksize.
  */
@@ -12,21 +12,31 @@
 
 #include <stdio.h>
 
-void run_server(const char *port, void (*handler)(int));
+#include "admission.h"
+
+// An address to listen on and the handler of its connections
+struct listener {
+    const char *address;        // host name or numeric address, NULL for all
+    const char *port;
+    void (*handler)(int);
+    admission_t admission;      // NULL to handle every client
+};
+
+void run_server(const char *port, void (*handler)(int), admission_t admission);
+void run_servers(const struct listener *listeners, int count);
 
 int send_all(int fd, char buf[], size_t size);
+int send_flush(int fd);
+const char *send_pending(int fd, size_t *size);
+void send_discard(int fd);
+void set_send_buffering(int fd, int enabled);
+char *format_uint(char *out, unsigned long long value);
 
 // The __attribute__ in this function allows the compiler to provide
 // useful warnings when compiling the code.
 int send_formatted(int fd, const char *str, ...)
   __attribute__ ((format(printf, 2, 3)));
 
-// The __attribute__ in this function allows the compiler to provide
-// useful warnings when compiling the code.
-void dlog(const char *fmt, ...)
-  __attribute__ ((format(printf, 1, 2)));
-extern int be_verbose;
-
 extern int split(char *line, char *parts[]);
 
 #endif
@@ -0,0 +1,214 @@
+/* sha256.c
+ * SHA-256, HMAC-SHA256 and PBKDF2-HMAC-SHA256.
+ *
+ * PBKDF2 runs HMAC once per iteration on a 32-byte input. The inner
+ * and outer hashes of the key are computed once and copied for each
+ * iteration, so that an iteration costs two compressions instead of
+ * four.
+ */
+
+#include "sha256.h"
+
+#include <string.h>
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/** Internal function that processes one 64-byte block.
+ */
+static void compress(uint32_t state[8], const unsigned char block[SHA256_BLOCK_SIZE]) {
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      round_constants[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/** Starts a new hash.
+ */
+void sha256_init(struct sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+}
+
+/** Adds data to a hash.
+ *
+ *  Parameters: ctx: Hash being computed.
+ *              data: Bytes to add.
+ *              size: Number of bytes in data.
+ */
+void sha256_update(struct sha256 *ctx, const void *data, size_t size) {
+
+    const unsigned char *bytes = data;
+    size_t used = ctx->length % SHA256_BLOCK_SIZE;
+    ctx->length += size;
+
+    if (used) {
+        size_t fill = SHA256_BLOCK_SIZE - used;
+        if (size < fill) {
+            memcpy(ctx->block + used, bytes, size);
+            return;
+        }
+        memcpy(ctx->block + used, bytes, fill);
+        compress(ctx->state, ctx->block);
+        bytes += fill;
+        size -= fill;
+    }
+    for (; size >= SHA256_BLOCK_SIZE; bytes += SHA256_BLOCK_SIZE, size -= SHA256_BLOCK_SIZE)
+        compress(ctx->state, bytes);
+    memcpy(ctx->block, bytes, size);
+}
+
+/** Ends a hash.
+ *
+ *  Parameters: ctx: Hash being computed; it must be started again
+ *                   before being reused.
+ *              digest: Receives the hash.
+ */
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_SIZE]) {
+
+    uint64_t bits = ctx->length * 8;
+    size_t used = ctx->length % SHA256_BLOCK_SIZE;
+
+    ctx->block[used++] = 0x80;
+    if (used > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->block + used, 0, SHA256_BLOCK_SIZE - used);
+        compress(ctx->state, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+    for (int i = 0; i < 8; i++)
+        ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (8 * i);
+    compress(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+/** Starts a new message authentication code. A started context may be
+ *  copied to compute several codes with the same key.
+ *
+ *  Parameters: ctx: Code being computed.
+ *              key: Secret key.
+ *              key_size: Number of bytes in key.
+ */
+void hmac_sha256_init(struct hmac_sha256 *ctx, const void *key, size_t key_size) {
+
+    unsigned char pad[SHA256_BLOCK_SIZE] = { 0 };
+    if (key_size > SHA256_BLOCK_SIZE) {
+        sha256_init(&ctx->inner);
+        sha256_update(&ctx->inner, key, key_size);
+        sha256_final(&ctx->inner, pad);
+    } else {
+        memcpy(pad, key, key_size);
+    }
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, SHA256_BLOCK_SIZE);
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, SHA256_BLOCK_SIZE);
+    memset(pad, 0, sizeof(pad));
+}
+
+/** Adds data to a message authentication code.
+ */
+void hmac_sha256_update(struct hmac_sha256 *ctx, const void *data, size_t size) {
+    sha256_update(&ctx->inner, data, size);
+}
+
+/** Ends a message authentication code.
+ *
+ *  Parameters: ctx: Code being computed; it must be started again
+ *                   before being reused.
+ *              mac: Receives the code.
+ */
+void hmac_sha256_final(struct hmac_sha256 *ctx, unsigned char mac[SHA256_SIZE]) {
+    unsigned char inner[SHA256_SIZE];
+    sha256_final(&ctx->inner, inner);
+    sha256_update(&ctx->outer, inner, SHA256_SIZE);
+    sha256_final(&ctx->outer, mac);
+}
+
+/** Derives a key from a password with PBKDF2-HMAC-SHA256.
+ *
+ *  Parameters: password: Password to derive the key from.
+ *              password_size: Number of bytes in password.
+ *              salt: Salt of the key.
+ *              salt_size: Number of bytes in salt.
+ *              iterations: Number of iterations, at least 1.
+ *              key: Receives the key.
+ *              key_size: Number of bytes to derive.
+ */
+void pbkdf2_sha256(const void *password, size_t password_size, const void *salt, size_t salt_size,
+                   unsigned long iterations, unsigned char *key, size_t key_size) {
+
+    struct hmac_sha256 keyed, ctx;
+    hmac_sha256_init(&keyed, password, password_size);
+
+    for (uint32_t block = 1; key_size; block++) {
+        unsigned char u[SHA256_SIZE], t[SHA256_SIZE];
+        unsigned char counter[4] = { block >> 24, block >> 16, block >> 8, block };
+
+        ctx = keyed;
+        hmac_sha256_update(&ctx, salt, salt_size);
+        hmac_sha256_update(&ctx, counter, sizeof(counter));
+        hmac_sha256_final(&ctx, u);
+        memcpy(t, u, SHA256_SIZE);
+        for (unsigned long i = 1; i < iterations; i++) {
+            ctx = keyed;
+            hmac_sha256_update(&ctx, u, SHA256_SIZE);
+            hmac_sha256_final(&ctx, u);
+            for (int j = 0; j < SHA256_SIZE; j++)
+                t[j] ^= u[j];
+        }
+
+        size_t size = key_size < SHA256_SIZE ? key_size : SHA256_SIZE;
+        memcpy(key, t, size);
+        key += size;
+        key_size -= size;
+    }
+}
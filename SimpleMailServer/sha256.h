@@ -0,0 +1,37 @@
+/* sha256.h
+ * SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104) and PBKDF2-HMAC-SHA256
+ * (RFC 8018), self-contained, for password hashing.
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE       32
+#define SHA256_BLOCK_SIZE 64
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;                    // bytes hashed so far
+    unsigned char block[SHA256_BLOCK_SIZE];
+};
+
+struct hmac_sha256 {
+    struct sha256 inner;
+    struct sha256 outer;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t size);
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+void hmac_sha256_init(struct hmac_sha256 *ctx, const void *key, size_t key_size);
+void hmac_sha256_update(struct hmac_sha256 *ctx, const void *data, size_t size);
+void hmac_sha256_final(struct hmac_sha256 *ctx, unsigned char mac[SHA256_SIZE]);
+
+void pbkdf2_sha256(const void *password, size_t password_size, const void *salt, size_t salt_size,
+                   unsigned long iterations, unsigned char *key, size_t key_size);
+
+#endif
@@ -0,0 +1,241 @@
+/* timerwheel.c
+ * Hierarchical timer wheel.
+ *
+ * Time is counted in ticks of TICK_MS milliseconds. The wheel has
+ * LEVELS levels of SLOTS slots each, and a slot of level L covers
+ * SLOTS^L ticks. A timer is placed in the lowest level whose range
+ * reaches its expiry, so arming and cancelling a timer are a list
+ * insertion and removal whatever the number of timers. Whenever the
+ * lowest level wraps around, the timers in the next slot of the level
+ * above are moved down (cascaded), and so on up the levels, so each
+ * timer is moved at most LEVELS - 1 times. A bit map of the slots in
+ * use at each level gives the time of the next event without scanning
+ * the slots; callers sleep until then, e.g., in poll.
+ */
+
+#include "timerwheel.h"
+
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+
+#define TICK_MS   10
+#define SLOT_BITS 6
+#define SLOTS     (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define LEVELS    4
+// Later timers expire at the end of the wheel's range, about 46 hours
+#define MAX_TICKS (((uint64_t) 1 << (SLOT_BITS * LEVELS)) - 1)
+
+static struct {
+    int started;
+    uint64_t now;               // last tick processed
+    unsigned long armed;        // number of armed timers
+    uint64_t in_use[LEVELS];    // bit map of non-empty slots
+    struct timer slots[LEVELS][SLOTS];   // list heads
+} wheel;
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Internal function that sets up the wheel on first use.
+ */
+static void start_wheel(void) {
+    for (int level = 0; level < LEVELS; level++)
+        for (int slot = 0; slot < SLOTS; slot++)
+            wheel.slots[level][slot].next = wheel.slots[level][slot].prev = &wheel.slots[level][slot];
+    wheel.now = now_ms() / TICK_MS;
+    wheel.started = 1;
+}
+
+/** Internal function that adds an armed timer to the slot covering its
+ *  expiry, relative to the last tick processed.
+ */
+static void insert(struct timer *timer) {
+
+    if (timer->expires <= wheel.now)
+        timer->expires = wheel.now + 1;
+    if (timer->expires - wheel.now > MAX_TICKS)
+        timer->expires = wheel.now + MAX_TICKS;
+
+    uint64_t delta = timer->expires - wheel.now;
+    int level = 0;
+    while (delta >> (SLOT_BITS * (level + 1)))
+        level++;
+    int slot = (timer->expires >> (SLOT_BITS * level)) & SLOT_MASK;
+
+    struct timer *head = &wheel.slots[level][slot];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel.in_use[level] |= (uint64_t) 1 << slot;
+}
+
+/** Internal function that takes a timer out of its slot.
+ */
+static void unlink_timer(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    // An empty slot list points to its own head, which lives in the
+    // slots array; that gives the level and slot to clear
+    if (timer->next == timer->prev) {
+        struct timer *head = timer->next;
+        ptrdiff_t index = head - &wheel.slots[0][0];
+        if (index >= 0 && index < LEVELS * SLOTS)
+            wheel.in_use[index / SLOTS] &= ~((uint64_t) 1 << (index % SLOTS));
+    }
+    timer->next = timer->prev = NULL;
+}
+
+/** Prepares a timer to be armed. A timer must not be freed or
+ *  initialized again while armed.
+ *
+ *  Parameters: timer: Timer to initialize.
+ *              expire: Function called when the timer expires.
+ *              arg: Argument passed to expire.
+ */
+void timer_init(struct timer *timer, void (*expire)(void *arg), void *arg) {
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->expire = expire;
+    timer->arg = arg;
+}
+
+/** Arms a timer to expire after a delay, replacing any previous
+ *  expiry. The expiry is rounded up to the next tick of the wheel, so
+ *  timers never expire early.
+ *
+ *  Parameters: timer: Timer to arm.
+ *              timeout_ms: Delay in milliseconds.
+ */
+void timer_arm(struct timer *timer, unsigned int timeout_ms) {
+    if (!wheel.started)
+        start_wheel();
+    if (timer->next)
+        timer_cancel(timer);
+    timer->expires = (now_ms() + timeout_ms + TICK_MS - 1) / TICK_MS;
+    insert(timer);
+    wheel.armed++;
+}
+
+/** Disarms a timer, if armed.
+ */
+void timer_cancel(struct timer *timer) {
+    if (!timer->next)
+        return;
+    unlink_timer(timer);
+    wheel.armed--;
+}
+
+/** Returns non-zero if a timer is armed and has not expired yet.
+ */
+int timer_armed(const struct timer *timer) {
+    return timer->next != NULL;
+}
+
+/** Internal function that returns the distance, from 1 to SLOTS, from
+ *  a slot to the next slot in use after it, going round the level.
+ */
+static int next_slot(uint64_t in_use, int slot) {
+    uint64_t after = slot == SLOT_MASK ? 0 : in_use >> (slot + 1);
+    if (after)
+        return __builtin_ctzll(after) + 1;
+    return __builtin_ctzll(in_use) + SLOTS - slot;
+}
+
+/** Returns the time until the next timer expires or must be moved
+ *  down the wheel, which is how long a caller may wait before calling
+ *  timer_run.
+ *
+ *  Returns: Time in milliseconds (0 if timers are due), or -1 if no
+ *           timer is armed.
+ */
+int timer_next_ms(void) {
+
+    if (!wheel.armed)
+        return -1;
+
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < LEVELS; level++) {
+        if (!wheel.in_use[level])
+            continue;
+        int shift = SLOT_BITS * level;
+        int distance = next_slot(wheel.in_use[level], (wheel.now >> shift) & SLOT_MASK);
+        // Timers in higher levels wake the caller when they cascade
+        uint64_t tick = level ? ((wheel.now >> shift) + distance) << shift : wheel.now + distance;
+        if (tick < next)
+            next = tick;
+    }
+
+    uint64_t now = now_ms();
+    if (next * TICK_MS <= now)
+        return 0;
+    return next * TICK_MS - now < INT_MAX ? (int) (next * TICK_MS - now) : INT_MAX;
+}
+
+/** Internal function that moves the timers of the current slot of a
+ *  level down the wheel, then does the same for the level above if
+ *  this level wrapped around.
+ */
+static void cascade(int level) {
+
+    int shift = SLOT_BITS * level;
+    int slot = (wheel.now >> shift) & SLOT_MASK;
+    struct timer *head = &wheel.slots[level][slot];
+
+    // Detach the whole list first: timers may go back to this level
+    if (head->next != head) {
+        struct timer *timer = head->next;
+        head->prev->next = NULL;
+        head->next = head->prev = head;
+        wheel.in_use[level] &= ~((uint64_t) 1 << slot);
+        while (timer) {
+            struct timer *next = timer->next;
+            insert(timer);
+            timer = next;
+        }
+    }
+    if (!slot && level + 1 < LEVELS)
+        cascade(level + 1);
+}
+
+/** Processes the ticks elapsed since the last call: expires the timers
+ *  that are due, calling their expire functions in order of expiry,
+ *  and moves the other timers down the wheel as needed. Expire
+ *  functions may arm or cancel timers.
+ */
+void timer_run(void) {
+
+    if (!wheel.started)
+        return;
+    uint64_t target = now_ms() / TICK_MS;
+
+    while (wheel.now < target) {
+        if (!wheel.armed) {
+            wheel.now = target;
+            break;
+        }
+        // Nothing expires before the lowest level wraps around
+        if (!wheel.in_use[0] && (wheel.now | SLOT_MASK) < target) {
+            wheel.now |= SLOT_MASK;
+        }
+        wheel.now++;
+        int slot = wheel.now & SLOT_MASK;
+        if (!slot)
+            cascade(1);
+
+        struct timer *head = &wheel.slots[0][slot];
+        while (head->next != head) {
+            struct timer *timer = head->next;
+            unlink_timer(timer);
+            wheel.armed--;
+            timer->expire(timer->arg);
+        }
+    }
+}
@@ -0,0 +1,29 @@
+/* timerwheel.h
+ * Timeouts kept in a hierarchical timer wheel, with constant-time
+ * arming, cancelling and expiry. Timers are embedded in the objects
+ * they belong to; the wheel is private to each process and is not
+ * thread-safe.
+ */
+
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+
+struct timer {
+    // Private: links in the slot list, NULL when not armed
+    struct timer *next, *prev;
+    uint64_t expires;           // in ticks
+    void (*expire)(void *arg);
+    void *arg;
+};
+
+void timer_init(struct timer *timer, void (*expire)(void *arg), void *arg);
+void timer_arm(struct timer *timer, unsigned int timeout_ms);
+void timer_cancel(struct timer *timer);
+int timer_armed(const struct timer *timer);
+
+int timer_next_ms(void);
+void timer_run(void);
+
+#endif
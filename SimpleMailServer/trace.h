@@ -0,0 +1,90 @@
+/* trace.h
+ * Static tracepoints for perf, bpftrace and SystemTap, in the USDT
+ * format of <sys/sdt.h> but without depending on it.
+ *
+ * A probe compiles to a single nop. Its address and the location of
+ * its arguments (registers, stack slots or constants) are described in
+ * a .note.stapsdt ELF note, which tracing tools read to place a
+ * breakpoint on the nop while they are attached. When nobody traces,
+ * a probe costs the nop and keeping its arguments available, so
+ * arguments should be values already at hand.
+ *
+ * All probes belong to the provider "simplemail". Arguments are 64-bit
+ * signed integers; strings are passed as pointers. The session ID
+ * identifies the connection being handled by the process, or is 0 for
+ * background work.
+ *
+ *   conn_accept(session, fd)           conn_close(session, fd)
+ *   command_start(session, verb, key)  command_end(session, key, result)
+ *   data_begin(session)                data_end(session, bytes, completed)
+ *   mail_link(session, path, rv)       mail_unlink(session, path, rv)
+ *
+ * For example:
+ *   bpftrace -l 'usdt:./mysmtpd:*'
+ *   bpftrace -e 'usdt:./mypopd:simplemail:command_start { printf("%x %s\n", arg0, str(arg1)); }'
+ *   perf probe -x ./mysmtpd sdt_simplemail:data_end
+ *
+ * Building with -DNO_TRACE removes all probes.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Session of the connection being handled, set by run_server
+extern uint64_t trace_session_id;
+
+#if !defined(NO_TRACE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// The note layout is the one written by <sys/sdt.h>; the semaphore
+// address is 0, so probes are always armed and need no check.
+#define TRACE_PROBE_(name, args, ...)                                             \
+    __asm__ __volatile__ (                                                        \
+        "990: nop\n"                                                              \
+        ".pushsection .note.stapsdt,\"\",\"note\"\n"                              \
+        ".balign 4\n"                                                             \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                        \
+        "991: .asciz \"stapsdt\"\n"                                               \
+        "992: .balign 4\n"                                                        \
+        "993: .8byte 990b\n"                                                      \
+        ".8byte _.stapsdt.base\n"                                                 \
+        ".8byte 0\n"                                                              \
+        ".asciz \"simplemail\"\n"                                                 \
+        ".asciz \"" #name "\"\n"                                                  \
+        ".asciz \"" args "\"\n"                                                   \
+        "994: .balign 4\n"                                                        \
+        ".popsection\n"                                                           \
+        ".ifndef _.stapsdt.base\n"                                                \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"   \
+        ".weak _.stapsdt.base\n"                                                  \
+        ".hidden _.stapsdt.base\n"                                                \
+        "_.stapsdt.base: .space 1\n"                                              \
+        ".size _.stapsdt.base, 1\n"                                               \
+        ".popsection\n"                                                           \
+        ".endif\n"                                                                \
+        :: __VA_ARGS__)
+
+#define TRACE_ARG_(x) "nor" ((int64_t) (intptr_t) (x))
+
+#define TRACE0(name) TRACE_PROBE_(name, "")
+#define TRACE1(name, x0) \
+    TRACE_PROBE_(name, "-8@%[a0]", [a0] TRACE_ARG_(x0))
+#define TRACE2(name, x0, x1) \
+    TRACE_PROBE_(name, "-8@%[a0] -8@%[a1]", [a0] TRACE_ARG_(x0), [a1] TRACE_ARG_(x1))
+#define TRACE3(name, x0, x1, x2) \
+    TRACE_PROBE_(name, "-8@%[a0] -8@%[a1] -8@%[a2]", \
+                 [a0] TRACE_ARG_(x0), [a1] TRACE_ARG_(x1), [a2] TRACE_ARG_(x2))
+
+#else
+
+// Arguments are still referenced, so values computed only for the
+// probes do not cause warnings
+#define TRACE0(name) ((void) 0)
+#define TRACE1(name, x0) ((void) (x0))
+#define TRACE2(name, x0, x1) ((void) (x0), (void) (x1))
+#define TRACE3(name, x0, x1, x2) ((void) (x0), (void) (x1), (void) (x2))
+
+#endif
+
+#endif